@@ -1,30 +1,35 @@
-grammar Formula;
-
-main
-    : expr EOF
-    ;
-
-expr
-    : '(' expr ')'  # Parens
-    | (ADD | SUB) expr  # UnaryOp
-    | expr (MUL | DIV) expr  # BinaryOp
-    | expr (ADD | SUB) expr  # BinaryOp
-    | CELL  # Cell
-    | NUMBER  # Literal
-    ;
-
-// number literals cannot be signed, or else 1-2 would be lexed as [1] [-2]
-fragment INT: [-+]? UINT ;
-fragment UINT: [0-9]+ ;
-fragment EXPONENT: [eE] INT;
-NUMBER
-    : UINT EXPONENT?
-    | UINT? '.' UINT EXPONENT?
-    ;
-
-ADD: '+' ;
-SUB: '-' ;
-MUL: '*' ;
-DIV: '/' ;
-CELL: [A-Z]+[0-9]+ ;
-WS: [ \t\n\r]+ -> skip ;
+grammar Formula;
+
+main
+    : expr EOF
+    ;
+
+expr
+    : '(' expr ')'  # Parens
+    | (ADD | SUB) expr  # UnaryOp
+    | expr (MUL | DIV) expr  # BinaryOp
+    | expr (ADD | SUB) expr  # BinaryOp
+    | CELL  # Cell
+    | REF  # Ref
+    | NUMBER  # Literal
+    ;
+
+// number literals cannot be signed, or else 1-2 would be lexed as [1] [-2]
+fragment INT: [-+]? UINT ;
+fragment UINT: [0-9]+ ;
+fragment EXPONENT: [eE] INT;
+NUMBER
+    : UINT EXPONENT?
+    | UINT? '.' UINT EXPONENT?
+    ;
+
+ADD: '+' ;
+SUB: '-' ;
+MUL: '*' ;
+DIV: '/' ;
+// optional sheet name for a reference to another sheet of the workbook: Sheet2!A1
+CELL: (SHEET_NAME '!')? [A-Z]+[0-9]+ ;
+fragment SHEET_NAME: [A-Za-z_] [A-Za-z0-9_]* ;
+// reference to a deleted row or column
+REF: '#REF!' ;
+WS: [ \t\n\r]+ -> skip ;
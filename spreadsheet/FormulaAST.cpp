@@ -1,446 +1,662 @@
-#include "FormulaAST.h"
-
-#include "FormulaBaseListener.h"
-#include "FormulaLexer.h"
-#include "FormulaParser.h"
-
-#include <cassert>
-#include <cmath>
-#include <memory>
-#include <optional>
-#include <sstream>
-
-#include <iostream>
-
-namespace ASTImpl {
-
-enum ExprPrecedence {
-    EP_ADD,
-    EP_SUB,
-    EP_MUL,
-    EP_DIV,
-    EP_UNARY,
-    EP_ATOM,
-    EP_END,
-};
-
-
-enum PrecedenceRule {
-    PR_NONE = 0b00,                // never needed
-    PR_LEFT = 0b01,                // needed for a left child
-    PR_RIGHT = 0b10,               // needed for a right child
-    PR_BOTH = PR_LEFT | PR_RIGHT,  // needed for both children
-};
-
-
-constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
-    /* EP_ADD */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_SUB */ {PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
-    /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-};
-
-class Expr {
-public:
-    virtual ~Expr() = default;
-    virtual void Print(std::ostream& out) const = 0;
-    virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-    virtual double Evaluate(SheetInterface& sheet) const = 0;
-
-    // higher is tighter
-    virtual ExprPrecedence GetPrecedence() const = 0;
-
-    void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
-                      bool right_child = false) const {
-        auto precedence = GetPrecedence();
-        auto mask = right_child ? PR_RIGHT : PR_LEFT;
-        bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
-        if (parens_needed) {
-            out << '(';
-        }
-
-        DoPrintFormula(out, precedence);
-
-        if (parens_needed) {
-            out << ')';
-        }
-    }
-};
-
-namespace {
-class BinaryOpExpr final : public Expr {
-public:
-    enum Type : char {
-        Add = '+',
-        Subtract = '-',
-        Multiply = '*',
-        Divide = '/',
-    };
-
-public:
-    explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
-        : type_(type)
-        , lhs_(std::move(lhs))
-        , rhs_(std::move(rhs)) {
-    }
-
-    void Print(std::ostream& out) const override {
-        out << '(' << static_cast<char>(type_) << ' ';
-        lhs_->Print(out);
-        out << ' ';
-        rhs_->Print(out);
-        out << ')';
-    }
-
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        lhs_->PrintFormula(out, precedence);
-        out << static_cast<char>(type_);
-        rhs_->PrintFormula(out, precedence, /* right_child = */ true);
-    }
-
-    ExprPrecedence GetPrecedence() const override {
-        switch (type_) {
-            case Add:
-                return EP_ADD;
-            case Subtract:
-                return EP_SUB;
-            case Multiply:
-                return EP_MUL;
-            case Divide:
-                return EP_DIV;
-            default:
-                // have to do this because VC++ has a buggy warning
-                assert(false);
-                return static_cast<ExprPrecedence>(INT_MAX);
-        }
-    }
-
-    double Evaluate(SheetInterface& sheet) const override {
-        double result;
-        double r = rhs_->Evaluate(sheet);
-        double l = lhs_->Evaluate(sheet);
-        switch (type_) {
-            case Type::Add:
-                result = l + r;
-                break;
-            case Type::Subtract:
-                result = l - r;
-                break;
-            case Type::Multiply:
-                result = l * r;
-                break;
-            case Type::Divide:
-                result = l / r;
-                //
-                break;
-        }
-        if (!std::isfinite(result)) {
-            throw FormulaError(FormulaError::Category::Arithmetic);
-        }
-        return result;
-    }
-
-private:
-    Type type_;
-    std::unique_ptr<Expr> lhs_;
-    std::unique_ptr<Expr> rhs_;
-};
-
-class UnaryOpExpr final : public Expr {
-public:
-    enum Type : char {
-        UnaryPlus = '+',
-        UnaryMinus = '-',
-    };
-
-public:
-    explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
-        : type_(type)
-        , operand_(std::move(operand)) {
-    }
-
-    void Print(std::ostream& out) const override {
-        out << '(' << static_cast<char>(type_) << ' ';
-        operand_->Print(out);
-        out << ')';
-    }
-
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        out << static_cast<char>(type_);
-        operand_->PrintFormula(out, precedence);
-    }
-
-    ExprPrecedence GetPrecedence() const override {
-        return EP_UNARY;
-    }
-
-    double Evaluate(SheetInterface& sheet) const override {
-        double result = operand_->Evaluate(sheet);
-        return type_ == Type::UnaryMinus ? -result : result;
-    }
-
-private:
-    Type type_;
-    std::unique_ptr<Expr> operand_;
-};
-
-class CellExpr final : public Expr {
-public:
-    explicit CellExpr(const Position* cell)
-        : cell_(cell) {
-    }
-
-    void Print(std::ostream& out) const override {
-        if (!cell_->IsValid()) {
-            out << FormulaError::Category::Ref;
-        } else {
-            out << cell_->ToString();
-        }
-    }
-
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        Print(out);
-    }
-
-    ExprPrecedence GetPrecedence() const override {
-        return EP_ATOM;
-    }
-
-    double Evaluate(SheetInterface& sheet) const override {
-        if (cell_ != nullptr) {
-            try {
-                const auto* cell = sheet.GetCell(*cell_);
-                if (cell == nullptr) {
-                    return 0.;
-                }
-                CellValueVisitor ans;
-                std::visit(ans, cell->GetValue());
-                return ans.result;
-            } catch (InvalidPositionException&) {
-                throw FormulaException("1234");;
-            }
-        }
-        // реализуйте метод.
-        return 0.;
-    }
-
-private:
-    struct CellValueVisitor {
-        double result;
-        void operator()(const std::string& val) {
-            if (val.empty()) {
-                result = 0.;
-                return;
-            }
-            std::istringstream in(val);
-            in >> result;
-            if (!in) {
-                throw FormulaError(FormulaError::Category::Value);
-            }            
-        }
-        void operator()(const double& val) {
-            result = val;
-        }
-        void operator()(const FormulaError& val) {
-            throw val;
-        }
-    };
-    const Position* cell_;
-};
-
-class NumberExpr final : public Expr {
-public:
-    explicit NumberExpr(double value)
-        : value_(value) {
-    }
-
-    void Print(std::ostream& out) const override {
-        out << value_;
-    }
-
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        out << value_;
-    }
-
-    ExprPrecedence GetPrecedence() const override {
-        return EP_ATOM;
-    }
-
-    double Evaluate(SheetInterface&) const override {
-        return value_;
-    }
-
-private:
-    double value_;
-};
-
-class ParseASTListener final : public FormulaBaseListener {
-public:
-    std::unique_ptr<Expr> MoveRoot() {
-        assert(args_.size() == 1);
-        auto root = std::move(args_.front());
-        args_.clear();
-
-        return root;
-    }
-
-    std::forward_list<Position> MoveCells() {
-        return std::move(cells_);
-    }
-
-public:
-    void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
-        assert(args_.size() >= 1);
-
-        auto operand = std::move(args_.back());
-
-        UnaryOpExpr::Type type;
-        if (ctx->SUB()) {
-            type = UnaryOpExpr::UnaryMinus;
-        } else {
-            assert(ctx->ADD() != nullptr);
-            type = UnaryOpExpr::UnaryPlus;
-        }
-
-        auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
-        args_.back() = std::move(node);
-    }
-
-    void exitLiteral(FormulaParser::LiteralContext* ctx) override {
-        double value = 0;
-        auto valueStr = ctx->NUMBER()->getSymbol()->getText();
-        //std::cout << "lit"<<valueStr << std::endl;
-        std::istringstream in(valueStr);
-        in >> value;
-        if (!in) {
-            throw ParsingError("Invalid number: " + valueStr);
-        }
-
-        auto node = std::make_unique<NumberExpr>(value);
-        args_.push_back(std::move(node));
-    }
-
-    void exitCell(FormulaParser::CellContext* ctx) override {
-        auto value_str = ctx->CELL()->getSymbol()->getText();
-        //std::cout << "-" << value_str << std::endl;
-        auto value = Position::FromString(value_str);
-        if (!value.IsValid()) {
-            //std::cout << "inv" << std::endl;
-            throw FormulaException("Invalid position: " + value_str);
-        }
-
-        cells_.push_front(value);
-        auto node = std::make_unique<CellExpr>(&cells_.front());
-        args_.push_back(std::move(node));
-    }
-
-    void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
-        assert(args_.size() >= 2);
-
-        auto rhs = std::move(args_.back());
-        args_.pop_back();
-
-        auto lhs = std::move(args_.back());
-
-        BinaryOpExpr::Type type;
-        if (ctx->ADD()) {
-            type = BinaryOpExpr::Add;
-        } else if (ctx->SUB()) {
-            type = BinaryOpExpr::Subtract;
-        } else if (ctx->MUL()) {
-            type = BinaryOpExpr::Multiply;
-        } else {
-            assert(ctx->DIV() != nullptr);
-            type = BinaryOpExpr::Divide;
-        }
-
-        auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
-        args_.back() = std::move(node);
-    }
-
-    void visitErrorNode(antlr4::tree::ErrorNode* node) override {
-        //std::cout << "error node" << std::endl;
-        throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
-    }
-
-private:
-    std::vector<std::unique_ptr<Expr>> args_;
-    std::forward_list<Position> cells_;
-};
-
-class BailErrorListener : public antlr4::BaseErrorListener {
-public:
-    void syntaxError(antlr4::Recognizer* /* recognizer */, antlr4::Token* /* offendingSymbol */,
-                     size_t /* line */, size_t /* charPositionInLine */, const std::string& msg,
-                     std::exception_ptr /* e */
-                     ) override {
-        //std::cout << "listener error" << std::endl;
-        throw ParsingError("Error when lexing: " + msg);
-    }
-};
-
-} 
-} 
-
-FormulaAST ParseFormulaAST(std::istream& in) {
-    using namespace antlr4;
-
-    ANTLRInputStream input(in);
-
-    FormulaLexer lexer(&input);
-    ASTImpl::BailErrorListener error_listener;
-    lexer.removeErrorListeners();
-    lexer.addErrorListener(&error_listener);
-
-    CommonTokenStream tokens(&lexer);
-
-    FormulaParser parser(&tokens);
-    auto error_handler = std::make_shared<BailErrorStrategy>();
-    parser.setErrorHandler(error_handler);
-    parser.removeErrorListeners();
-
-    tree::ParseTree* tree = parser.main();
-    ASTImpl::ParseASTListener listener;
-    tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
-
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
-}
-
-FormulaAST ParseFormulaAST(const std::string& in_str) {
-    std::istringstream in(in_str);
-    try {
-        return ParseFormulaAST(in);
-    } catch (antlr4::ParseCancellationException&) {
-        throw FormulaException("parsing error");
-    } catch (ParsingError&) {
-        throw FormulaException("parsing error");
-    }
-}
-
-void FormulaAST::PrintCells(std::ostream& out) const {
-    for (auto cell : cells_) {
-        out << cell.ToString() << ' ';
-    }
-}
-
-void FormulaAST::Print(std::ostream& out) const {
-    root_expr_->Print(out);
-}
-
-void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
-}
-
-double FormulaAST::Execute(SheetInterface& sheet) const {
-    return root_expr_->Evaluate(sheet);
-}
-
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
-    : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
-    cells_.sort();  // to avoid sorting in GetReferencedCells
-}
-
-FormulaAST::~FormulaAST() = default;
+#include "FormulaAST.h"
+
+#include "FormulaBaseListener.h"
+#include "FormulaLexer.h"
+#include "FormulaParser.h"
+#include "profiler.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <memory>
+#include <optional>
+#include <sstream>
+
+#include <iostream>
+
+namespace ASTImpl {
+
+double GetCellOperand(SheetInterface& sheet, Position pos) {
+    if (!pos.IsValid()) {
+        // ссылка на удалённую строку или столбец (#REF!)
+        throw FormulaError(FormulaError::Category::Ref);
+    }
+    double number;
+    if (sheet.TryGetNumber(pos, number)) {
+        return number;
+    }
+    const CellInterface* cell = sheet.GetCell(pos);
+    if (cell == nullptr) {
+        return 0.;
+    }
+    const auto value = cell->GetValue();
+    if (const auto* result = std::get_if<double>(&value)) {
+        return *result;
+    }
+    if (const auto* error = std::get_if<FormulaError>(&value)) {
+        throw *error;
+    }
+    const auto& text = std::get<std::string>(value);
+    if (text.empty()) {
+        return 0.;
+    }
+    if (!ParseNumber(text, number)) {
+        throw FormulaError(FormulaError::Category::Value);
+    }
+    return number;
+}
+
+enum ExprPrecedence {
+    EP_ADD,
+    EP_SUB,
+    EP_MUL,
+    EP_DIV,
+    EP_UNARY,
+    EP_ATOM,
+    EP_END,
+};
+
+
+enum PrecedenceRule {
+    PR_NONE = 0b00,                // never needed
+    PR_LEFT = 0b01,                // needed for a left child
+    PR_RIGHT = 0b10,               // needed for a right child
+    PR_BOTH = PR_LEFT | PR_RIGHT,  // needed for both children
+};
+
+
+constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
+    /* EP_ADD */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_SUB */ {PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
+    /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+};
+
+class Expr {
+public:
+    virtual ~Expr() = default;
+    virtual void Print(std::ostream& out) const = 0;
+    virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
+    // inputs - операнды ссылок формулы (см. IndexInputs) или nullptr.
+    virtual double Evaluate(SheetInterface& sheet, const CellOperand* const* inputs) const = 0;
+    virtual void Compile(std::vector<FormulaInstruction>& code) const = 0;
+    // Запоминает для ссылок поддерева их номера в inputs (без повторов, по возрастанию).
+    virtual void IndexInputs(const std::vector<Position>& inputs) = 0;
+    // Копия поддерева; ссылки копии добавляются в cells и заменяются на map(pos).
+    virtual std::unique_ptr<Expr> MapCells(std::forward_list<Position>& cells,
+                                           const std::function<Position(Position)>& map) const = 0;
+    // Байты поддерева, включая сам узел.
+    virtual size_t GetMemoryUsage() const = 0;
+
+    // higher is tighter
+    virtual ExprPrecedence GetPrecedence() const = 0;
+
+    void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
+                      bool right_child = false) const {
+        auto precedence = GetPrecedence();
+        auto mask = right_child ? PR_RIGHT : PR_LEFT;
+        bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
+        if (parens_needed) {
+            out << '(';
+        }
+
+        DoPrintFormula(out, precedence);
+
+        if (parens_needed) {
+            out << ')';
+        }
+    }
+};
+
+namespace {
+class BinaryOpExpr final : public Expr {
+public:
+    enum Type : char {
+        Add = '+',
+        Subtract = '-',
+        Multiply = '*',
+        Divide = '/',
+    };
+
+public:
+    explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
+        : type_(type)
+        , lhs_(std::move(lhs))
+        , rhs_(std::move(rhs)) {
+    }
+
+    void Print(std::ostream& out) const override {
+        out << '(' << static_cast<char>(type_) << ' ';
+        lhs_->Print(out);
+        out << ' ';
+        rhs_->Print(out);
+        out << ')';
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+        lhs_->PrintFormula(out, precedence);
+        out << static_cast<char>(type_);
+        rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        switch (type_) {
+            case Add:
+                return EP_ADD;
+            case Subtract:
+                return EP_SUB;
+            case Multiply:
+                return EP_MUL;
+            case Divide:
+                return EP_DIV;
+            default:
+                // have to do this because VC++ has a buggy warning
+                assert(false);
+                return static_cast<ExprPrecedence>(INT_MAX);
+        }
+    }
+
+    double Evaluate(SheetInterface& sheet, const CellOperand* const* inputs) const override {
+        double result;
+        double r = rhs_->Evaluate(sheet, inputs);
+        double l = lhs_->Evaluate(sheet, inputs);
+        switch (type_) {
+            case Type::Add:
+                result = l + r;
+                break;
+            case Type::Subtract:
+                result = l - r;
+                break;
+            case Type::Multiply:
+                result = l * r;
+                break;
+            case Type::Divide:
+                result = l / r;
+                //
+                break;
+        }
+        if (!std::isfinite(result)) {
+            throw FormulaError(FormulaError::Category::Arithmetic);
+        }
+        return result;
+    }
+
+    void Compile(std::vector<FormulaInstruction>& code) const override {
+        lhs_->Compile(code);
+        rhs_->Compile(code);
+        FormulaInstruction instruction;
+        switch (type_) {
+            case Type::Add:
+                instruction.op = FormulaInstruction::Op::Add;
+                break;
+            case Type::Subtract:
+                instruction.op = FormulaInstruction::Op::Subtract;
+                break;
+            case Type::Multiply:
+                instruction.op = FormulaInstruction::Op::Multiply;
+                break;
+            case Type::Divide:
+                instruction.op = FormulaInstruction::Op::Divide;
+                break;
+        }
+        code.push_back(instruction);
+    }
+
+    void IndexInputs(const std::vector<Position>& inputs) override {
+        lhs_->IndexInputs(inputs);
+        rhs_->IndexInputs(inputs);
+    }
+
+    std::unique_ptr<Expr> MapCells(std::forward_list<Position>& cells,
+                                   const std::function<Position(Position)>& map) const override {
+        auto lhs = lhs_->MapCells(cells, map);
+        return std::make_unique<BinaryOpExpr>(type_, std::move(lhs), rhs_->MapCells(cells, map));
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this) + lhs_->GetMemoryUsage() + rhs_->GetMemoryUsage();
+    }
+
+private:
+    Type type_;
+    std::unique_ptr<Expr> lhs_;
+    std::unique_ptr<Expr> rhs_;
+};
+
+class UnaryOpExpr final : public Expr {
+public:
+    enum Type : char {
+        UnaryPlus = '+',
+        UnaryMinus = '-',
+    };
+
+public:
+    explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
+        : type_(type)
+        , operand_(std::move(operand)) {
+    }
+
+    void Print(std::ostream& out) const override {
+        out << '(' << static_cast<char>(type_) << ' ';
+        operand_->Print(out);
+        out << ')';
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+        out << static_cast<char>(type_);
+        operand_->PrintFormula(out, precedence);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_UNARY;
+    }
+
+    double Evaluate(SheetInterface& sheet, const CellOperand* const* inputs) const override {
+        double result = operand_->Evaluate(sheet, inputs);
+        return type_ == Type::UnaryMinus ? -result : result;
+    }
+
+    void Compile(std::vector<FormulaInstruction>& code) const override {
+        operand_->Compile(code);
+        FormulaInstruction instruction;
+        instruction.op = type_ == Type::UnaryMinus ? FormulaInstruction::Op::UnaryMinus
+                                                   : FormulaInstruction::Op::UnaryPlus;
+        code.push_back(instruction);
+    }
+
+    void IndexInputs(const std::vector<Position>& inputs) override {
+        operand_->IndexInputs(inputs);
+    }
+
+    std::unique_ptr<Expr> MapCells(std::forward_list<Position>& cells,
+                                   const std::function<Position(Position)>& map) const override {
+        return std::make_unique<UnaryOpExpr>(type_, operand_->MapCells(cells, map));
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this) + operand_->GetMemoryUsage();
+    }
+
+private:
+    Type type_;
+    std::unique_ptr<Expr> operand_;
+};
+
+class CellExpr final : public Expr {
+public:
+    explicit CellExpr(const Position* cell)
+        : cell_(cell) {
+    }
+
+    void Print(std::ostream& out) const override {
+        if (!cell_->IsValid()) {
+            out << FormulaError::Category::Ref;
+        } else {
+            char name[Position::MAX_NAME_LENGTH];
+            out.write(name, cell_->ToChars(name));
+        }
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        Print(out);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    double Evaluate(SheetInterface& sheet, const CellOperand* const* inputs) const override {
+        return GetCellOperand(sheet, *cell_, inputs != nullptr && input_ >= 0 ? inputs[input_] : nullptr);
+    }
+
+    void Compile(std::vector<FormulaInstruction>& code) const override {
+        FormulaInstruction instruction;
+        instruction.op = FormulaInstruction::Op::Cell;
+        instruction.cell = *cell_;
+        instruction.input = input_;
+        code.push_back(instruction);
+    }
+
+    void IndexInputs(const std::vector<Position>& inputs) override {
+        const auto it = std::lower_bound(inputs.begin(), inputs.end(), *cell_);
+        input_ = it != inputs.end() && *it == *cell_ ? static_cast<int>(it - inputs.begin()) : -1;
+    }
+
+    std::unique_ptr<Expr> MapCells(std::forward_list<Position>& cells,
+                                   const std::function<Position(Position)>& map) const override {
+        cells.push_front(cell_->IsValid() ? map(*cell_) : Position::NONE);
+        return std::make_unique<CellExpr>(&cells.front());
+    }
+
+    size_t GetMemoryUsage() const override {
+        // позиция лежит в списке cells формулы
+        return sizeof(*this);
+    }
+
+private:
+    const Position* cell_;
+    int input_ = -1;
+};
+
+// Ссылка на ячейку другого листа книги. В список cells формулы не входит:
+// граф зависимостей между листами ведёт книга (Workbook).
+class SheetCellExpr final : public Expr {
+public:
+    explicit SheetCellExpr(SheetPosition ref)
+        : ref_(std::move(ref)) {
+    }
+
+    void Print(std::ostream& out) const override {
+        char name[Position::MAX_NAME_LENGTH];
+        out << ref_.sheet << '!';
+        out.write(name, ref_.pos.ToChars(name));
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        Print(out);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    double Evaluate(SheetInterface& sheet, const CellOperand* const*) const override {
+        SheetInterface* other = sheet.FindSheet(ref_.sheet);
+        if (other == nullptr) {
+            throw FormulaError(FormulaError::Category::Ref);
+        }
+        return GetCellOperand(*other, ref_.pos);
+    }
+
+    void Compile(std::vector<FormulaInstruction>&) const override {
+        // не вызывается: формулы со ссылками на другие листы не компилируются
+        assert(false);
+    }
+
+    void IndexInputs(const std::vector<Position>&) override {
+    }
+
+    std::unique_ptr<Expr> MapCells(std::forward_list<Position>&,
+                                   const std::function<Position(Position)>&) const override {
+        return std::make_unique<SheetCellExpr>(ref_);
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this) + GetStringMemory(ref_.sheet);
+    }
+
+private:
+    SheetPosition ref_;
+};
+
+class NumberExpr final : public Expr {
+public:
+    explicit NumberExpr(double value)
+        : value_(value) {
+    }
+
+    void Print(std::ostream& out) const override {
+        PrintNumber(out, value_);
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        PrintNumber(out, value_);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    double Evaluate(SheetInterface&, const CellOperand* const*) const override {
+        return value_;
+    }
+
+    void IndexInputs(const std::vector<Position>&) override {
+    }
+
+    void Compile(std::vector<FormulaInstruction>& code) const override {
+        FormulaInstruction instruction;
+        instruction.op = FormulaInstruction::Op::Number;
+        instruction.number = value_;
+        code.push_back(instruction);
+    }
+
+    std::unique_ptr<Expr> MapCells(std::forward_list<Position>&,
+                                   const std::function<Position(Position)>&) const override {
+        return std::make_unique<NumberExpr>(value_);
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this);
+    }
+
+private:
+    double value_;
+};
+
+class ParseASTListener final : public FormulaBaseListener {
+public:
+    std::unique_ptr<Expr> MoveRoot() {
+        assert(args_.size() == 1);
+        auto root = std::move(args_.front());
+        args_.clear();
+
+        return root;
+    }
+
+    std::forward_list<Position> MoveCells() {
+        return std::move(cells_);
+    }
+
+    std::vector<SheetPosition> MoveSheetCells() {
+        return std::move(sheet_cells_);
+    }
+
+public:
+    void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
+        assert(args_.size() >= 1);
+
+        auto operand = std::move(args_.back());
+
+        UnaryOpExpr::Type type;
+        if (ctx->SUB()) {
+            type = UnaryOpExpr::UnaryMinus;
+        } else {
+            assert(ctx->ADD() != nullptr);
+            type = UnaryOpExpr::UnaryPlus;
+        }
+
+        auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
+        args_.back() = std::move(node);
+    }
+
+    void exitLiteral(FormulaParser::LiteralContext* ctx) override {
+        double value = 0;
+        auto valueStr = ctx->NUMBER()->getSymbol()->getText();
+        //std::cout << "lit"<<valueStr << std::endl;
+        std::istringstream in(valueStr);
+        in >> value;
+        if (!in) {
+            throw ParsingError("Invalid number: " + valueStr);
+        }
+
+        auto node = std::make_unique<NumberExpr>(value);
+        args_.push_back(std::move(node));
+    }
+
+    void exitCell(FormulaParser::CellContext* ctx) override {
+        auto value_str = ctx->CELL()->getSymbol()->getText();
+        //std::cout << "-" << value_str << std::endl;
+        const auto bang = value_str.find('!');
+        auto value = Position::FromString(bang == std::string::npos ? value_str : value_str.substr(bang + 1));
+        if (!value.IsValid()) {
+            //std::cout << "inv" << std::endl;
+            throw FormulaException("Invalid position: " + value_str);
+        }
+        if (bang != std::string::npos) {
+            SheetPosition ref {value_str.substr(0, bang), value};
+            sheet_cells_.push_back(ref);
+            args_.push_back(std::make_unique<SheetCellExpr>(std::move(ref)));
+            return;
+        }
+
+        cells_.push_front(value);
+        auto node = std::make_unique<CellExpr>(&cells_.front());
+        args_.push_back(std::move(node));
+    }
+
+    void exitRef(FormulaParser::RefContext* /* ctx */) override {
+        cells_.push_front(Position::NONE);
+        args_.push_back(std::make_unique<CellExpr>(&cells_.front()));
+    }
+
+    void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
+        assert(args_.size() >= 2);
+
+        auto rhs = std::move(args_.back());
+        args_.pop_back();
+
+        auto lhs = std::move(args_.back());
+
+        BinaryOpExpr::Type type;
+        if (ctx->ADD()) {
+            type = BinaryOpExpr::Add;
+        } else if (ctx->SUB()) {
+            type = BinaryOpExpr::Subtract;
+        } else if (ctx->MUL()) {
+            type = BinaryOpExpr::Multiply;
+        } else {
+            assert(ctx->DIV() != nullptr);
+            type = BinaryOpExpr::Divide;
+        }
+
+        auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
+        args_.back() = std::move(node);
+    }
+
+    void visitErrorNode(antlr4::tree::ErrorNode* node) override {
+        //std::cout << "error node" << std::endl;
+        throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
+    }
+
+private:
+    std::vector<std::unique_ptr<Expr>> args_;
+    std::forward_list<Position> cells_;
+    std::vector<SheetPosition> sheet_cells_;
+};
+
+class BailErrorListener : public antlr4::BaseErrorListener {
+public:
+    void syntaxError(antlr4::Recognizer* /* recognizer */, antlr4::Token* /* offendingSymbol */,
+                     size_t /* line */, size_t /* charPositionInLine */, const std::string& msg,
+                     std::exception_ptr /* e */
+                     ) override {
+        //std::cout << "listener error" << std::endl;
+        throw ParsingError("Error when lexing: " + msg);
+    }
+};
+
+} 
+} 
+
+FormulaAST ParseFormulaAST(std::istream& in) {
+    using namespace antlr4;
+
+    ANTLRInputStream input(in);
+
+    FormulaLexer lexer(&input);
+    ASTImpl::BailErrorListener error_listener;
+    lexer.removeErrorListeners();
+    lexer.addErrorListener(&error_listener);
+
+    CommonTokenStream tokens(&lexer);
+
+    FormulaParser parser(&tokens);
+    auto error_handler = std::make_shared<BailErrorStrategy>();
+    parser.setErrorHandler(error_handler);
+    parser.removeErrorListeners();
+
+    tree::ParseTree* tree = parser.main();
+    ASTImpl::ParseASTListener listener;
+    tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
+
+    auto root = listener.MoveRoot();
+    auto cells = listener.MoveCells();
+    return FormulaAST(std::move(root), std::move(cells), listener.MoveSheetCells());
+}
+
+FormulaAST ParseFormulaAST(const std::string& in_str) {
+    std::istringstream in(in_str);
+    try {
+        return ParseFormulaAST(in);
+    } catch (antlr4::ParseCancellationException&) {
+        throw FormulaException("parsing error");
+    } catch (ParsingError&) {
+        throw FormulaException("parsing error");
+    }
+}
+
+void FormulaAST::PrintCells(std::ostream& out) const {
+    char name[Position::MAX_NAME_LENGTH];
+    for (auto cell : cells_) {
+        out.write(name, cell.ToChars(name)) << ' ';
+    }
+}
+
+void FormulaAST::Print(std::ostream& out) const {
+    root_expr_->Print(out);
+}
+
+void FormulaAST::PrintFormula(std::ostream& out) const {
+    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+}
+
+void FormulaAST::Compile(std::vector<FormulaInstruction>& code) const {
+    if (!sheet_cells_.empty()) {
+        return;
+    }
+    root_expr_->Compile(code);
+}
+
+FormulaAST FormulaAST::MapCells(const std::function<Position(Position)>& map) const {
+    std::forward_list<Position> cells;
+    auto root = root_expr_->MapCells(cells, map);
+    return FormulaAST(std::move(root), std::move(cells), sheet_cells_);
+}
+
+size_t FormulaAST::GetMemoryUsage() const {
+    // узел списка - позиция и указатель на следующий
+    size_t usage = root_expr_->GetMemoryUsage()
+        + std::distance(cells_.begin(), cells_.end()) * (sizeof(Position) + sizeof(void*))
+        + sheet_cells_.capacity() * sizeof(SheetPosition);
+    for (const auto& ref : sheet_cells_) {
+        usage += GetStringMemory(ref.sheet);
+    }
+    return usage;
+}
+
+void FormulaAST::IndexInputs(const std::vector<Position>& inputs) {
+    root_expr_->IndexInputs(inputs);
+}
+
+double FormulaAST::Execute(SheetInterface& sheet, const CellOperand* const* inputs) const {
+    PROFILE_EXECUTE();
+    return root_expr_->Evaluate(sheet, inputs);
+}
+
+FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells,
+                       std::vector<SheetPosition> sheet_cells)
+    : root_expr_(std::move(root_expr))
+    , cells_(std::move(cells))
+    , sheet_cells_(std::move(sheet_cells)) {
+    cells_.sort();  // to avoid sorting in GetReferencedCells
+    std::sort(sheet_cells_.begin(), sheet_cells_.end());
+    sheet_cells_.erase(std::unique(sheet_cells_.begin(), sheet_cells_.end()), sheet_cells_.end());
+}
+
+FormulaAST::FormulaAST(FormulaAST&&) = default;
+FormulaAST& FormulaAST::operator=(FormulaAST&&) = default;
+
+FormulaAST::~FormulaAST() = default;
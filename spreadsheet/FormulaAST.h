@@ -1,46 +1,85 @@
-#pragma once
-
-#include "FormulaLexer.h"
-#include "common.h"
-
-#include <forward_list>
-#include <functional>
-#include <stdexcept>
-
-namespace ASTImpl {
-class Expr;
-}
-
-class ParsingError : public std::runtime_error {
-    using std::runtime_error::runtime_error;
-};
-
-class FormulaAST {
-public:
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
-    FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
-    ~FormulaAST();
-
-    double Execute(SheetInterface& sheet) const;
-    void PrintCells(std::ostream& out) const;
-    void Print(std::ostream& out) const;
-    void PrintFormula(std::ostream& out) const;
-
-    std::forward_list<Position>& GetCells() {
-        return cells_;
-    }
-
-    const std::forward_list<Position>& GetCells() const {
-        return cells_;
-    }
-
-private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
-
-    std::forward_list<Position> cells_;
-};
-
-FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
+#pragma once
+
+#include "FormulaLexer.h"
+#include "common.h"
+#include "formula.h"
+
+#include <forward_list>
+#include <functional>
+#include <stdexcept>
+
+namespace ASTImpl {
+class Expr;
+
+// Значение ячейки как операнда формулы: пустая ячейка - 0, текст - число
+// или #VALUE!, ошибка ячейки выбрасывается как FormulaError. Некорректная
+// позиция (ссылка #REF!) даёт #REF!.
+double GetCellOperand(SheetInterface& sheet, Position pos);
+
+// То же по операнду ячейки, найденному заранее (nullptr - искать в таблице).
+// Неактуальный операнд обновляется вычислением ячейки.
+inline double GetCellOperand(SheetInterface& sheet, Position pos, const CellOperand* operand) {
+    if (operand == nullptr) {
+        return GetCellOperand(sheet, pos);
+    }
+    if (!operand->ready) {
+        operand->cell->GetValue();
+    }
+    if (operand->is_error) {
+        throw FormulaError(operand->error);
+    }
+    return operand->number;
+}
+}
+
+class ParsingError : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+class FormulaAST {
+public:
+    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
+                        std::forward_list<Position> cells,
+                        std::vector<SheetPosition> sheet_cells = {});
+    FormulaAST(FormulaAST&&);
+    FormulaAST& operator=(FormulaAST&&);
+    ~FormulaAST();
+
+    // inputs - операнды ссылок, пронумерованных IndexInputs, или nullptr.
+    double Execute(SheetInterface& sheet, const CellOperand* const* inputs = nullptr) const;
+    // Нумерует ссылки дерева по их позициям в inputs (без повторов, по возрастанию).
+    void IndexInputs(const std::vector<Position>& inputs);
+    void PrintCells(std::ostream& out) const;
+    void Print(std::ostream& out) const;
+    void PrintFormula(std::ostream& out) const;
+    // Формула со ссылками на другие листы не компилируется, code остаётся пустым.
+    void Compile(std::vector<FormulaInstruction>& code) const;
+    // Копия дерева, в которой каждая ссылка pos заменена на map(pos), без разбора
+    // текста. Position::NONE становится ссылкой #REF!. Ссылки на другие листы
+    // не меняются.
+    FormulaAST MapCells(const std::function<Position(Position)>& map) const;
+    // Динамическая память дерева и списков ссылок (без самого объекта).
+    size_t GetMemoryUsage() const;
+
+    std::forward_list<Position>& GetCells() {
+        return cells_;
+    }
+
+    const std::forward_list<Position>& GetCells() const {
+        return cells_;
+    }
+
+    // Ссылки на ячейки других листов, без повторов, по возрастанию.
+    const std::vector<SheetPosition>& GetSheetCells() const {
+        return sheet_cells_;
+    }
+
+private:
+    std::unique_ptr<ASTImpl::Expr> root_expr_;
+
+    std::forward_list<Position> cells_;
+    std::vector<SheetPosition> sheet_cells_;
+};
+
+FormulaAST ParseFormulaAST(std::istream& in);
+FormulaAST ParseFormulaAST(const std::string& in_str);
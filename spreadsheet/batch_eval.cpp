@@ -0,0 +1,134 @@
+#include "batch_eval.h"
+
+#include <algorithm>
+#include <cassert>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// строк в одном блоке: стек блока целиком помещается в L1
+const size_t BLOCK = 256;
+
+using Op = FormulaInstruction::Op;
+
+size_t GetStackDepth(const std::vector<FormulaInstruction>& code) {
+    size_t depth = 0;
+    size_t max_depth = 0;
+    for (const auto& instruction : code) {
+        switch (instruction.op) {
+            case Op::Number:
+            case Op::Cell:
+                max_depth = std::max(max_depth, ++depth);
+                break;
+            case Op::UnaryPlus:
+            case Op::UnaryMinus:
+                break;
+            default:
+                --depth;
+        }
+    }
+    return max_depth;
+}
+
+// check[i] += value[i] * 0 - ноль для конечного value и NaN иначе,
+// так что после всех операций check[i] != 0 означает #ARITHM!.
+void ApplyBinary(Op op, double* lhs, const double* rhs, double* check, size_t n) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256d zero = _mm256_setzero_pd();
+    for (; i + 4 <= n; i += 4) {
+        const __m256d a = _mm256_loadu_pd(lhs + i);
+        const __m256d b = _mm256_loadu_pd(rhs + i);
+        __m256d value;
+        switch (op) {
+            case Op::Add:
+                value = _mm256_add_pd(a, b);
+                break;
+            case Op::Subtract:
+                value = _mm256_sub_pd(a, b);
+                break;
+            case Op::Multiply:
+                value = _mm256_mul_pd(a, b);
+                break;
+            default:
+                value = _mm256_div_pd(a, b);
+        }
+        _mm256_storeu_pd(lhs + i, value);
+        _mm256_storeu_pd(check + i, _mm256_add_pd(_mm256_loadu_pd(check + i), _mm256_mul_pd(value, zero)));
+    }
+#endif
+    switch (op) {
+        case Op::Add:
+            for (; i < n; ++i) {
+                lhs[i] += rhs[i];
+                check[i] += lhs[i] * 0.;
+            }
+            break;
+        case Op::Subtract:
+            for (; i < n; ++i) {
+                lhs[i] -= rhs[i];
+                check[i] += lhs[i] * 0.;
+            }
+            break;
+        case Op::Multiply:
+            for (; i < n; ++i) {
+                lhs[i] *= rhs[i];
+                check[i] += lhs[i] * 0.;
+            }
+            break;
+        default:
+            for (; i < n; ++i) {
+                lhs[i] /= rhs[i];
+                check[i] += lhs[i] * 0.;
+            }
+    }
+}
+
+}  // namespace
+
+void EvaluateBatch(const std::vector<FormulaInstruction>& code, const std::vector<const double*>& inputs,
+                   size_t rows, double* result, bool* arithm_error) {
+    const size_t depth = GetStackDepth(code);
+    assert(depth > 0);
+    std::vector<double> stack(depth * BLOCK);
+    double check[BLOCK];
+
+    for (size_t begin = 0; begin < rows; begin += BLOCK) {
+        const size_t n = std::min(BLOCK, rows - begin);
+        std::fill(check, check + n, 0.);
+        double* top = stack.data();  // первая свободная ячейка стека
+        size_t input = 0;
+        for (const auto& instruction : code) {
+            switch (instruction.op) {
+                case Op::Number:
+                    std::fill(top, top + n, instruction.number);
+                    top += BLOCK;
+                    break;
+                case Op::Cell:
+                    std::copy(inputs[input] + begin, inputs[input] + begin + n, top);
+                    ++input;
+                    top += BLOCK;
+                    break;
+                case Op::UnaryPlus:
+                    break;
+                case Op::UnaryMinus: {
+                    double* operand = top - BLOCK;
+                    for (size_t i = 0; i < n; ++i) {
+                        operand[i] = -operand[i];
+                    }
+                    break;
+                }
+                default:
+                    top -= BLOCK;
+                    ApplyBinary(instruction.op, top - BLOCK, top, check, n);
+            }
+        }
+        std::copy(stack.data(), stack.data() + n, result + begin);
+        for (size_t i = 0; i < n; ++i) {
+            arithm_error[begin + i] = check[i] != 0.;
+        }
+    }
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "formula.h"
+
+#include <cstddef>
+#include <vector>
+
+// Вычисляет одну программу (FormulaInstruction) сразу для rows строк.
+// inputs[i] - значения i-й по порядку инструкции Cell для каждой строки.
+// В result записываются значения, в arithm_error - признак того, что в строке
+// какая-то бинарная операция дала бесконечность или NaN (#ARITHM!).
+// С -mavx2 операции выполняются по 4 числа за инструкцию.
+void EvaluateBatch(const std::vector<FormulaInstruction>& code, const std::vector<const double*>& inputs,
+                   size_t rows, double* result, bool* arithm_error);
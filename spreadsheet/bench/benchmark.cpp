@@ -0,0 +1,926 @@
+#include "benchmark.h"
+
+#include "FormulaAST.h"
+#include "cell_map.h"
+#include "common.h"
+#include "formula.h"
+#include "profiler.h"
+#include "sheet.h"
+#include "sweep.h"
+#include "value_export.h"
+#include "workbook.h"
+
+#include <cmath>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+const unsigned SEED = 20240601;
+
+std::string CellName(int row, int col) {
+    return Position{row, col}.ToString();
+}
+
+void ConsumeValue(const CellInterface::Value& value) {
+    if (const auto* number = std::get_if<double>(&value)) {
+        Consume(*number);
+    } else {
+        Consume(1.);
+    }
+}
+
+// Плотный прямоугольник чисел rows x cols.
+std::unique_ptr<Sheet> MakeNumbers(int rows, int cols) {
+    auto sheet = std::make_unique<Sheet>();
+    std::mt19937 rng(SEED);
+    std::uniform_int_distribution<int> dist(0, 1000);
+    for (int row = 0; row < rows; ++row) {
+        for (int col = 0; col < cols; ++col) {
+            sheet->SetCell({row, col}, std::to_string(dist(rng)));
+        }
+    }
+    return sheet;
+}
+
+// A1 = 1, A(i) = A(i-1) + 1.
+std::unique_ptr<Sheet> MakeChain(int length) {
+    auto sheet = std::make_unique<Sheet>();
+    sheet->SetCell({0, 0}, "1");
+    for (int row = 1; row < length; ++row) {
+        sheet->SetCell({row, 0}, "=" + CellName(row - 1, 0) + "+1");
+    }
+    return sheet;
+}
+
+// Столбец A - входы, столбец B - формулы =A(i)*2+A1.
+std::unique_ptr<Sheet> MakeFanOut(int width) {
+    auto sheet = std::make_unique<Sheet>();
+    for (int row = 0; row < width; ++row) {
+        sheet->SetCell({row, 0}, std::to_string(row));
+        sheet->SetCell({row, 1}, "=" + CellName(row, 0) + "*2+A1");
+    }
+    return sheet;
+}
+
+// Столбцы A, B, C - числа, столбец D - формулы =A(i)*B(i)+C(i).
+std::unique_ptr<Sheet> MakeFillDown(int rows) {
+    auto sheet = MakeNumbers(rows, 3);
+    for (int row = 0; row < rows; ++row) {
+        sheet->SetCell({row, 3}, "=" + CellName(row, 0) + "*" + CellName(row, 1) + "+" + CellName(row, 2));
+    }
+    return sheet;
+}
+
+// Модель с входом A1 (ставка): C(i) - поступления, B(i) = B(i-1)*(1+A1)+C(i).
+std::unique_ptr<Sheet> MakeGrowthModel(int length) {
+    auto sheet = MakeNumbers(length, 3);
+    sheet->SetCell({0, 0}, "0.05");
+    sheet->SetCell({0, 1}, "=" + CellName(0, 2));
+    for (int row = 1; row < length; ++row) {
+        sheet->SetCell({row, 1}, "=" + CellName(row - 1, 1) + "*(1+A1)+" + CellName(row, 2));
+    }
+    return sheet;
+}
+
+std::string MakeSumFormula(int width) {
+    std::string text = "=";
+    for (int row = 0; row < width; ++row) {
+        if (row > 0) {
+            text += '+';
+        }
+        text += CellName(row, 0);
+    }
+    return text;
+}
+
+// Формулы типичной расчётной таблицы над столбцами A-D: в основном
+// короткие (=B1*C1, =D1*1.2, =-B1), часть - длиннее.
+std::vector<std::string> MakeBusinessExpressions(int rows) {
+    std::vector<std::string> result;
+    for (int row = 0; row < rows; ++row) {
+        const auto a = CellName(row, 0);
+        const auto b = CellName(row, 1);
+        const auto c = CellName(row, 2);
+        const auto d = CellName(row, 3);
+        result.push_back(b + "*" + c);
+        result.push_back(d + "*1.2");
+        result.push_back(a + "-" + d);
+        result.push_back(a + "/" + c);
+        result.push_back("-" + b);
+        result.push_back(a + "+" + b + "+" + c);
+    }
+    return result;
+}
+
+std::vector<std::string> MakeExpressions(int count) {
+    std::mt19937 rng(SEED);
+    std::uniform_int_distribution<int> cell(0, 999);
+    std::uniform_int_distribution<int> shape(0, 3);
+    std::vector<std::string> result;
+    for (int i = 0; i < count; ++i) {
+        const auto a = CellName(cell(rng), cell(rng) % 26);
+        const auto b = CellName(cell(rng), cell(rng) % 26);
+        switch (shape(rng)) {
+            case 0:
+                result.push_back(a + "+" + b);
+                break;
+            case 1:
+                result.push_back(a + "*2.5");
+                break;
+            case 2:
+                result.push_back("(" + a + "-" + b + ")/" + b);
+                break;
+            default:
+                result.push_back("-" + a + "*(" + b + "+1e3)/7");
+                break;
+        }
+    }
+    return result;
+}
+
+void RegisterSheetBenchmarks(BenchmarkRunner& runner) {
+    runner.Run("set_cell/numbers_dense_300x300", [] {
+        return [] {
+            Sheet sheet;
+            for (int row = 0; row < 300; ++row) {
+                for (int col = 0; col < 300; ++col) {
+                    sheet.SetCell({row, col}, std::to_string(row * col));
+                }
+            }
+            return size_t{300 * 300};
+        };
+    });
+
+    runner.Run("set_cell/formulas_10000", [] {
+        auto expressions = MakeExpressions(10000);
+        return [expressions = std::move(expressions)] {
+            Sheet sheet;
+            for (size_t i = 0; i < expressions.size(); ++i) {
+                sheet.SetCell({static_cast<int>(i / 26), 26 + static_cast<int>(i % 26)}, "=" + expressions[i]);
+            }
+            return expressions.size();
+        };
+    });
+
+    runner.Run("chain/build_and_eval_2000", [] {
+        return [] {
+            auto sheet = MakeChain(2000);
+            ConsumeValue(sheet->GetCell({1999, 0})->GetValue());
+            return size_t{2000};
+        };
+    });
+
+    runner.Run("chain/recalc_after_edit_2000", [] {
+        std::shared_ptr<Sheet> sheet = MakeChain(2000);
+        sheet->GetCell({1999, 0})->GetValue();
+        return [sheet] {
+            for (int i = 0; i < 10; ++i) {
+                sheet->SetCell({0, 0}, std::to_string(i));
+                ConsumeValue(sheet->GetCell({1999, 0})->GetValue());
+            }
+            return size_t{10 * 2000};
+        };
+    });
+
+    runner.Run("fan_in/sum_of_500", [] {
+        std::shared_ptr<Sheet> sheet = MakeNumbers(500, 1);
+        auto formula = MakeSumFormula(500);
+        return [sheet, formula] {
+            for (int i = 0; i < 20; ++i) {
+                sheet->SetCell({0, 1}, formula);
+                ConsumeValue(sheet->GetCell({0, 1})->GetValue());
+            }
+            return size_t{20 * 500};
+        };
+    });
+
+    runner.Run("fan_out/recalc_after_edit_5000", [] {
+        std::shared_ptr<Sheet> sheet = MakeFanOut(5000);
+        return [sheet] {
+            for (int i = 0; i < 5; ++i) {
+                sheet->SetCell({0, 0}, std::to_string(i));
+                for (int row = 0; row < 5000; ++row) {
+                    ConsumeValue(sheet->GetCell({row, 1})->GetValue());
+                }
+            }
+            return size_t{5 * 5000};
+        };
+    });
+
+    runner.Run("fan_out/formula_operands_5000x4", [] {
+        // формулы читают значения других формул: A(i) = E1*i, дальше по строке
+        auto sheet = std::make_shared<Sheet>();
+        for (int row = 0; row < 5000; ++row) {
+            const auto a = CellName(row, 0);
+            const auto b = CellName(row, 1);
+            sheet->SetCell({row, 0}, "=E1*" + std::to_string(row));
+            sheet->SetCell({row, 1}, "=" + a + "*2");
+            sheet->SetCell({row, 2}, "=" + b + "+" + a);
+            sheet->SetCell({row, 3}, "=" + CellName(row, 2) + "-" + b);
+        }
+        return [sheet] {
+            for (int i = 0; i < 5; ++i) {
+                sheet->SetCell({0, 4}, std::to_string(i));
+                for (int row = 0; row < 5000; ++row) {
+                    ConsumeValue(sheet->GetCell({row, 3})->GetValue());
+                }
+            }
+            // чтения ячеек формулами
+            return size_t{5 * 5000 * 6};
+        };
+    });
+
+    runner.Run("eager/fan_out_edit_5000", [] {
+        std::shared_ptr<Sheet> sheet = MakeFanOut(5000);
+        sheet->SetRecalcMode(RecalcMode::Eager);
+        return [sheet] {
+            for (int i = 0; i < 5; ++i) {
+                sheet->SetCell({0, 0}, std::to_string(i));
+                Consume(static_cast<double>(sheet->GetLastChanges().size()));
+            }
+            return size_t{5 * 5000};
+        };
+    });
+
+    runner.Run("numeric_column/formula_reads_10000", [] {
+        // столбец A - числа в плотном хранилище, формулы читают их напрямую
+        std::shared_ptr<Sheet> sheet = MakeNumbers(10000, 1);
+        auto formulas = std::make_shared<std::vector<std::unique_ptr<FormulaInterface>>>();
+        for (int row = 0; row < 10000; ++row) {
+            const auto a = CellName(row, 0);
+            formulas->push_back(ParseFormula(a + "+" + a));
+        }
+        return [sheet, formulas] {
+            for (int i = 0; i < 5; ++i) {
+                for (const auto& formula : *formulas) {
+                    Consume(std::get<double>(formula->Evaluate(*sheet)));
+                }
+            }
+            return size_t{5 * 10000 * 2};
+        };
+    });
+
+    runner.Run("print_values/dense_200x50", [] {
+        std::shared_ptr<Sheet> sheet = MakeNumbers(200, 50);
+        return [sheet] {
+            std::ostringstream out;
+            sheet->PrintValues(out);
+            Consume(static_cast<double>(out.str().size()));
+            return size_t{200 * 50};
+        };
+    });
+
+    runner.Run("print_values/sparse_2000x200", [] {
+        auto sheet = std::make_shared<Sheet>();
+        std::mt19937 rng(SEED);
+        std::uniform_int_distribution<int> row(0, 1999);
+        std::uniform_int_distribution<int> col(0, 199);
+        for (int i = 0; i < 2000; ++i) {
+            sheet->SetCell({row(rng), col(rng)}, std::to_string(i));
+        }
+        sheet->SetCell({1999, 199}, "=A1+1");
+        return [sheet] {
+            std::ostringstream out;
+            sheet->PrintValues(out);
+            Consume(static_cast<double>(out.str().size()));
+            return size_t{2000 * 200};
+        };
+    });
+
+    runner.Run("print_texts/dense_200x50", [] {
+        std::shared_ptr<Sheet> sheet = MakeNumbers(200, 50);
+        return [sheet] {
+            std::ostringstream out;
+            sheet->PrintTexts(out);
+            Consume(static_cast<double>(out.str().size()));
+            return size_t{200 * 50};
+        };
+    });
+}
+
+// Случайные позиции по всей таблице.
+std::vector<Position> MakePositions(int count) {
+    std::mt19937 rng(SEED);
+    std::uniform_int_distribution<int> rows(0, Position::MAX_ROWS - 1);
+    std::uniform_int_distribution<int> cols(0, Position::MAX_COLS - 1);
+    std::vector<Position> positions;
+    for (int i = 0; i < count; ++i) {
+        positions.push_back({rows(rng), cols(rng)});
+    }
+    return positions;
+}
+
+void RegisterPositionBenchmarks(BenchmarkRunner& runner) {
+    const int count = 10000;
+    runner.Run("position/from_string_10000", [] {
+        std::vector<std::string> names;
+        for (const auto& pos : MakePositions(count)) {
+            names.push_back(pos.ToString());
+        }
+        return [names = std::move(names)] {
+            for (const auto& name : names) {
+                Consume(static_cast<double>(Position::FromString(name).row));
+            }
+            return names.size();
+        };
+    });
+
+    runner.Run("position/to_string_10000", [] {
+        return [positions = MakePositions(count)] {
+            for (const auto& pos : positions) {
+                Consume(static_cast<double>(pos.ToString().size()));
+            }
+            return positions.size();
+        };
+    });
+
+    runner.Run("position/to_chars_10000", [] {
+        return [positions = MakePositions(count)] {
+            char name[Position::MAX_NAME_LENGTH];
+            for (const auto& pos : positions) {
+                Consume(static_cast<double>(pos.ToChars(name)));
+            }
+            return positions.size();
+        };
+    });
+}
+
+// Дроби разного порядка, как у результатов формул.
+std::vector<double> MakeFractions(int count) {
+    std::mt19937 rng(SEED);
+    std::uniform_real_distribution<double> mantissa(-1000., 1000.);
+    std::uniform_int_distribution<int> exponent(-8, 8);
+    std::vector<double> values;
+    for (int i = 0; i < count; ++i) {
+        values.push_back(mantissa(rng) * std::pow(10., exponent(rng)));
+    }
+    return values;
+}
+
+void RegisterNumberFormatBenchmarks(BenchmarkRunner& runner) {
+    // сравнить с number_format/stream_10000 - прежний вывод через поток (6 цифр)
+    const int count = 10000;
+    runner.Run("number_format/shortest_10000", [] {
+        return [values = MakeFractions(count)] {
+            std::ostringstream out;
+            for (const double value : values) {
+                PrintNumber(out, value);
+                out << '\t';
+            }
+            Consume(static_cast<double>(out.str().size()));
+            return values.size();
+        };
+    });
+
+    runner.Run("number_format/stream_10000", [] {
+        return [values = MakeFractions(count)] {
+            std::ostringstream out;
+            for (const double value : values) {
+                PrintNumber(out, value, NumberFormat::Stream);
+                out << '\t';
+            }
+            Consume(static_cast<double>(out.str().size()));
+            return values.size();
+        };
+    });
+
+    runner.Run("number_format/shortest_to_buffer_10000", [] {
+        return [values = MakeFractions(count)] {
+            char buffer[MAX_NUMBER_LENGTH];
+            for (const double value : values) {
+                Consume(static_cast<double>(FormatNumber(value, buffer)));
+            }
+            return values.size();
+        };
+    });
+}
+
+void RegisterFormulaBenchmarks(BenchmarkRunner& runner) {
+    runner.Run("formula/parse_5000", [] {
+        auto expressions = MakeExpressions(5000);
+        return [expressions = std::move(expressions)] {
+            for (const auto& expression : expressions) {
+                Consume(static_cast<double>(ParseFormula(expression)->GetReferencedCells().size()));
+            }
+            return expressions.size();
+        };
+    });
+
+    // сравнить с formula/business_sheet_2000_tree - те же формулы через дерево разбора
+    runner.Run("formula/business_sheet_2000", [] {
+        std::shared_ptr<Sheet> sheet = MakeNumbers(2000, 4);
+        auto formulas = std::make_shared<std::vector<std::unique_ptr<FormulaInterface>>>();
+        for (const auto& expression : MakeBusinessExpressions(2000)) {
+            formulas->push_back(ParseFormula(expression));
+        }
+        return [sheet, formulas] {
+            for (int i = 0; i < 5; ++i) {
+                for (const auto& formula : *formulas) {
+                    const auto value = formula->Evaluate(*sheet);
+                    Consume(std::holds_alternative<double>(value) ? std::get<double>(value) : 1.);
+                }
+            }
+            return 5 * formulas->size();
+        };
+    });
+
+    runner.Run("formula/business_sheet_2000_tree", [] {
+        std::shared_ptr<Sheet> sheet = MakeNumbers(2000, 4);
+        auto asts = std::make_shared<std::vector<std::unique_ptr<FormulaAST>>>();
+        for (const auto& expression : MakeBusinessExpressions(2000)) {
+            asts->push_back(std::make_unique<FormulaAST>(ParseFormulaAST(expression)));
+        }
+        return [sheet, asts] {
+            for (int i = 0; i < 5; ++i) {
+                for (const auto& ast : *asts) {
+                    try {
+                        Consume(ast->Execute(*sheet));
+                    } catch (const FormulaError&) {
+                        Consume(1.);
+                    }
+                }
+            }
+            return 5 * asts->size();
+        };
+    });
+
+    runner.Run("formula/get_expression_5000", [] {
+        std::vector<std::unique_ptr<FormulaInterface>> formulas;
+        for (const auto& expression : MakeExpressions(5000)) {
+            formulas.push_back(ParseFormula(expression));
+        }
+        auto shared = std::make_shared<decltype(formulas)>(std::move(formulas));
+        return [shared] {
+            for (const auto& formula : *shared) {
+                Consume(static_cast<double>(formula->GetExpression().size()));
+            }
+            return shared->size();
+        };
+    });
+}
+
+// A1 - вход, B1 = A1*0, дальше цепочка от B1: почти любая правка A1
+// не меняет значений цепочки.
+std::unique_ptr<Sheet> MakeCutoffChain(int length) {
+    auto sheet = std::make_unique<Sheet>();
+    sheet->SetCell({0, 0}, "1");
+    sheet->SetCell({0, 1}, "=A1*0");
+    sheet->SetCell({0, 2}, "=B1+1");
+    for (int row = 1; row < length; ++row) {
+        sheet->SetCell({row, 2}, "=" + CellName(row - 1, 2) + "+1");
+    }
+    return sheet;
+}
+
+void RegisterCutoffBenchmarks(BenchmarkRunner& runner) {
+    // сравнить с chain/recalc_after_edit_2000, где каждая правка меняет всю цепочку
+    runner.Run("cutoff/unchanged_values_chain_2000", [] {
+        std::shared_ptr<Sheet> sheet = MakeCutoffChain(2000);
+        ConsumeValue(sheet->GetCell({1999, 2})->GetValue());
+        return [sheet] {
+            for (int i = 0; i < 100; ++i) {
+                sheet->SetCell({0, 0}, std::to_string(i + 2));
+                ConsumeValue(sheet->GetCell({1999, 2})->GetValue());
+            }
+            return size_t{100 * 2001};
+        };
+    });
+
+    runner.Run("cutoff/unchanged_values_chain_2000_executes", [] {
+        std::shared_ptr<Sheet> sheet = MakeCutoffChain(2000);
+        ConsumeValue(sheet->GetCell({1999, 2})->GetValue());
+        return [sheet] {
+            Profiler::Instance().Reset();
+            Profiler::Instance().Enable();
+            for (int i = 0; i < 100; ++i) {
+                sheet->SetCell({0, 0}, std::to_string(i + 2));
+                ConsumeValue(sheet->GetCell({1999, 2})->GetValue());
+            }
+            Profiler::Instance().Enable(false);
+            BenchmarkRunner::Counters()["formula_executes"] =
+                static_cast<double>(Profiler::Instance().GetExecuteCount());
+            BenchmarkRunner::Counters()["executes_without_cutoff"] = 100. * 2001;
+            return size_t{100 * 2001};
+        };
+    });
+}
+
+void RegisterProfilerBenchmarks(BenchmarkRunner& runner) {
+    // сравнить с chain/recalc_after_edit_2000, где профилировщик выключен
+    runner.Run("profiler/chain_recalc_after_edit_2000_enabled", [] {
+        std::shared_ptr<Sheet> sheet = MakeChain(2000);
+        sheet->GetCell({1999, 0})->GetValue();
+        return [sheet] {
+            Profiler::Instance().Reset();
+            Profiler::Instance().Enable();
+            for (int i = 0; i < 10; ++i) {
+                sheet->SetCell({0, 0}, std::to_string(i));
+                ConsumeValue(sheet->GetCell({1999, 0})->GetValue());
+            }
+            Profiler::Instance().Enable(false);
+            return size_t{10 * 2000};
+        };
+    });
+}
+
+}  // namespace
+
+// Хеш позиций до CellKey: std::hash<int> от row * MAX_COLS + col.
+struct IdentityPositionHash {
+    size_t operator()(const Position& pos) const {
+        return std::hash<int>()(pos.row * Position::MAX_COLS + pos.col);
+    }
+};
+
+// Поиск по плотному квадрату side x side (заполнен по строкам)
+// сначала по строкам, затем по столбцам, плюс столько же промахов.
+template <typename Map>
+void RunLookupBenchmark(BenchmarkRunner& runner, const std::string& name, int side) {
+    runner.Run(name, [side] {
+        auto map = std::make_shared<Map>();
+        for (int row = 0; row < side; ++row) {
+            for (int col = 0; col < side; ++col) {
+                (*map)[Position {row, col}] = row + col;
+            }
+        }
+        return [map, side] {
+            size_t found = 0;
+            for (int row = 0; row < side; ++row) {
+                for (int col = 0; col < side; ++col) {
+                    found += map->find(Position {row, col}) != map->end();
+                }
+            }
+            for (int col = 0; col < side; ++col) {
+                for (int row = 0; row < side; ++row) {
+                    found += map->find(Position {row, col}) != map->end();
+                    found += map->find(Position {row + side, col}) != map->end();
+                }
+            }
+            Consume(static_cast<double>(found));
+            return static_cast<size_t>(3 * side * side);
+        };
+    });
+}
+
+template <typename Map>
+void RunInsertEraseBenchmark(BenchmarkRunner& runner, const std::string& name, int side) {
+    runner.Run(name, [side] {
+        return [side] {
+            Map map;
+            for (int row = 0; row < side; ++row) {
+                for (int col = 0; col < side; ++col) {
+                    map[Position {row, col}] = row;
+                }
+            }
+            for (int row = 0; row < side; row += 2) {
+                for (int col = 0; col < side; ++col) {
+                    map.erase(Position {row, col});
+                }
+            }
+            Consume(static_cast<double>(map.size()));
+            return static_cast<size_t>(side * side * 3 / 2);
+        };
+    });
+}
+
+void RegisterCloneBenchmarks(BenchmarkRunner& runner) {
+    // сравнить с clone/rebuild_fill_down_5000 - та же таблица заново через SetCell
+    runner.Run("clone/fill_down_5000", [] {
+        std::shared_ptr<Sheet> sheet = MakeFillDown(5000);
+        return [sheet] {
+            auto clone = sheet->Clone();
+            clone->SetCell({0, 0}, "1");
+            Consume(static_cast<double>(clone->GetPrintableSize().rows));
+            return size_t{5000 * 4};
+        };
+    });
+
+    runner.Run("clone/rebuild_fill_down_5000", [] {
+        std::shared_ptr<Sheet> sheet = MakeFillDown(5000);
+        return [sheet] {
+            Sheet copy;
+            const auto size = sheet->GetPrintableSize();
+            for (int row = 0; row < size.rows; ++row) {
+                for (int col = 0; col < size.cols; ++col) {
+                    copy.SetCell({row, col}, sheet->GetCell({row, col})->GetText());
+                }
+            }
+            copy.SetCell({0, 0}, "1");
+            Consume(static_cast<double>(copy.GetPrintableSize().rows));
+            return size_t{5000 * 4};
+        };
+    });
+}
+
+void RegisterCellMapBenchmarks(BenchmarkRunner& runner) {
+    using IdentityMap = std::unordered_map<Position, int, IdentityPositionHash>;
+    using HashedMap = std::unordered_map<Position, int, PositionHash>;
+    RunLookupBenchmark<IdentityMap>(runner, "cell_map/lookup_300x300_unordered_identity", 300);
+    RunLookupBenchmark<HashedMap>(runner, "cell_map/lookup_300x300_unordered", 300);
+    RunLookupBenchmark<CellMap<int>>(runner, "cell_map/lookup_300x300_flat", 300);
+    RunInsertEraseBenchmark<IdentityMap>(runner, "cell_map/insert_erase_300x300_unordered_identity", 300);
+    RunInsertEraseBenchmark<HashedMap>(runner, "cell_map/insert_erase_300x300_unordered", 300);
+    RunInsertEraseBenchmark<CellMap<int>>(runner, "cell_map/insert_erase_300x300_flat", 300);
+}
+
+void RegisterBatchBenchmarks(BenchmarkRunner& runner) {
+    runner.Run("batch/fill_down_10000", [] {
+        std::shared_ptr<Sheet> sheet = MakeFillDown(10000);
+        return [sheet] {
+            sheet->EvaluateAll();
+            Consume(std::get<double>(sheet->GetCell({9999, 3})->GetValue()));
+            return size_t{10000};
+        };
+    });
+
+    // те же ячейки, вычисленные по одной
+    runner.Run("batch/fill_down_10000_scalar", [] {
+        std::shared_ptr<Sheet> sheet = MakeFillDown(10000);
+        return [sheet] {
+            for (int row = 0; row < 10000; ++row) {
+                for (int col = 0; col < 4; ++col) {
+                    ConsumeValue(sheet->GetCell({row, col})->GetValue());
+                }
+            }
+            return size_t{10000};
+        };
+    });
+}
+
+void RegisterSweepBenchmarks(BenchmarkRunner& runner) {
+    const int length = 200;
+    const size_t scenarios = 10000;
+    const Position output {length - 1, 1};
+    // items - сценарии; сравнить ns_per_item с sweep/set_cell_growth_200
+    runner.Run("sweep/growth_200", [=] {
+        auto sheet = MakeGrowthModel(length);
+        auto sweep = std::make_shared<Sweep>(*sheet, std::vector<Position> {{0, 0}}, std::vector<Position> {output});
+        std::vector<double> rates;
+        for (size_t i = 0; i < scenarios; ++i) {
+            rates.push_back(i * 1e-5);
+        }
+        return [sweep, rates] {
+            const auto result = sweep->Run({rates});
+            ConsumeValue(result[0].back());
+            return rates.size();
+        };
+    });
+
+    runner.Run("sweep/growth_200_single_thread", [=] {
+        auto sheet = MakeGrowthModel(length);
+        auto sweep = std::make_shared<Sweep>(*sheet, std::vector<Position> {{0, 0}}, std::vector<Position> {output});
+        std::vector<double> rates;
+        for (size_t i = 0; i < scenarios; ++i) {
+            rates.push_back(i * 1e-5);
+        }
+        return [sweep, rates] {
+            const auto result = sweep->Run({rates}, 1);
+            ConsumeValue(result[0].back());
+            return rates.size();
+        };
+    });
+
+    // прежний способ: SetCell входа и GetValue выхода, в 10 раз меньше сценариев
+    runner.Run("sweep/set_cell_growth_200", [=] {
+        std::shared_ptr<Sheet> sheet = MakeGrowthModel(length);
+        return [sheet, output, scenarios] {
+            for (size_t i = 0; i < scenarios / 10; ++i) {
+                sheet->SetCell({0, 0}, std::to_string(i * 1e-5));
+                ConsumeValue(sheet->GetCell(output)->GetValue());
+            }
+            return scenarios / 10;
+        };
+    });
+}
+
+void RegisterFillBenchmarks(BenchmarkRunner& runner) {
+    // items - заполненные ячейки; сравнить с fill/set_cell_16000
+    const int rows = 16000;
+    runner.Run("fill/fill_down_16000", [] {
+        std::shared_ptr<Sheet> sheet = MakeNumbers(rows, 3);
+        sheet->SetCell({0, 3}, "=A1*B1+C1");
+        return [sheet] {
+            sheet->FillRange({{0, 3}, {0, 3}}, {{0, 3}, {rows - 1, 3}});
+            return static_cast<size_t>(rows);
+        };
+    });
+
+    runner.Run("fill/set_cell_16000", [] {
+        std::shared_ptr<Sheet> sheet = MakeNumbers(rows, 3);
+        std::vector<std::string> texts;
+        for (int row = 0; row < rows; ++row) {
+            texts.push_back("=" + CellName(row, 0) + "*" + CellName(row, 1) + "+" + CellName(row, 2));
+        }
+        return [sheet, texts] {
+            for (int row = 0; row < rows; ++row) {
+                sheet->SetCell({row, 3}, texts[row]);
+            }
+            return static_cast<size_t>(rows);
+        };
+    });
+
+    runner.Run("fill/copy_block_100x20", [] {
+        std::shared_ptr<Sheet> sheet = MakeFillDown(100);
+        sheet->FillRange({{0, 3}, {99, 3}}, {{0, 3}, {99, 19}});
+        return [sheet] {
+            sheet->CopyRange({{0, 0}, {99, 19}}, {200, 0});
+            return size_t{100 * 20};
+        };
+    });
+}
+
+void RegisterClearBenchmarks(BenchmarkRunner& runner) {
+    // блок 1000x1000 чисел и столбец формул справа от него; items - очищенные ячейки
+    const int size = 1000;
+    const auto make_sheet = [] {
+        std::shared_ptr<Sheet> sheet = MakeNumbers(size, size);
+        for (int row = 0; row < size; ++row) {
+            sheet->SetCell({row, size}, "=" + CellName(row, 0) + "+1");
+        }
+        return sheet;
+    };
+    runner.Run("clear/clear_range_1000x1000", [make_sheet] {
+        auto sheet = make_sheet();
+        return [sheet] {
+            sheet->ClearRange({{0, 0}, {size - 1, size - 1}});
+            return static_cast<size_t>(size * size);
+        };
+    });
+
+    runner.Run("clear/clear_cell_1000x1000", [make_sheet] {
+        auto sheet = make_sheet();
+        return [sheet] {
+            for (int row = 0; row < size; ++row) {
+                for (int col = 0; col < size; ++col) {
+                    sheet->ClearCell({row, col});
+                }
+            }
+            return static_cast<size_t>(size * size);
+        };
+    });
+}
+
+void RegisterViewportBenchmarks(BenchmarkRunner& runner) {
+    // 10000 строк невычисленных формул =A*B+C; items - напечатанные ячейки
+    const int rows = 10000;
+    runner.Run("viewport/print_values_window_50x4_of_10000x4", [] {
+        std::shared_ptr<Sheet> sheet = MakeFillDown(rows);
+        return [sheet] {
+            std::ostringstream out;
+            sheet->PrintValues(out, {{rows / 2, 0}, {rows / 2 + 49, 3}});
+            Consume(static_cast<double>(out.str().size()));
+            return size_t{50 * 4};
+        };
+    });
+
+    runner.Run("viewport/print_values_all_10000x4", [] {
+        std::shared_ptr<Sheet> sheet = MakeFillDown(rows);
+        return [sheet] {
+            std::ostringstream out;
+            sheet->PrintValues(out);
+            Consume(static_cast<double>(out.str().size()));
+            return static_cast<size_t>(rows * 4);
+        };
+    });
+}
+
+void RegisterExportBenchmarks(BenchmarkRunner& runner) {
+    // значения 10000x4 (три столбца чисел и формулы =A*B+C); items - ячейки
+    const int rows = 10000;
+    runner.Run("export/binary_values_10000x4", [] {
+        std::shared_ptr<Sheet> sheet = MakeFillDown(rows);
+        sheet->EvaluateAll();
+        auto buffer = std::make_shared<std::vector<char>>(1 << 20);
+        return [sheet, buffer] {
+            const size_t size = ExportValues(*sheet, {{0, 0}, {rows - 1, 3}}, buffer->data(), buffer->size());
+            Consume(static_cast<double>(size));
+            return static_cast<size_t>(rows * 4);
+        };
+    });
+
+    runner.Run("export/print_values_10000x4", [] {
+        std::shared_ptr<Sheet> sheet = MakeFillDown(rows);
+        sheet->EvaluateAll();
+        return [sheet] {
+            std::ostringstream out;
+            sheet->PrintValues(out);
+            Consume(static_cast<double>(out.str().size()));
+            return static_cast<size_t>(rows * 4);
+        };
+    });
+
+    // правка одного входа между выгрузками: только изменения против полной печати
+    runner.Run("export/value_changes_after_edit_10000x4", [] {
+        std::shared_ptr<Sheet> sheet = MakeFillDown(rows);
+        auto since = std::make_shared<uint64_t>(sheet->GetValueChanges(0).revision);
+        auto next = std::make_shared<int>(0);
+        return [sheet, since, next] {
+            const int row = (*next)++ % rows;
+            sheet->SetCell({row, 0}, std::to_string(row + *next));
+            const auto changes = sheet->GetValueChanges(*since);
+            *since = changes.revision;
+            Consume(static_cast<double>(changes.values.size()));
+            return size_t{1};
+        };
+    });
+
+    runner.Run("export/print_values_after_edit_10000x4", [] {
+        std::shared_ptr<Sheet> sheet = MakeFillDown(rows);
+        sheet->EvaluateAll();
+        auto next = std::make_shared<int>(0);
+        return [sheet, next] {
+            const int row = (*next)++ % rows;
+            sheet->SetCell({row, 0}, std::to_string(row + *next));
+            std::ostringstream out;
+            sheet->PrintValues(out);
+            Consume(static_cast<double>(out.str().size()));
+            return size_t{1};
+        };
+    });
+}
+
+void RegisterWorkbookBenchmarks(BenchmarkRunner& runner) {
+    // 8 листов Region0..7 с цепочкой B(i) = B(i-1)*1.01+A(i) по 2000 строк и лист
+    // Total с суммой их последних значений; items - формулы, пересчитанные после
+    // правки A1 каждого региона
+    const int regions = 8;
+    const int rows = 2000;
+    const auto make_book = [] {
+        auto book = std::make_shared<Workbook>();
+        std::string total = "=0";
+        for (int region = 0; region < regions; ++region) {
+            const std::string name = "Region" + std::to_string(region);
+            auto& sheet = book->AddSheet(name);
+            sheet.SetCell({0, 1}, "=A1");
+            for (int row = 0; row < rows; ++row) {
+                sheet.SetCell({row, 0}, std::to_string(row % 10));
+                if (row > 0) {
+                    sheet.SetCell({row, 1}, "=" + CellName(row - 1, 1) + "*1.01+" + CellName(row, 0));
+                }
+            }
+            total += "+" + name + "!" + CellName(rows - 1, 1);
+        }
+        book->AddSheet("Total").SetCell({0, 0}, total);
+        book->EvaluateAll();
+        for (int region = 0; region < regions; ++region) {
+            book->GetSheet("Region" + std::to_string(region))->SetCell({0, 0}, "1");
+        }
+        return book;
+    };
+    for (const unsigned threads : {1u, 0u}) {
+        const std::string suffix = threads == 1 ? "_single_thread" : "";
+        runner.Run("workbook/evaluate_8_sheets" + suffix, [make_book, threads] {
+            auto book = make_book();
+            return [book, threads] {
+                book->EvaluateAll(threads);
+                return static_cast<size_t>(regions * rows + 1);
+            };
+        });
+    }
+}
+
+void RegisterStructureBenchmarks(BenchmarkRunner& runner) {
+    // 2000 строк: столбцы A-C - числа, D - формулы; items - сдвинутые ячейки
+    const int rows = 2000;
+    for (const int row : {0, rows / 2, rows - 10}) {
+        runner.Run("structure/insert_row_at_" + std::to_string(row) + "_of_2000x4", [row] {
+            std::shared_ptr<Sheet> sheet = MakeFillDown(rows);
+            return [sheet, row] {
+                sheet->InsertRows(row);
+                return static_cast<size_t>((rows - row) * 4);
+            };
+        });
+    }
+    runner.Run("structure/delete_col_0_of_2000x4", [] {
+        std::shared_ptr<Sheet> sheet = MakeFillDown(rows);
+        return [sheet] {
+            sheet->DeleteCols(0);
+            return static_cast<size_t>(rows * 4);
+        };
+    });
+}
+
+int main(int argc, char** argv) {
+    BenchmarkRunner runner(argc, argv);
+    RegisterSheetBenchmarks(runner);
+    RegisterFormulaBenchmarks(runner);
+    RegisterPositionBenchmarks(runner);
+    RegisterNumberFormatBenchmarks(runner);
+    RegisterProfilerBenchmarks(runner);
+    RegisterCutoffBenchmarks(runner);
+    RegisterBatchBenchmarks(runner);
+    RegisterCellMapBenchmarks(runner);
+    RegisterCloneBenchmarks(runner);
+    RegisterSweepBenchmarks(runner);
+    RegisterStructureBenchmarks(runner);
+    RegisterFillBenchmarks(runner);
+    RegisterClearBenchmarks(runner);
+    RegisterWorkbookBenchmarks(runner);
+    RegisterViewportBenchmarks(runner);
+    RegisterExportBenchmarks(runner);
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Минимальный раннер бенчмарков. Каждый замер - функция, которая выполняет
+// нагрузку и возвращает число обработанных элементов (ячеек, формул и т.п.).
+// Подготовка данных делается в setup и в замер не входит.
+// Результаты печатаются по одному JSON-объекту на строку.
+class BenchmarkRunner {
+public:
+    using Setup = std::function<std::function<size_t()>()>;
+
+    BenchmarkRunner(int argc, char** argv) {
+        for (int i = 1; i < argc; ++i) {
+            std::string_view arg = argv[i];
+            if (arg == "--filter" && i + 1 < argc) {
+                filter_ = argv[++i];
+            } else if (arg == "--repetitions" && i + 1 < argc) {
+                repetitions_ = std::max(1, std::stoi(argv[++i]));
+            } else if (arg == "--list") {
+                list_only_ = true;
+            }
+        }
+    }
+
+    void Run(const std::string& name, Setup setup) {
+        if (!filter_.empty() && name.find(filter_) == std::string::npos) {
+            return;
+        }
+        if (list_only_) {
+            std::cout << name << '\n';
+            return;
+        }
+        std::vector<double> samples;
+        size_t items = 0;
+        Counters().clear();
+        for (int i = 0; i < repetitions_; ++i) {
+            auto body = setup();
+            const auto start = std::chrono::steady_clock::now();
+            items = body();
+            const auto finish = std::chrono::steady_clock::now();
+            samples.push_back(std::chrono::duration<double>(finish - start).count());
+        }
+        std::sort(samples.begin(), samples.end());
+        const double best = samples.front();
+        const double median = samples[samples.size() / 2];
+        std::cout << "{\"name\":\"" << name << "\""
+                  << ",\"repetitions\":" << repetitions_
+                  << ",\"items\":" << items
+                  << ",\"best_s\":" << best
+                  << ",\"median_s\":" << median
+                  << ",\"ns_per_item\":" << (items > 0 ? median * 1e9 / items : 0.)
+                  << ",\"items_per_s\":" << (median > 0 ? items / median : 0.);
+        for (const auto& [counter, value] : Counters()) {
+            std::cout << ",\"" << counter << "\":" << value;
+        }
+        std::cout << "}" << std::endl;
+    }
+
+    // Дополнительные показатели замера (значение последнего повтора).
+    static std::map<std::string, double>& Counters() {
+        static std::map<std::string, double> counters;
+        return counters;
+    }
+
+private:
+    std::string filter_;
+    int repetitions_ = 5;
+    bool list_only_ = false;
+};
+
+// Не даёт компилятору выбросить вычисление результата.
+inline volatile double benchmark_sink = 0.;
+
+inline void Consume(double value) {
+    benchmark_sink = benchmark_sink + value;
+}
@@ -1,184 +1,436 @@
-#include "cell.h"
-
-#include <cassert>
-#include <iostream>
-#include <string>
-#include <optional>
-#include <sstream>
-
-
-
-Cell::Cell(std::string text, Position pos, SheetInterface& sheet) : pos_(pos), sheet_(sheet) {
-    Clear();
-    Set(text);
-}
-
-Cell::~Cell() {
-    
-}
-
-void Cell::ClearRefs() {
-    for (const auto& pos : GetReferencedCells()) {
-        auto* cell = reinterpret_cast<Cell*>(sheet_.GetCell(pos));
-        if (cell != nullptr) {
-            cell->DelReference(pos_);
-        }
-    }
-}
-
-void Cell::Invalidate() {
-    has_value_ = false;
-    for (const auto& pos : references_) {
-        auto* cell = sheet_.GetCell(pos);
-        if (cell != nullptr) {
-            cell->Invalidate();
-        }
-    }
-}
-
-bool Cell::CheckDependencies(const std::vector<Position>& refs) const {
-    for (const auto& pos : refs) {
-        if (pos == pos_) {
-            return false;
-        }
-        auto* cell = sheet_.GetCell(pos);
-        if (cell != nullptr && !CheckDependencies(cell->GetReferencedCells())) {
-            return false;
-        }
-    }
-    return true;
-}
-
-void Cell::Set(std::string text) {
-    Invalidate();
-    ClearRefs();
-    if (text.empty()) {
-        impl_ = std::make_unique<EmptyImpl>();
-    } else if (text[0] == ESCAPE_SIGN) {
-        impl_ = std::make_unique<TextImpl>(text);
-    } else if (text[0] == FORMULA_SIGN && text.size() > 1) {
-        auto new_impl = std::make_unique<FormulaImpl>(text, sheet_);
-        const auto refs = new_impl->GetReferencedCells();
-        if (!CheckDependencies(refs)) {
-            throw CircularDependencyException("circular dependency");
-        }
-        
-        for (const auto& pos : refs) {
-            auto* cell = sheet_.GetCell(pos);
-            if (cell == nullptr) {
-                sheet_.SetCell(pos, "");
-            }
-            sheet_.GetCell(pos)->AddReference(pos_);
-        }
-        
-        impl_ = std::move(new_impl);
-    } else {
-        impl_ = std::make_unique<TextImpl>(text);
-    }
-}
-
-void Cell::Clear() {
-    impl_ = std::make_unique<EmptyImpl>();
-}
-
-Cell::Value Cell::GetValue() const {
-    if (has_value_) {
-        return cache_;
-    }
-    cache_ = impl_->GetValue();
-    has_value_ = true;
-    return cache_;
-}
-
-std::string Cell::GetText() const {
-    return impl_->GetText();
-}
-
-std::vector<Position> Cell::GetReferencedCells() const {
-    return impl_->GetReferencedCells();
-}
-
-bool Cell::IsReferenced() const {
-    return !references_.empty();
-}
-
-bool Cell::Empty() const {
-    return impl_->Empty();
-}
-
-void Cell::AddReference(const Position& pos) {
-    references_.insert(pos);
-}
-
-void Cell::DelReference(const Position& pos) {
-    references_.erase(pos);
-}
-
-Cell::Impl::Impl(const std::string& text) : raw_text_(text) {
-}
-
-Cell::EmptyImpl::EmptyImpl() : Cell::Impl("") {
-}
-
-CellInterface::Value Cell::EmptyImpl::GetValue() const {
-    return raw_text_;
-}
-
-std::string Cell::EmptyImpl::GetText() const {
-    return raw_text_;
-}
-
-std::vector<Position> Cell::EmptyImpl::GetReferencedCells() const {
-    return {};
-}
-
-bool Cell::EmptyImpl::Empty() const {
-    return true;
-}
-
-Cell::TextImpl::TextImpl(const std::string& text) : Cell::Impl(text) {
-}
-
-CellInterface::Value Cell::TextImpl::GetValue() const {
-    if (!raw_text_.empty() && raw_text_[0] == ESCAPE_SIGN) {
-        return raw_text_.substr(1);
-    }
-    return raw_text_;
-}
-
-std::string Cell::TextImpl::GetText() const {
-    return raw_text_;
-}
-
-std::vector<Position> Cell::TextImpl::GetReferencedCells() const {
-    return {};
-}
-
-bool Cell::TextImpl::Empty() const {
-    return false;
-}
-
-Cell::FormulaImpl::FormulaImpl(const std::string& text, SheetInterface& sheet) : Cell::Impl(text), sheet_(sheet) {
-    formula_ = ParseFormula(raw_text_.substr(1));
-}
-
-CellInterface::Value Cell::FormulaImpl::GetValue() const {
-    auto result = formula_->Evaluate(sheet_);
-    ValueVisitor ans;
-    std::visit(ans, result);
-    return ans.result;
-}
-
-std::string Cell::FormulaImpl::GetText() const {
-    std::stringstream ss;
-    ss << '=' << formula_->GetExpression();
-    return ss.str();
-}
-
-std::vector<Position> Cell::FormulaImpl::GetReferencedCells() const {
-    return formula_->GetReferencedCells();
-}
-
-bool Cell::FormulaImpl::Empty() const {
-    return false;
-}
+#include "cell.h"
+
+#include "profiler.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <cassert>
+#include <iostream>
+#include <string>
+#include <optional>
+#include <sstream>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+
+
+Cell::Cell(std::string text, Position pos, Sheet& sheet) : pos_(pos), sheet_(sheet) {
+    operand_.cell = this;
+    Clear();
+    Set(text);
+}
+
+Cell::Cell(const Cell& other, Sheet& sheet)
+    : operand_(other.operand_),
+      has_cache_(other.has_cache_),
+      content_changed_(other.content_changed_),
+      verified_at_(other.verified_at_),
+      pos_(other.pos_),
+      sheet_(sheet),
+      cache_(other.cache_),
+      impl_(other.impl_) {
+    operand_.cell = this;
+}
+
+Cell::~Cell() {
+    
+}
+
+void Cell::ClearRefs() {
+    for (const auto& pos : GetReferencedCells()) {
+        sheet_.RemoveDependency(pos_, pos);
+    }
+    if (const auto* formula = GetFormula()) {
+        for (const auto& ref : formula->GetSheetReferences()) {
+            sheet_.RemoveSheetDependency(pos_, ref);
+        }
+    }
+}
+
+void Cell::AddRefs() {
+    for (const auto& pos : GetReferencedCells()) {
+        sheet_.AddDependency(pos_, pos);
+    }
+    if (const auto* formula = GetFormula()) {
+        for (const auto& ref : formula->GetSheetReferences()) {
+            sheet_.AddSheetDependency(pos_, ref);
+        }
+    }
+}
+
+void Cell::Invalidate() {
+    if (!operand_.ready) {
+        // зависимые ячейки уже помечены: актуальная ячейка не может
+        // зависеть от неактуальной
+        return;
+    }
+    operand_.ready = false;
+    sheet_.InvalidateDependents(pos_);
+}
+
+bool Cell::Recalculate() {
+    operand_.ready = false;
+    GetValue();
+    return operand_.changed_at == sheet_.GetRevision();
+}
+
+uint64_t Cell::GetChangedAt() const {
+    return operand_.changed_at;
+}
+
+bool Cell::InputsUnchanged() const {
+    const auto* formula = GetFormula();
+    if (formula != nullptr && !formula->GetSheetReferences().empty()) {
+        // номера правок разных листов несравнимы: ячейку сбрасывает книга, и она
+        // пересчитывается
+        return false;
+    }
+    if (inputs_layout_ != sheet_.GetLayoutVersion()) {
+        for (const auto& pos : GetFormulaCells()) {
+            if (sheet_.GetChangedAt(pos) > verified_at_) {
+                return false;
+            }
+        }
+        GetInputs();
+        return true;
+    }
+    // Входы привязаны после последнего удаления ячеек в их позициях, то есть
+    // не позже verified_at_: пустые входы с тех пор не менялись.
+    for (const auto* input : inputs_) {
+        if (input->cell == nullptr) {
+            continue;
+        }
+        if (!input->ready) {
+            input->cell->GetValue();
+        }
+        if (input->changed_at > verified_at_) {
+            return false;
+        }
+    }
+    return true;
+}
+
+namespace {
+// Ведут ли ссылки формулы листа sheet, прямо или через другие ячейки и листы
+// книги, к ячейке target листа target_sheet. Обход в глубину без рекурсии:
+// ячейка, до которой дошли по разным путям, раскрывается один раз.
+bool Reaches(const SheetInterface& sheet, const FormulaInterface& formula, const SheetInterface& target_sheet,
+             Position target) {
+    std::unordered_map<const SheetInterface*, CellSet> visited;
+    std::vector<std::pair<const SheetInterface*, Position>> stack;
+    const auto push_refs = [&stack](const SheetInterface& from, const FormulaInterface& from_formula) {
+        for (const auto& pos : from_formula.GetReferencedCells()) {
+            stack.emplace_back(&from, pos);
+        }
+        for (const auto& ref : from_formula.GetSheetReferences()) {
+            if (const auto* other = from.FindSheet(ref.sheet)) {
+                stack.emplace_back(other, ref.pos);
+            }
+        }
+    };
+    push_refs(sheet, formula);
+    while (!stack.empty()) {
+        const auto [cell_sheet, pos] = stack.back();
+        stack.pop_back();
+        if (cell_sheet == &target_sheet && pos == target) {
+            return true;
+        }
+        if (!pos.IsValid() || !visited[cell_sheet].insert(pos)) {
+            continue;
+        }
+        const auto* cell = static_cast<const Cell*>(cell_sheet->GetCell(pos));
+        if (const auto* cell_formula = cell != nullptr ? cell->GetFormula() : nullptr) {
+            push_refs(*cell_sheet, *cell_formula);
+        }
+    }
+    return false;
+}
+}  // namespace
+
+void Cell::Set(std::string text) {
+    if (!text.empty() && text[0] == FORMULA_SIGN && text.size() > 1) {
+        std::unique_ptr<FormulaImpl> new_impl;
+        {
+            PROFILE_PARSE(sheet_, pos_);
+            new_impl = std::make_unique<FormulaImpl>(text);
+        }
+        SetFormula(std::move(new_impl));
+        return;
+    }
+    std::unique_ptr<Impl> new_impl;
+    if (text.empty()) {
+        new_impl = std::make_unique<EmptyImpl>();
+    } else {
+        new_impl = std::make_unique<TextImpl>(text);
+    }
+    operand_.ready = false;
+    content_changed_ = true;
+    inputs_layout_ = 0;
+    ClearRefs();
+    impl_ = std::move(new_impl);
+}
+
+void Cell::Set(std::unique_ptr<FormulaInterface> formula) {
+    SetFormula(std::make_unique<FormulaImpl>(std::move(formula)));
+}
+
+void Cell::SetFormula(std::unique_ptr<FormulaImpl> new_impl) {
+    if (Reaches(sheet_, *new_impl->GetFormula(), sheet_, pos_)) {
+        throw CircularDependencyException("circular dependency");
+    }
+    operand_.ready = false;
+    content_changed_ = true;
+    inputs_layout_ = 0;
+    ClearRefs();
+    impl_ = std::move(new_impl);
+    AddRefs();
+}
+
+void Cell::SetPosition(Position pos) {
+    pos_ = pos;
+}
+
+void Cell::ReplaceFormula(std::unique_ptr<FormulaInterface> formula) {
+    operand_.ready = false;
+    content_changed_ = true;
+    inputs_layout_ = 0;
+    impl_ = std::make_shared<FormulaImpl>(std::move(formula));
+}
+
+void Cell::CopyFrom(const Cell& source, int row_shift, int col_shift) {
+    auto new_impl = source.impl_;
+    const auto* formula = source.GetFormula();
+    if (formula != nullptr && !formula->GetReferencedCells().empty()) {
+        new_impl = std::make_shared<FormulaImpl>(formula->MapCells([row_shift, col_shift](Position pos) {
+            pos.row += row_shift;
+            pos.col += col_shift;
+            return pos.IsValid() ? pos : Position::NONE;
+        }));
+    }
+    operand_.ready = false;
+    content_changed_ = true;
+    inputs_layout_ = 0;
+    ClearRefs();
+    impl_ = std::move(new_impl);
+    AddRefs();
+}
+
+void Cell::Clear() {
+    impl_ = std::make_shared<EmptyImpl>();
+}
+
+Cell::Value Cell::GetValue() const {
+    if (operand_.ready) {
+        PROFILE_CACHE_HIT(sheet_, pos_);
+        return cache_;
+    }
+    const auto revision = sheet_.GetRevision();
+    if (has_cache_ && !content_changed_ && InputsUnchanged()) {
+        // входы сохранили свои значения, прежний результат остаётся верным
+        PROFILE_CACHE_HIT(sheet_, pos_);
+        verified_at_ = revision;
+        operand_.ready = true;
+        return cache_;
+    }
+    PROFILE_EVALUATION(sheet_, pos_);
+    StoreValue(impl_->GetValue(sheet_, GetFormula() != nullptr ? GetInputs() : nullptr));
+    return cache_;
+}
+
+const CellOperand* const* Cell::GetInputs() const {
+    const uint64_t layout = sheet_.GetLayoutVersion();
+    if (inputs_layout_ != layout) {
+        const auto& refs = GetFormulaCells();
+        inputs_.resize(refs.size());
+        std::transform(refs.begin(), refs.end(), inputs_.begin(), [this](Position pos) {
+            return sheet_.FindOperand(pos);
+        });
+        inputs_layout_ = layout;
+    }
+    return inputs_.data();
+}
+
+void Cell::UpdateOperand() const {
+    operand_.is_error = false;
+    operand_.number = 0.;
+    if (const auto* number = std::get_if<double>(&cache_)) {
+        operand_.number = *number;
+    } else if (const auto* error = std::get_if<FormulaError>(&cache_)) {
+        operand_.is_error = true;
+        operand_.error = error->GetCategory();
+    } else {
+        // текст разобран один раз при установке ячейки
+        const auto& text = std::get<std::string>(cache_);
+        if (!text.empty() && !impl_->GetNumber(operand_.number)) {
+            operand_.is_error = true;
+            operand_.error = FormulaError::Category::Value;
+        }
+    }
+}
+
+void Cell::StoreValue(Value value) const {
+    const auto revision = sheet_.GetRevision();
+    if (!has_cache_ || !(value == cache_)) {
+        operand_.changed_at = revision;
+        cache_ = std::move(value);
+        UpdateOperand();
+    }
+    has_cache_ = true;
+    content_changed_ = false;
+    verified_at_ = revision;
+    operand_.ready = true;
+}
+
+const FormulaInterface* Cell::GetFormula() const {
+    return impl_->GetFormula();
+}
+
+void Cell::CountMemory(SheetMemoryStats& stats) const {
+    stats.cells += sizeof(*this) + inputs_.capacity() * sizeof(const CellOperand*);
+    const size_t content = impl_->GetMemoryUsage() / std::max<long>(impl_.use_count(), 1);
+    (GetFormula() != nullptr ? stats.formulas : stats.texts) += content;
+    if (const auto* text = std::get_if<std::string>(&cache_)) {
+        stats.values += GetStringMemory(*text);
+    }
+}
+
+bool Cell::IsUpToDate() const {
+    return operand_.ready;
+}
+
+std::string Cell::GetText() const {
+    return impl_->GetText();
+}
+
+const std::vector<Position>& Cell::GetFormulaCells() const {
+    static const std::vector<Position> NO_CELLS;
+    const auto* formula = GetFormula();
+    return formula != nullptr ? formula->GetReferencedCells() : NO_CELLS;
+}
+
+std::vector<Position> Cell::GetReferencedCells() const {
+    return impl_->GetReferencedCells();
+}
+
+bool Cell::IsReferenced() const {
+    return sheet_.GetDependents(pos_) != nullptr;
+}
+
+bool Cell::Empty() const {
+    return impl_->Empty();
+}
+
+bool Cell::GetNumber(double& value) const {
+    return impl_->GetNumber(value);
+}
+
+Cell::Impl::Impl(const std::string& text) : raw_text_(text) {
+}
+
+bool Cell::Impl::GetNumber(double& value) const {
+    return false;
+}
+
+const FormulaInterface* Cell::Impl::GetFormula() const {
+    return nullptr;
+}
+
+Cell::EmptyImpl::EmptyImpl() : Cell::Impl("") {
+}
+
+CellInterface::Value Cell::EmptyImpl::GetValue(SheetInterface&, const CellOperand* const*) const {
+    return raw_text_;
+}
+
+std::string Cell::EmptyImpl::GetText() const {
+    return raw_text_;
+}
+
+std::vector<Position> Cell::EmptyImpl::GetReferencedCells() const {
+    return {};
+}
+
+bool Cell::EmptyImpl::Empty() const {
+    return true;
+}
+
+size_t Cell::EmptyImpl::GetMemoryUsage() const {
+    return sizeof(*this);
+}
+
+Cell::TextImpl::TextImpl(const std::string& text) : Cell::Impl(text) {
+    std::string_view value = raw_text_;
+    if (value[0] == ESCAPE_SIGN) {
+        value.remove_prefix(1);
+    }
+    is_number_ = ParseNumber(value, number_);
+}
+
+CellInterface::Value Cell::TextImpl::GetValue(SheetInterface&, const CellOperand* const*) const {
+    if (!raw_text_.empty() && raw_text_[0] == ESCAPE_SIGN) {
+        return raw_text_.substr(1);
+    }
+    return raw_text_;
+}
+
+std::string Cell::TextImpl::GetText() const {
+    return raw_text_;
+}
+
+std::vector<Position> Cell::TextImpl::GetReferencedCells() const {
+    return {};
+}
+
+bool Cell::TextImpl::Empty() const {
+    return false;
+}
+
+size_t Cell::TextImpl::GetMemoryUsage() const {
+    return sizeof(*this) + GetStringMemory(raw_text_);
+}
+
+bool Cell::TextImpl::GetNumber(double& value) const {
+    if (is_number_) {
+        value = number_;
+    }
+    return is_number_;
+}
+
+Cell::FormulaImpl::FormulaImpl(const std::string& text) : Cell::Impl(text) {
+    formula_ = ParseFormula(raw_text_.substr(1));
+}
+
+Cell::FormulaImpl::FormulaImpl(std::unique_ptr<FormulaInterface> formula)
+    : Cell::Impl(std::string()), formula_(std::move(formula)) {
+    // текст не хранится: GetText печатает его по дереву формулы
+}
+
+CellInterface::Value Cell::FormulaImpl::GetValue(SheetInterface& sheet, const CellOperand* const* inputs) const {
+    auto result = formula_->Evaluate(sheet, inputs);
+    ValueVisitor ans;
+    std::visit(ans, result);
+    return ans.result;
+}
+
+std::string Cell::FormulaImpl::GetText() const {
+    std::stringstream ss;
+    ss << '=' << formula_->GetExpression();
+    return ss.str();
+}
+
+std::vector<Position> Cell::FormulaImpl::GetReferencedCells() const {
+    return formula_->GetReferencedCells();
+}
+
+bool Cell::FormulaImpl::Empty() const {
+    return false;
+}
+
+size_t Cell::FormulaImpl::GetMemoryUsage() const {
+    return sizeof(*this) + GetStringMemory(raw_text_) + formula_->GetMemoryUsage();
+}
+
+const FormulaInterface* Cell::FormulaImpl::GetFormula() const {
+    return formula_.get();
+}
@@ -1,85 +1,156 @@
-#pragma once
-
-#include "common.h"
-#include "formula.h"
-
-#include <functional>
-#include <unordered_set>
-
-class Cell : public CellInterface {
-public:
-    explicit Cell(std::string text, Position pos, SheetInterface& sheet);
-    ~Cell();
-
-    void Set(std::string text);
-    void Clear();
-
-    Value GetValue() const override;
-    std::string GetText() const override;
-    std::vector<Position> GetReferencedCells() const override;
-
-    bool IsReferenced() const;
-
-    void AddReference(const Position& pos) override;
-    void DelReference(const Position& pos) override;
-    void Invalidate() override;
-
-private:
-    class Impl {
-    public:
-        Impl(const std::string& text);
-        virtual CellInterface::Value GetValue() const = 0;
-        virtual std::string GetText() const = 0;
-        virtual std::vector<Position> GetReferencedCells() const = 0;
-        virtual bool Empty() const = 0;
-    protected:
-        const std::string raw_text_;
-    };
-    class EmptyImpl : public Impl {
-    public:
-        EmptyImpl();
-        CellInterface::Value GetValue() const override;
-        std::string GetText() const override;
-        std::vector<Position> GetReferencedCells() const override;
-        bool Empty() const override;
-    };
-    class TextImpl : public Impl {
-    public:
-        TextImpl(const std::string& text);
-        CellInterface::Value GetValue() const override;
-        std::string GetText() const override;
-        std::vector<Position> GetReferencedCells() const override;
-        bool Empty() const override;
-    };
-    class FormulaImpl : public Impl {
-    public:
-        FormulaImpl(const std::string& text, SheetInterface& sheet);
-        CellInterface::Value GetValue() const override;
-        std::string GetText() const override;
-        std::vector<Position> GetReferencedCells() const override;
-        bool Empty() const override;
-    private:
-        struct ValueVisitor {
-            CellInterface::Value result;
-            void operator()(const double& val) {
-                result = val;
-            }
-            void operator()(const FormulaError& val) {
-                result = val;
-            }
-        };
-        SheetInterface& sheet_;
-        std::unique_ptr<FormulaInterface> formula_;
-    };
-
-    void ClearRefs();
-    bool Empty() const;
-    bool CheckDependencies(const std::vector<Position>& refs) const;
-
-    std::unordered_set<Position, PositionHash> references_;
-    mutable bool has_value_ = false;
-    const Position pos_;
-    SheetInterface& sheet_;
-    mutable Value cache_;
-    std::unique_ptr<Impl> impl_;
-};
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+
+#include <cstdint>
+#include <functional>
+#include <unordered_set>
+
+class Sheet;
+struct SheetMemoryStats;
+
+class Cell : public CellInterface {
+public:
+    explicit Cell(std::string text, Position pos, Sheet& sheet);
+    // Копия ячейки для другой таблицы (Sheet::Clone): содержимое общее,
+    // кеш значения копируется и дальше живёт отдельно.
+    Cell(const Cell& other, Sheet& sheet);
+    ~Cell();
+
+    void Set(std::string text);
+    // Устанавливает уже разобранную формулу, минуя повторный разбор текста.
+    void Set(std::unique_ptr<FormulaInterface> formula);
+    void Clear();
+
+    // Для вставки и удаления строк и столбцов: граф зависимостей таблица
+    // правит сама, циклов такие операции не создают.
+    void SetPosition(Position pos);
+    void ReplaceFormula(std::unique_ptr<FormulaInterface> formula);
+    // Содержимое source со ссылками формулы, сдвинутыми на (row_shift, col_shift);
+    // ссылка за край таблицы становится #REF!. Текст и формулы без ссылок
+    // остаются общими с source. Проверку циклов делает таблица.
+    void CopyFrom(const Cell& source, int row_shift, int col_shift);
+    // Убирает из графа таблицы ссылки ячейки (перед её удалением таблицей).
+    void ClearRefs();
+
+    Value GetValue() const override;
+    std::string GetText() const override;
+    std::vector<Position> GetReferencedCells() const override;
+
+    bool IsReferenced() const;
+    // Числовое значение текстовой ячейки; false для формул, пустых и нечисловых ячеек.
+    bool GetNumber(double& value) const;
+
+    void Invalidate() override;
+    // Пересчитывает значение, не трогая зависимые ячейки. Возвращает true,
+    // если новое значение отличается от сохранённого.
+    bool Recalculate();
+    // Номер правки таблицы, на которой значение ячейки изменилось в последний раз.
+    // Актуален после GetValue().
+    uint64_t GetChangedAt() const;
+
+    // Формула ячейки или nullptr, если в ячейке не формула.
+    const FormulaInterface* GetFormula() const;
+    bool IsUpToDate() const;
+    // Сохраняет значение, вычисленное снаружи (пакетное вычисление в Sheet),
+    // так же, как если бы его вернул GetValue().
+    void StoreValue(Value value) const;
+    // Добавляет в stats память ячейки. Содержимое, общее у нескольких ячеек
+    // (копии таблицы, протягивание), делится между ними поровну.
+    void CountMemory(SheetMemoryStats& stats) const;
+    // Значение ячейки как операнда формулы; адрес постоянен, пока ячейка существует.
+    const CellOperand& GetOperand() const {
+        return operand_;
+    }
+
+private:
+    class Impl {
+    public:
+        Impl(const std::string& text);
+        virtual ~Impl() = default;
+        virtual CellInterface::Value GetValue(SheetInterface& sheet, const CellOperand* const* inputs) const = 0;
+        virtual std::string GetText() const = 0;
+        virtual std::vector<Position> GetReferencedCells() const = 0;
+        virtual bool Empty() const = 0;
+        virtual bool GetNumber(double& value) const;
+        virtual const FormulaInterface* GetFormula() const;
+        // Байты содержимого, включая сам объект.
+        virtual size_t GetMemoryUsage() const = 0;
+    protected:
+        const std::string raw_text_;
+    };
+    class EmptyImpl : public Impl {
+    public:
+        EmptyImpl();
+        CellInterface::Value GetValue(SheetInterface& sheet, const CellOperand* const* inputs) const override;
+        std::string GetText() const override;
+        std::vector<Position> GetReferencedCells() const override;
+        bool Empty() const override;
+        size_t GetMemoryUsage() const override;
+    };
+    class TextImpl : public Impl {
+    public:
+        TextImpl(const std::string& text);
+        CellInterface::Value GetValue(SheetInterface& sheet, const CellOperand* const* inputs) const override;
+        std::string GetText() const override;
+        std::vector<Position> GetReferencedCells() const override;
+        bool Empty() const override;
+        size_t GetMemoryUsage() const override;
+        bool GetNumber(double& value) const override;
+    private:
+        bool is_number_ = false;
+        double number_ = 0.;
+    };
+    class FormulaImpl : public Impl {
+    public:
+        explicit FormulaImpl(const std::string& text);
+        explicit FormulaImpl(std::unique_ptr<FormulaInterface> formula);
+        CellInterface::Value GetValue(SheetInterface& sheet, const CellOperand* const* inputs) const override;
+        std::string GetText() const override;
+        std::vector<Position> GetReferencedCells() const override;
+        bool Empty() const override;
+        size_t GetMemoryUsage() const override;
+        const FormulaInterface* GetFormula() const override;
+    private:
+        struct ValueVisitor {
+            CellInterface::Value result;
+            void operator()(const double& val) {
+                result = val;
+            }
+            void operator()(const FormulaError& val) {
+                result = val;
+            }
+        };
+        std::unique_ptr<FormulaInterface> formula_;
+    };
+
+    void SetFormula(std::unique_ptr<FormulaImpl> new_impl);
+    bool Empty() const;
+    void AddRefs();
+    bool InputsUnchanged() const;
+    // Операнды ссылок формулы по порядку GetReferencedCells().
+    const CellOperand* const* GetInputs() const;
+    // Ссылки формулы без копирования; пустой список, если ячейка не формула.
+    const std::vector<Position>& GetFormulaCells() const;
+    void UpdateOperand() const;
+
+    // Неактуальная ячейка с сохранённым значением сначала проверяет, изменились ли
+    // значения её входов после verified_at_, и пересчитывается, только если да.
+    // operand_ повторяет cache_; ready - значение актуально, changed_at - номер
+    // правки, на которой значение изменилось в последний раз
+    mutable CellOperand operand_;
+    mutable bool has_cache_ = false;
+    mutable bool content_changed_ = true;
+    mutable uint64_t verified_at_ = 0;
+    Position pos_;
+    Sheet& sheet_;
+    mutable Value cache_;
+    // содержимое неизменяемо и может быть общим у ячеек разных копий таблицы
+    std::shared_ptr<const Impl> impl_;
+    // Операнды ячеек, на которые ссылается формула. Привязываются заново, когда
+    // меняется содержимое (inputs_layout_ = 0) или таблица создаёт, удаляет
+    // или двигает ячейки (Sheet::GetLayoutVersion).
+    mutable std::vector<const CellOperand*> inputs_;
+    mutable uint64_t inputs_layout_ = 0;
+};
@@ -0,0 +1,471 @@
+#pragma once
+
+#include "common.h"
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Хеш-таблица с открытой адресацией по корректным позициям таблицы.
+// Ключ - 28-битный CellKey. Четвёрки соседних по строке ячеек лежат
+// в соседних слотах, номер четвёрки перемешивается умножением на 2^32 / phi.
+// Коллизии разрешаются линейным пробированием, удаление сдвигает хвост
+// цепочки назад (без меток удалённых элементов).
+// Вставка (перехеширование) и удаление (сдвиг хвоста цепочки) перекладывают
+// элементы: итераторы и ссылки на значения действительны только до следующей
+// вставки или удаления.
+template <typename T>
+class CellMap {
+public:
+    using value_type = std::pair<Position, T>;
+
+    template <typename Value>
+    class Iterator {
+    public:
+        Iterator(Value* slot, const uint32_t* key, const uint32_t* keys_end)
+            : slot_(slot), key_(key), keys_end_(keys_end) {
+            SkipEmpty();
+        }
+
+        Value& operator*() const {
+            return *slot_;
+        }
+        Value* operator->() const {
+            return slot_;
+        }
+        Iterator& operator++() {
+            ++slot_;
+            ++key_;
+            SkipEmpty();
+            return *this;
+        }
+        bool operator==(const Iterator& rhs) const {
+            return key_ == rhs.key_;
+        }
+        bool operator!=(const Iterator& rhs) const {
+            return key_ != rhs.key_;
+        }
+
+    private:
+        void SkipEmpty() {
+            while (key_ != keys_end_ && *key_ == EMPTY) {
+                ++slot_;
+                ++key_;
+            }
+        }
+
+        Value* slot_;
+        const uint32_t* key_;
+        const uint32_t* keys_end_;
+    };
+
+    using iterator = Iterator<value_type>;
+    using const_iterator = Iterator<const value_type>;
+
+    iterator begin() {
+        return MakeIterator(0);
+    }
+    iterator end() {
+        return MakeIterator(keys_.size());
+    }
+    const_iterator begin() const {
+        return MakeIterator(0);
+    }
+    const_iterator end() const {
+        return MakeIterator(keys_.size());
+    }
+
+    size_t size() const {
+        return size_;
+    }
+    bool empty() const {
+        return size_ == 0;
+    }
+    size_t capacity() const {
+        return keys_.size();
+    }
+
+    iterator find(Position pos) {
+        return MakeIterator(FindSlot(pos));
+    }
+    const_iterator find(Position pos) const {
+        return MakeIterator(FindSlot(pos));
+    }
+
+    size_t count(Position pos) const {
+        return FindSlot(pos) != keys_.size() ? 1 : 0;
+    }
+
+    T& at(Position pos) {
+        const size_t slot = FindSlot(pos);
+        if (slot == keys_.size()) {
+            throw std::out_of_range("CellMap::at");
+        }
+        return slots_[slot].second;
+    }
+    const T& at(Position pos) const {
+        const size_t slot = FindSlot(pos);
+        if (slot == keys_.size()) {
+            throw std::out_of_range("CellMap::at");
+        }
+        return slots_[slot].second;
+    }
+
+    T& operator[](Position pos) {
+        assert(pos.IsValid());
+        if ((size_ + 1) * 4 > keys_.size() * 3) {
+            Rehash(keys_.empty() ? MIN_CAPACITY : keys_.size() * 2);
+        }
+        const uint32_t key = CellKey::FromPosition(pos).value;
+        size_t slot = GetBucket(key);
+        while (keys_[slot] != EMPTY) {
+            if (keys_[slot] == key) {
+                return slots_[slot].second;
+            }
+            slot = (slot + 1) & mask_;
+        }
+        keys_[slot] = key;
+        slots_[slot] = {pos, T {}};
+        ++size_;
+        return slots_[slot].second;
+    }
+
+    void erase(iterator it) {
+        EraseSlot(static_cast<size_t>(&*it - slots_.data()));
+    }
+    size_t erase(Position pos) {
+        const size_t slot = FindSlot(pos);
+        if (slot == keys_.size()) {
+            return 0;
+        }
+        EraseSlot(slot);
+        return 1;
+    }
+
+    void reserve(size_t count) {
+        const size_t capacity = GetCapacityFor(count);
+        if (capacity > keys_.size()) {
+            Rehash(capacity);
+        }
+    }
+
+    // Уменьшает таблицу до наименьшей ёмкости, вмещающей текущие элементы.
+    void shrink_to_fit() {
+        if (size_ == 0) {
+            clear();
+            keys_.shrink_to_fit();
+            slots_.shrink_to_fit();
+            return;
+        }
+        const size_t capacity = GetCapacityFor(size_);
+        if (capacity < keys_.size()) {
+            Rehash(capacity);
+        }
+    }
+
+    void clear() {
+        keys_.clear();
+        slots_.clear();
+        mask_ = 0;
+        shift_ = 32;
+        size_ = 0;
+    }
+
+private:
+    static constexpr uint32_t EMPTY = UINT32_MAX;
+    static constexpr size_t MIN_CAPACITY = 16;
+
+    static size_t GetCapacityFor(size_t count) {
+        size_t capacity = MIN_CAPACITY;
+        while (count * 4 > capacity * 3) {
+            capacity *= 2;
+        }
+        return capacity;
+    }
+
+    size_t GetBucket(uint32_t key) const {
+        // полное перемешивание ключа разбрасывало соседние ячейки по всей
+        // таблице, и обход листа по строкам упирался в промахи кеша
+        return (static_cast<uint32_t>((key >> 2) * 2654435769u) >> (shift_ + 2) << 2) | (key & 3);
+    }
+
+    // Номер слота с pos или keys_.size(), если её нет.
+    size_t FindSlot(Position pos) const {
+        if (size_ == 0 || static_cast<unsigned>(pos.row) >= Position::MAX_ROWS
+            || static_cast<unsigned>(pos.col) >= Position::MAX_COLS) {
+            return keys_.size();
+        }
+        const uint32_t key = CellKey::FromPosition(pos).value;
+        for (size_t slot = GetBucket(key); keys_[slot] != EMPTY; slot = (slot + 1) & mask_) {
+            if (keys_[slot] == key) {
+                return slot;
+            }
+        }
+        return keys_.size();
+    }
+
+    void EraseSlot(size_t slot) {
+        // сдвигаем назад элементы цепочки, которые иначе стали бы недостижимы
+        size_t next = (slot + 1) & mask_;
+        while (keys_[next] != EMPTY) {
+            const size_t home = GetBucket(keys_[next]);
+            // home лежит вне циклического интервала (slot, next]
+            if (((next - home) & mask_) >= ((next - slot) & mask_)) {
+                keys_[slot] = keys_[next];
+                slots_[slot] = std::move(slots_[next]);
+                slot = next;
+            }
+            next = (next + 1) & mask_;
+        }
+        keys_[slot] = EMPTY;
+        slots_[slot] = {};
+        --size_;
+    }
+
+    void Rehash(size_t capacity) {
+        auto old_keys = std::exchange(keys_, std::vector<uint32_t>(capacity, EMPTY));
+        auto old_slots = std::exchange(slots_, std::vector<value_type>(capacity));
+        mask_ = capacity - 1;
+        shift_ = 32;
+        for (size_t bits = capacity; bits > 1; bits >>= 1) {
+            --shift_;
+        }
+        for (size_t i = 0; i < old_keys.size(); ++i) {
+            if (old_keys[i] == EMPTY) {
+                continue;
+            }
+            size_t slot = GetBucket(old_keys[i]);
+            while (keys_[slot] != EMPTY) {
+                slot = (slot + 1) & mask_;
+            }
+            keys_[slot] = old_keys[i];
+            slots_[slot] = std::move(old_slots[i]);
+        }
+    }
+
+    iterator MakeIterator(size_t slot) {
+        return iterator(slots_.data() + slot, keys_.data() + slot, keys_.data() + keys_.size());
+    }
+    const_iterator MakeIterator(size_t slot) const {
+        return const_iterator(slots_.data() + slot, keys_.data() + slot, keys_.data() + keys_.size());
+    }
+
+    // ключи отдельно от значений: пробирование читает только их
+    std::vector<uint32_t> keys_;
+    std::vector<value_type> slots_;
+    size_t mask_ = 0;
+    int shift_ = 32;
+    size_t size_ = 0;
+};
+
+// Множество корректных позиций с той же раскладкой, что у CellMap, но без
+// значений: позиция восстанавливается из ключа, слот занимает 4 байта.
+// Рассчитано и на маленькие множества (зависимые одной ячейки).
+// Итераторы действительны только до следующей вставки или удаления.
+class CellSet {
+public:
+    class const_iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Position;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const Position*;
+        using reference = Position;
+
+        const_iterator(const uint32_t* key, const uint32_t* keys_end) : key_(key), keys_end_(keys_end) {
+            SkipEmpty();
+        }
+
+        Position operator*() const {
+            return CellKey {*key_}.ToPosition();
+        }
+        const_iterator& operator++() {
+            ++key_;
+            SkipEmpty();
+            return *this;
+        }
+        bool operator==(const const_iterator& rhs) const {
+            return key_ == rhs.key_;
+        }
+        bool operator!=(const const_iterator& rhs) const {
+            return key_ != rhs.key_;
+        }
+
+    private:
+        void SkipEmpty() {
+            while (key_ != keys_end_ && *key_ == EMPTY) {
+                ++key_;
+            }
+        }
+
+        const uint32_t* key_;
+        const uint32_t* keys_end_;
+    };
+
+    CellSet() = default;
+    CellSet(std::initializer_list<Position> positions) {
+        insert(positions.begin(), positions.end());
+    }
+    template <typename It>
+    CellSet(It first, It last) {
+        insert(first, last);
+    }
+
+    const_iterator begin() const {
+        return {keys_.data(), keys_.data() + keys_.size()};
+    }
+    const_iterator end() const {
+        return {keys_.data() + keys_.size(), keys_.data() + keys_.size()};
+    }
+
+    size_t size() const {
+        return size_;
+    }
+    bool empty() const {
+        return size_ == 0;
+    }
+    size_t capacity() const {
+        return keys_.size();
+    }
+
+    size_t count(Position pos) const {
+        return FindSlot(pos) != keys_.size() ? 1 : 0;
+    }
+
+    // true, если позиции ещё не было.
+    bool insert(Position pos) {
+        assert(pos.IsValid());
+        if ((size_ + 1) * 4 > keys_.size() * 3) {
+            Rehash(keys_.empty() ? MIN_CAPACITY : keys_.size() * 2);
+        }
+        const uint32_t key = CellKey::FromPosition(pos).value;
+        size_t slot = GetBucket(key);
+        while (keys_[slot] != EMPTY) {
+            if (keys_[slot] == key) {
+                return false;
+            }
+            slot = (slot + 1) & mask_;
+        }
+        keys_[slot] = key;
+        ++size_;
+        return true;
+    }
+    template <typename It>
+    void insert(It first, It last) {
+        // порядок другого множества с тем же хешем в растущей таблице
+        // сбивает ключи в одну цепочку: ёмкость выделяется заранее
+        if constexpr (std::is_base_of_v<std::forward_iterator_tag,
+                                        typename std::iterator_traits<It>::iterator_category>) {
+            reserve(size_ + static_cast<size_t>(std::distance(first, last)));
+        }
+        for (; first != last; ++first) {
+            insert(*first);
+        }
+    }
+
+    size_t erase(Position pos) {
+        size_t slot = FindSlot(pos);
+        if (slot == keys_.size()) {
+            return 0;
+        }
+        // сдвиг хвоста цепочки, как в CellMap
+        size_t next = (slot + 1) & mask_;
+        while (keys_[next] != EMPTY) {
+            const size_t home = GetBucket(keys_[next]);
+            if (((next - home) & mask_) >= ((next - slot) & mask_)) {
+                keys_[slot] = keys_[next];
+                slot = next;
+            }
+            next = (next + 1) & mask_;
+        }
+        keys_[slot] = EMPTY;
+        --size_;
+        return 1;
+    }
+
+    void reserve(size_t count) {
+        const size_t capacity = GetCapacityFor(count);
+        if (capacity > keys_.size()) {
+            Rehash(capacity);
+        }
+    }
+
+    void shrink_to_fit() {
+        if (size_ == 0) {
+            clear();
+            keys_.shrink_to_fit();
+            return;
+        }
+        const size_t capacity = GetCapacityFor(size_);
+        if (capacity < keys_.size()) {
+            Rehash(capacity);
+        }
+    }
+
+    void clear() {
+        keys_.clear();
+        mask_ = 0;
+        shift_ = 32;
+        size_ = 0;
+    }
+
+private:
+    static constexpr uint32_t EMPTY = UINT32_MAX;
+    static constexpr size_t MIN_CAPACITY = 4;
+
+    static size_t GetCapacityFor(size_t count) {
+        size_t capacity = MIN_CAPACITY;
+        while (count * 4 > capacity * 3) {
+            capacity *= 2;
+        }
+        return capacity;
+    }
+
+    size_t GetBucket(uint32_t key) const {
+        // в множестве нет обхода по строкам, ключ перемешивается целиком
+        return static_cast<uint32_t>(key * 2654435769u) >> shift_;
+    }
+
+    size_t FindSlot(Position pos) const {
+        if (size_ == 0 || static_cast<unsigned>(pos.row) >= Position::MAX_ROWS
+            || static_cast<unsigned>(pos.col) >= Position::MAX_COLS) {
+            return keys_.size();
+        }
+        const uint32_t key = CellKey::FromPosition(pos).value;
+        for (size_t slot = GetBucket(key); keys_[slot] != EMPTY; slot = (slot + 1) & mask_) {
+            if (keys_[slot] == key) {
+                return slot;
+            }
+        }
+        return keys_.size();
+    }
+
+    void Rehash(size_t capacity) {
+        auto old_keys = std::exchange(keys_, std::vector<uint32_t>(capacity, EMPTY));
+        mask_ = capacity - 1;
+        shift_ = 32;
+        for (size_t bits = capacity; bits > 1; bits >>= 1) {
+            --shift_;
+        }
+        for (const uint32_t key : old_keys) {
+            if (key == EMPTY) {
+                continue;
+            }
+            size_t slot = GetBucket(key);
+            while (keys_[slot] != EMPTY) {
+                slot = (slot + 1) & mask_;
+            }
+            keys_[slot] = key;
+        }
+    }
+
+    std::vector<uint32_t> keys_;
+    size_t mask_ = 0;
+    int shift_ = 32;
+    size_t size_ = 0;
+};
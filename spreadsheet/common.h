@@ -1,139 +1,214 @@
-#pragma once
-
-#include <iosfwd>
-#include <memory>
-#include <stdexcept>
-#include <string>
-#include <string_view>
-#include <variant>
-#include <vector>
-#include <optional>
-#include <unordered_set>
-
-struct Position {
-    int row = 0;
-    int col = 0;
-
-    bool operator==(Position rhs) const;
-    bool operator<(Position rhs) const;
-
-    bool IsValid() const;
-    std::string ToString() const;
-
-    static Position FromString(std::string_view str);
-
-    static const int MAX_ROWS = 16384;
-    static const int MAX_COLS = 16384;
-    static const Position NONE;
-};
-
-struct PositionHash {
-    /*std::hash<std::string> hasher;
-
-    size_t operator()(const Position& pos) const {
-        return hasher(pos.ToString());
-    }
-    */
-    std::hash<int> hasher;
-
-    size_t operator()(const Position& pos) const {
-        //return hasher(pos.col * Position::MAX_ROWS + pos.row);
-        return hasher(pos.row * Position::MAX_COLS + pos.col);
-    }
-};
-
-struct Size {
-    int rows = 0;
-    int cols = 0;
-
-    bool operator==(Size rhs) const;
-};
-
-class FormulaError {
-public:
-    enum class Category {
-        Ref,    // ссылка на ячейку с некорректной позицией
-        Value,  // ячейка не может быть трактована как число
-        Arithmetic,  // в результате вычисления возникло деление на ноль
-    };
-
-    FormulaError(Category category);
-
-    Category GetCategory() const;
-
-    bool operator==(FormulaError rhs) const;
-
-    std::string_view ToString() const;
-
-private:
-    Category category_;
-};
-
-std::ostream& operator<<(std::ostream& output, FormulaError fe);
-
-
-class InvalidPositionException : public std::out_of_range {
-public:
-    using std::out_of_range::out_of_range;
-};
-
-
-class FormulaException : public std::runtime_error {
-public:
-    using std::runtime_error::runtime_error;
-};
-
-
-class CircularDependencyException : public std::runtime_error {
-public:
-    using std::runtime_error::runtime_error;
-};
-
-
-class TableTooBigException : public std::runtime_error {
-public:
-    using std::runtime_error::runtime_error;
-};
-
-class CellInterface {
-public:
- 
-    using Value = std::variant<std::string, double, FormulaError>;
-
-    virtual ~CellInterface() = default;
-
-    virtual Value GetValue() const = 0;
-
-    virtual std::string GetText() const = 0;
-
-
-    virtual std::vector<Position> GetReferencedCells() const = 0;
-
-    virtual void AddReference(const Position& pos) = 0;
-    virtual void DelReference(const Position& pos) = 0;
-    virtual void Invalidate() = 0;
-
-};
-
-inline constexpr char FORMULA_SIGN = '=';
-inline constexpr char ESCAPE_SIGN = '\'';
-
-
-class SheetInterface {
-public:
-    virtual ~SheetInterface() = default;
-
-    virtual void SetCell(Position pos, std::string text) = 0;
-
-    virtual const CellInterface* GetCell(Position pos) const = 0;
-    virtual CellInterface* GetCell(Position pos) = 0;
-
-    virtual void ClearCell(Position pos) = 0;
-
-    virtual Size GetPrintableSize() const = 0;
-
-    virtual void PrintValues(std::ostream& output) const = 0;
-    virtual void PrintTexts(std::ostream& output) const = 0;
-};
-
-std::unique_ptr<SheetInterface> CreateSheet();
+#pragma once
+
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+#include <optional>
+#include <unordered_set>
+
+struct Position {
+    int row = 0;
+    int col = 0;
+
+    bool operator==(Position rhs) const;
+    bool operator<(Position rhs) const;
+
+    bool IsValid() const;
+    std::string ToString() const;
+    // Пишет имя позиции в buffer размером не меньше MAX_NAME_LENGTH (без
+    // завершающего нуля) и возвращает его длину; для некорректной позиции - 0.
+    size_t ToChars(char* buffer) const;
+
+    static Position FromString(std::string_view str);
+
+    static const int MAX_ROWS = 16384;
+    static const int MAX_COLS = 16384;
+    // "XFD16384"
+    static const int MAX_NAME_LENGTH = 8;
+    static const Position NONE;
+};
+
+// Корректная позиция, упакованная в 28 бит: строка в старших 14 битах,
+// столбец в младших.
+struct CellKey {
+    static const int COL_BITS = 14;
+
+    uint32_t value = 0;
+
+    static CellKey FromPosition(Position pos) {
+        return {static_cast<uint32_t>(pos.row) << COL_BITS | static_cast<uint32_t>(pos.col)};
+    }
+
+    Position ToPosition() const {
+        return {static_cast<int>(value >> COL_BITS), static_cast<int>(value & ((1u << COL_BITS) - 1))};
+    }
+
+    bool operator==(CellKey rhs) const {
+        return value == rhs.value;
+    }
+};
+
+struct PositionHash {
+    size_t operator()(const Position& pos) const {
+        // тождественная функция от упакованного ключа: std::unordered_map берёт
+        // остаток по простому числу корзин, а соседние ячейки попадают
+        // в соседние корзины (перемешивание замедляло поиск, см. cell_map/*)
+        return CellKey::FromPosition(pos).value;
+    }
+};
+
+// Ячейка другого листа книги в ссылке формулы (Лист2!A1).
+struct SheetPosition {
+    std::string sheet;
+    Position pos;
+
+    bool operator==(const SheetPosition& rhs) const;
+    bool operator<(const SheetPosition& rhs) const;
+};
+
+struct Size {
+    int rows = 0;
+    int cols = 0;
+
+    bool operator==(Size rhs) const;
+};
+
+// Прямоугольник ячеек от from до to включительно.
+struct CellRange {
+    Position from;
+    Position to;
+
+    // Обе позиции корректны, from не правее и не ниже to.
+    bool IsValid() const;
+    bool Contains(Position pos) const;
+    Size GetSize() const;
+};
+
+class FormulaError {
+public:
+    enum class Category {
+        Ref,    // ссылка на ячейку с некорректной позицией
+        Value,  // ячейка не может быть трактована как число
+        Arithmetic,  // в результате вычисления возникло деление на ноль
+    };
+
+    FormulaError(Category category);
+
+    Category GetCategory() const;
+
+    bool operator==(FormulaError rhs) const;
+
+    std::string_view ToString() const;
+
+private:
+    Category category_;
+};
+
+std::ostream& operator<<(std::ostream& output, FormulaError fe);
+
+
+class InvalidPositionException : public std::out_of_range {
+public:
+    using std::out_of_range::out_of_range;
+};
+
+
+class FormulaException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+
+class CircularDependencyException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+
+class TableTooBigException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+class CellInterface {
+public:
+ 
+    using Value = std::variant<std::string, double, FormulaError>;
+
+    virtual ~CellInterface() = default;
+
+    virtual Value GetValue() const = 0;
+
+    virtual std::string GetText() const = 0;
+
+
+    virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    virtual void Invalidate() = 0;
+
+};
+
+// Разбирает текст ячейки как число по тем же правилам, что и чтение double
+// из std::istream: допускаются ведущие пробелы и знак, текст должен быть
+// прочитан целиком, переполнение - не число.
+bool ParseNumber(std::string_view text, double& value);
+
+enum class NumberFormat {
+    // кратчайшая запись, из которой ParseNumber получает то же число
+    Shortest,
+    // прежний вывод operator<< потока: по умолчанию 6 значащих цифр
+    Stream,
+};
+
+inline constexpr size_t MAX_NUMBER_LENGTH = 32;
+
+// Пишет value в buffer размером не меньше MAX_NUMBER_LENGTH (без завершающего
+// нуля) и возвращает длину записи; Stream - как поток с настройками по умолчанию.
+size_t FormatNumber(double value, char* buffer, NumberFormat format = NumberFormat::Shortest);
+// Stream учитывает точность и флаги output.
+void PrintNumber(std::ostream& output, double value, NumberFormat format = NumberFormat::Shortest);
+
+// Динамическая память строки: 0, пока текст помещается во внутренний буфер.
+inline size_t GetStringMemory(const std::string& str) {
+    return str.capacity() > std::string().capacity() ? str.capacity() + 1 : 0;
+}
+
+inline constexpr char FORMULA_SIGN = '=';
+inline constexpr char ESCAPE_SIGN = '\'';
+
+
+class SheetInterface {
+public:
+    virtual ~SheetInterface() = default;
+
+    virtual void SetCell(Position pos, std::string text) = 0;
+
+    virtual const CellInterface* GetCell(Position pos) const = 0;
+    virtual CellInterface* GetCell(Position pos) = 0;
+
+    virtual void ClearCell(Position pos) = 0;
+
+    virtual Size GetPrintableSize() const = 0;
+
+    virtual void PrintValues(std::ostream& output) const = 0;
+    virtual void PrintTexts(std::ostream& output) const = 0;
+
+    // Число в ячейке, если его можно получить без вычисления значения ячейки.
+    // Используется формулами как быстрый путь; по умолчанию такого пути нет.
+    virtual bool TryGetNumber(Position pos, double& value) const {
+        return false;
+    }
+
+    // Лист той же книги с именем name для ссылок вида name!A1;
+    // nullptr, если такого листа нет или таблица не входит в книгу.
+    virtual SheetInterface* FindSheet(std::string_view name) const {
+        return nullptr;
+    }
+};
+
+std::unique_ptr<SheetInterface> CreateSheet();
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <memory>
+
+// Значение, которое копии таблицы (Sheet::Clone) разделяют до первой записи.
+template <typename T>
+class CopyOnWrite {
+public:
+    CopyOnWrite() : value_(std::make_shared<T>()) {
+    }
+
+    const T& operator*() const {
+        return *value_;
+    }
+    const T* operator->() const {
+        return value_.get();
+    }
+
+    // Для изменения: если значение ещё общее с другой таблицей, сначала копирует его.
+    T& Write() {
+        if (value_.use_count() > 1) {
+            value_ = std::make_shared<T>(*value_);
+        }
+        return *value_;
+    }
+
+private:
+    std::shared_ptr<T> value_;
+};
@@ -1,52 +1,189 @@
-#include "formula.h"
-
-#include "FormulaAST.h"
-
-#include <algorithm>
-#include <cassert>
-#include <cctype>
-#include <sstream>
-
-using namespace std::literals;
-
-namespace {
-class Formula : public FormulaInterface {
-public:
-    explicit Formula(std::string expression) : ast_(ParseFormulaAST(expression)) {
-        for (const Position& pos : ast_.GetCells()) {
-            referenced_cells_.insert(pos);
-        }
-    }
-
-    Value Evaluate(SheetInterface& sheet) const override {
-        try {
-            return ast_.Execute(sheet);
-        } catch (const FormulaError& fe) {
-            return fe;
-        }
-    }
-
-    std::string GetExpression() const override {
-        std::stringstream out;
-        ast_.PrintFormula(out);
-        return out.str();
-    }
-
-    std::vector<Position> GetReferencedCells() const override {
-        std::vector<Position> ans;
-        for (const auto& pos : referenced_cells_) {
-            ans.push_back(pos);
-        }
-        std::sort(ans.begin(), ans.end());
-        return ans;
-    }
-    
-private:
-    std::unordered_set<Position, PositionHash> referenced_cells_;
-    FormulaAST ast_;
-};
-}  // namespace
-
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
-    return std::make_unique<Formula>(std::move(expression));
-}
+#include "formula.h"
+
+#include "FormulaAST.h"
+#include "profiler.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <cmath>
+#include <sstream>
+
+using namespace std::literals;
+
+namespace {
+using Op = FormulaInstruction::Op;
+
+// Вычислитель формулы частого вида по её программе, минуя дерево разбора.
+using ShapeEvaluator = double (*)(const FormulaInstruction* code, SheetInterface& sheet,
+                                  const CellOperand* const* inputs);
+
+template <Op op>
+double Apply(double lhs, double rhs) {
+    double result;
+    if constexpr (op == Op::Add) {
+        result = lhs + rhs;
+    } else if constexpr (op == Op::Subtract) {
+        result = lhs - rhs;
+    } else if constexpr (op == Op::Multiply) {
+        result = lhs * rhs;
+    } else {
+        result = lhs / rhs;
+    }
+    if (!std::isfinite(result)) {
+        throw FormulaError(FormulaError::Category::Arithmetic);
+    }
+    return result;
+}
+
+double LoadCell(const FormulaInstruction& instruction, SheetInterface& sheet, const CellOperand* const* inputs) {
+    return ASTImpl::GetCellOperand(sheet, instruction.cell,
+                                   inputs != nullptr && instruction.input >= 0 ? inputs[instruction.input] : nullptr);
+}
+
+// =A1
+double EvaluateCell(const FormulaInstruction* code, SheetInterface& sheet, const CellOperand* const* inputs) {
+    return LoadCell(code[0], sheet, inputs);
+}
+
+// =-A1
+template <Op op>
+double EvaluateUnaryCell(const FormulaInstruction* code, SheetInterface& sheet, const CellOperand* const* inputs) {
+    const double value = LoadCell(code[0], sheet, inputs);
+    return op == Op::UnaryMinus ? -value : value;
+}
+
+// =A1+B1; правый операнд читается первым, как в дереве разбора,
+// чтобы из двух ошибок наружу выходила та же
+template <Op op>
+double EvaluateCellCell(const FormulaInstruction* code, SheetInterface& sheet, const CellOperand* const* inputs) {
+    const double rhs = LoadCell(code[1], sheet, inputs);
+    return Apply<op>(LoadCell(code[0], sheet, inputs), rhs);
+}
+
+// =A1*2
+template <Op op>
+double EvaluateCellNumber(const FormulaInstruction* code, SheetInterface& sheet, const CellOperand* const* inputs) {
+    return Apply<op>(LoadCell(code[0], sheet, inputs), code[1].number);
+}
+
+// =2*A1
+template <Op op>
+double EvaluateNumberCell(const FormulaInstruction* code, SheetInterface& sheet, const CellOperand* const* inputs) {
+    return Apply<op>(code[0].number, LoadCell(code[1], sheet, inputs));
+}
+
+template <Op op>
+ShapeEvaluator SelectBinary(Op lhs, Op rhs) {
+    if (lhs == Op::Cell && rhs == Op::Cell) {
+        return &EvaluateCellCell<op>;
+    }
+    if (lhs == Op::Cell && rhs == Op::Number) {
+        return &EvaluateCellNumber<op>;
+    }
+    if (lhs == Op::Number && rhs == Op::Cell) {
+        return &EvaluateNumberCell<op>;
+    }
+    return nullptr;
+}
+
+// nullptr, если для формулы такого вида нет отдельного вычислителя.
+ShapeEvaluator SelectEvaluator(const std::vector<FormulaInstruction>& code) {
+    if (code.size() == 1 && code[0].op == Op::Cell) {
+        return &EvaluateCell;
+    }
+    if (code.size() == 2 && code[0].op == Op::Cell) {
+        return code[1].op == Op::UnaryMinus ? &EvaluateUnaryCell<Op::UnaryMinus>
+                                            : &EvaluateUnaryCell<Op::UnaryPlus>;
+    }
+    if (code.size() != 3) {
+        return nullptr;
+    }
+    switch (code[2].op) {
+        case Op::Add:
+            return SelectBinary<Op::Add>(code[0].op, code[1].op);
+        case Op::Subtract:
+            return SelectBinary<Op::Subtract>(code[0].op, code[1].op);
+        case Op::Multiply:
+            return SelectBinary<Op::Multiply>(code[0].op, code[1].op);
+        case Op::Divide:
+            return SelectBinary<Op::Divide>(code[0].op, code[1].op);
+        default:
+            return nullptr;
+    }
+}
+
+class Formula : public FormulaInterface {
+public:
+    explicit Formula(std::string expression) : Formula(ParseFormulaAST(expression)) {
+    }
+
+    explicit Formula(FormulaAST ast) : ast_(std::move(ast)) {
+        for (const auto& pos : ast_.GetCells()) {
+            if (pos.IsValid()) {
+                referenced_cells_.push_back(pos);
+            }
+        }
+        std::sort(referenced_cells_.begin(), referenced_cells_.end());
+        referenced_cells_.erase(std::unique(referenced_cells_.begin(), referenced_cells_.end()),
+                                referenced_cells_.end());
+        ast_.IndexInputs(referenced_cells_);
+        ast_.Compile(program_);
+        evaluator_ = SelectEvaluator(program_);
+    }
+
+    Value Evaluate(SheetInterface& sheet) const override {
+        return Evaluate(sheet, nullptr);
+    }
+
+    Value Evaluate(SheetInterface& sheet, const CellOperand* const* inputs) const override {
+        try {
+            if (evaluator_ != nullptr) {
+                PROFILE_EXECUTE();
+                return evaluator_(program_.data(), sheet, inputs);
+            }
+            return ast_.Execute(sheet, inputs);
+        } catch (const FormulaError& fe) {
+            return fe;
+        }
+    }
+
+    std::string GetExpression() const override {
+        std::stringstream out;
+        ast_.PrintFormula(out);
+        return out.str();
+    }
+
+    const std::vector<Position>& GetReferencedCells() const override {
+        return referenced_cells_;
+    }
+
+    const std::vector<SheetPosition>& GetSheetReferences() const override {
+        return ast_.GetSheetCells();
+    }
+
+    const std::vector<FormulaInstruction>& GetProgram() const override {
+        return program_;
+    }
+
+    std::unique_ptr<FormulaInterface> MapCells(const std::function<Position(Position)>& map) const override {
+        return std::make_unique<Formula>(ast_.MapCells(map));
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this) + referenced_cells_.capacity() * sizeof(Position) + ast_.GetMemoryUsage()
+            + program_.capacity() * sizeof(FormulaInstruction);
+    }
+
+private:
+    // без повторов, по возрастанию
+    std::vector<Position> referenced_cells_;
+    FormulaAST ast_;
+    std::vector<FormulaInstruction> program_;
+    ShapeEvaluator evaluator_ = nullptr;
+};
+}  // namespace
+
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
+    return std::make_unique<Formula>(std::move(expression));
+}
@@ -1,21 +1,75 @@
-#pragma once
-
-#include "common.h"
-
-#include <memory>
-#include <vector>
-
-class FormulaInterface {
-public:
-    using Value = std::variant<double, FormulaError>;
-
-    virtual ~FormulaInterface() = default;
-
-    virtual Value Evaluate(SheetInterface& sheet) const = 0;
-
-    virtual std::string GetExpression() const = 0;
-
-    virtual std::vector<Position> GetReferencedCells() const = 0;
-};
-
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+#pragma once
+
+#include "common.h"
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+// Инструкция формулы в обратной польской записи: Number и Cell кладут
+// значение на стек, операции снимают аргументы со стека и кладут результат.
+struct FormulaInstruction {
+    enum class Op {
+        Number,
+        Cell,
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        UnaryPlus,
+        UnaryMinus,
+    };
+
+    Op op;
+    double number = 0.;
+    Position cell;
+    // номер cell в GetReferencedCells() формулы, -1 для ссылки #REF!
+    int input = -1;
+};
+
+// Значение ячейки как операнда формулы, хранится в самой ячейке рядом с кешем.
+// Формула читает его по указателю, не ища ячейку в таблице.
+struct CellOperand {
+    // значение ячейки актуально; иначе его нужно вычислить через cell
+    bool ready = false;
+    bool is_error = false;
+    FormulaError::Category error = FormulaError::Category::Value;
+    double number = 0.;
+    // номер правки, на которой значение изменилось в последний раз
+    uint64_t changed_at = 0;
+    // ячейка-владелец; nullptr у общего операнда пустых позиций
+    const CellInterface* cell = nullptr;
+};
+
+class FormulaInterface {
+public:
+    using Value = std::variant<double, FormulaError>;
+
+    virtual ~FormulaInterface() = default;
+
+    virtual Value Evaluate(SheetInterface& sheet) const = 0;
+    // То же с привязанными ссылками: inputs[i] - операнд ячейки GetReferencedCells()[i].
+    virtual Value Evaluate(SheetInterface& sheet, const CellOperand* const* inputs) const = 0;
+
+    virtual std::string GetExpression() const = 0;
+
+    // Корректные позиции, на которые ссылается формула; ссылки #REF! не входят.
+    virtual const std::vector<Position>& GetReferencedCells() const = 0;
+
+    // Ссылки на ячейки других листов книги (Лист2!A1), без повторов, по возрастанию.
+    virtual const std::vector<SheetPosition>& GetSheetReferences() const = 0;
+
+    // Программа формулы в обратной польской записи, строится один раз при разборе.
+    // Пустая, если формула ссылается на другие листы: такая формула вычисляется
+    // только по дереву разбора.
+    virtual const std::vector<FormulaInstruction>& GetProgram() const = 0;
+
+    // Та же формула, в которой каждая ссылка pos заменена на map(pos);
+    // Position::NONE означает #REF!. Ссылки на другие листы не меняются.
+    // Текст заново не разбирается.
+    virtual std::unique_ptr<FormulaInterface> MapCells(const std::function<Position(Position)>& map) const = 0;
+    // Байты, занятые формулой, включая сам объект.
+    virtual size_t GetMemoryUsage() const = 0;
+};
+
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
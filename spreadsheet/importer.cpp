@@ -0,0 +1,161 @@
+#include "importer.h"
+
+#include "formula.h"
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <iostream>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace {
+
+struct PendingFormula {
+    Position pos;
+    std::string expression;
+    std::unique_ptr<FormulaInterface> formula;
+    std::exception_ptr error;
+};
+
+using PendingText = std::pair<Position, std::string>;
+
+class RowReader {
+public:
+    RowReader(char separator, ImportStats& stats, std::vector<PendingText>& texts,
+              std::vector<PendingFormula>& formulas)
+        : separator_(separator), stats_(stats), texts_(texts), formulas_(formulas) {
+    }
+
+    void ReadRow(std::string_view line) {
+        if (!line.empty() && line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+        int col = 0;
+        size_t begin = 0;
+        while (true) {
+            size_t end = line.find(separator_, begin);
+            if (end == std::string_view::npos) {
+                end = line.size();
+            }
+            AddCell(Position{row_, col}, line.substr(begin, end - begin));
+            if (end == line.size()) {
+                break;
+            }
+            begin = end + 1;
+            ++col;
+        }
+        ++row_;
+        ++stats_.rows;
+    }
+
+private:
+    void AddCell(Position pos, std::string_view text) {
+        if (text.empty()) {
+            return;
+        }
+        ++stats_.cells;
+        if (text[0] == FORMULA_SIGN && text.size() > 1) {
+            formulas_.push_back({pos, std::string(text.substr(1)), nullptr, nullptr});
+        } else {
+            texts_.emplace_back(pos, std::string(text));
+        }
+    }
+
+    char separator_;
+    ImportStats& stats_;
+    std::vector<PendingText>& texts_;
+    std::vector<PendingFormula>& formulas_;
+    int row_ = 0;
+};
+
+void ParseFormulas(std::vector<PendingFormula>& formulas, size_t threads) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::min(threads, formulas.size());
+    auto parse_range = [&formulas](size_t from, size_t to) {
+        for (size_t i = from; i < to; ++i) {
+            try {
+                formulas[i].formula = ParseFormula(std::move(formulas[i].expression));
+            } catch (...) {
+                formulas[i].error = std::current_exception();
+            }
+        }
+    };
+    if (threads <= 1) {
+        parse_range(0, formulas.size());
+        return;
+    }
+    std::vector<std::thread> workers;
+    const size_t chunk = (formulas.size() + threads - 1) / threads;
+    for (size_t from = 0; from < formulas.size(); from += chunk) {
+        workers.emplace_back(parse_range, from, std::min(from + chunk, formulas.size()));
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+}  // namespace
+
+double ImportStats::MegabytesPerSecond() const {
+    return seconds > 0. ? bytes / (1024. * 1024.) / seconds : 0.;
+}
+
+double ImportStats::CellsPerSecond() const {
+    return seconds > 0. ? cells / seconds : 0.;
+}
+
+ImportStats ImportTexts(Sheet& sheet, std::istream& input, const ImportOptions& options) {
+    const auto start = std::chrono::steady_clock::now();
+    ImportStats stats;
+    std::vector<PendingText> texts;
+    std::vector<PendingFormula> formulas;
+    RowReader reader(options.separator, stats, texts, formulas);
+
+    std::vector<char> buffer(std::max<size_t>(options.buffer_size, 1));
+    std::string tail;
+    while (input) {
+        input.read(buffer.data(), buffer.size());
+        const size_t count = static_cast<size_t>(input.gcount());
+        if (count == 0) {
+            break;
+        }
+        stats.bytes += count;
+        std::string_view chunk(buffer.data(), count);
+        size_t begin = 0;
+        for (size_t end = chunk.find('\n'); end != std::string_view::npos; end = chunk.find('\n', begin)) {
+            if (tail.empty()) {
+                reader.ReadRow(chunk.substr(begin, end - begin));
+            } else {
+                tail.append(chunk.substr(begin, end - begin));
+                reader.ReadRow(tail);
+                tail.clear();
+            }
+            begin = end + 1;
+        }
+        tail.append(chunk.substr(begin));
+    }
+    if (!tail.empty()) {
+        reader.ReadRow(tail);
+    }
+
+    ParseFormulas(formulas, options.threads);
+    // до первой ошибки разбора в таблицу ничего не записывается
+    std::vector<std::pair<Position, std::unique_ptr<FormulaInterface>>> parsed;
+    parsed.reserve(formulas.size());
+    for (auto& pending : formulas) {
+        if (pending.error) {
+            std::rethrow_exception(pending.error);
+        }
+        parsed.emplace_back(pending.pos, std::move(pending.formula));
+    }
+    stats.formulas = formulas.size();
+    sheet.LoadCells(std::move(texts), std::move(parsed));
+
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return stats;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "common.h"
+#include "sheet.h"
+
+#include <cstddef>
+#include <iosfwd>
+
+struct ImportOptions {
+    char separator = '\t';
+    // 0 - по числу аппаратных потоков
+    size_t threads = 0;
+    size_t buffer_size = 1 << 16;
+};
+
+struct ImportStats {
+    size_t bytes = 0;
+    size_t rows = 0;
+    size_t cells = 0;
+    size_t formulas = 0;
+    double seconds = 0.;
+
+    double MegabytesPerSecond() const;
+    double CellsPerSecond() const;
+};
+
+// Загружает таблицу в формате PrintTexts: строки разделены '\n', ячейки - separator.
+// Текст читается блоками, формулы разбираются параллельно, затем все ячейки
+// записываются одним пакетом (Sheet::LoadCells). При ошибке разбора формулы
+// или цикле исключение бросается до записи, и таблица не меняется.
+ImportStats ImportTexts(Sheet& sheet, std::istream& input, const ImportOptions& options = {});
@@ -0,0 +1,327 @@
+#include "journal.h"
+
+#include "formula.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+const char* LOG_SUFFIX = ".log";
+const char* CHECKPOINT_SUFFIX = ".ckpt";
+const char* TMP_SUFFIX = ".tmp";
+
+// Заголовок файла: сигнатура, версия и поколение контрольной точки (8 байт, little-endian).
+const char LOG_MAGIC[] = {'S', 'J', 1};
+const char CHECKPOINT_MAGIC[] = {'S', 'C', 1};
+const size_t GENERATION_SIZE = 8;
+
+void WriteVarint(std::string& out, uint32_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+bool ReadVarint(const std::vector<char>& in, size_t& offset, uint32_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (offset >= in.size()) {
+            return false;
+        }
+        const auto byte = static_cast<uint8_t>(in[offset++]);
+        value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+template <size_t N>
+void WriteHeader(std::string& out, const char (&magic)[N], uint64_t generation) {
+    out.append(magic, N);
+    for (size_t i = 0; i < GENERATION_SIZE; ++i) {
+        out.push_back(static_cast<char>(generation >> (8 * i)));
+    }
+}
+
+// false, если заголовка нет или он неполный.
+template <size_t N>
+bool ReadHeader(const std::vector<char>& in, const char (&magic)[N], size_t& offset, uint64_t& generation) {
+    if (in.size() < N + GENERATION_SIZE || !std::equal(magic, magic + N, in.begin())) {
+        return false;
+    }
+    generation = 0;
+    for (size_t i = 0; i < GENERATION_SIZE; ++i) {
+        generation |= static_cast<uint64_t>(static_cast<uint8_t>(in[N + i])) << (8 * i);
+    }
+    offset = N + GENERATION_SIZE;
+    return true;
+}
+
+// Содержимое файла; пустое, если файла нет.
+std::vector<char> ReadFile(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    return std::vector<char>((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+}
+
+void SyncFile(std::FILE* file) {
+    std::fflush(file);
+#ifdef _WIN32
+    _commit(_fileno(file));
+#else
+    fsync(fileno(file));
+#endif
+}
+
+// Атомарно заменяет to файлом from.
+bool MoveReplacing(const std::string& from, const std::string& to) {
+#ifdef _WIN32
+    return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    return std::rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+// Сохраняет на диске записи каталога файла path (созданные и переименованные
+// файлы). В Windows это делает MOVEFILE_WRITE_THROUGH.
+void SyncDirectory(const std::string& path) {
+#ifndef _WIN32
+    const auto slash = path.rfind('/');
+    const std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    const int fd = open(dir.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+#endif
+}
+
+}  // namespace
+
+Journal::Journal(Sheet& sheet, std::string path, JournalOptions options)
+    : sheet_(sheet), path_(std::move(path)), options_(options) {
+    size_t offset = 0;
+    const auto checkpoint = ReadFile(path_ + CHECKPOINT_SUFFIX);
+    if (!checkpoint.empty() && !ReadHeader(checkpoint, CHECKPOINT_MAGIC, offset, generation_)) {
+        throw std::runtime_error("bad checkpoint " + path_ + CHECKPOINT_SUFFIX);
+    }
+    const auto log = ReadFile(path_ + LOG_SUFFIX);
+    uint64_t log_generation;
+    if (!ReadHeader(log, LOG_MAGIC, offset, log_generation) || log_generation != generation_) {
+        // журнал уже вошёл в контрольную точку (или его ещё нет)
+        ResetLog();
+        SyncDirectory(path_);
+        return;
+    }
+    // недописанная последняя запись срезается: новые записи пишутся вместо неё
+    const size_t end = DecodeRecords(log, offset, [](Op, Position, std::string) {});
+    if (end != log.size()) {
+        std::error_code error;
+        std::filesystem::resize_file(path_ + LOG_SUFFIX, end, error);
+        if (error) {
+            throw std::runtime_error("cannot truncate journal " + path_ + LOG_SUFFIX);
+        }
+    }
+    log_ = std::fopen((path_ + LOG_SUFFIX).c_str(), "ab");
+    if (log_ == nullptr) {
+        throw std::runtime_error("cannot open journal " + path_ + LOG_SUFFIX);
+    }
+    log_size_ = end - offset;
+}
+
+Journal::~Journal() {
+    if (log_ != nullptr) {
+        SyncFile(log_);
+        std::fclose(log_);
+    }
+}
+
+void Journal::ResetLog() {
+    if (log_ != nullptr) {
+        std::fclose(log_);
+    }
+    log_ = std::fopen((path_ + LOG_SUFFIX).c_str(), "wb");
+    if (log_ == nullptr) {
+        throw std::runtime_error("cannot open journal " + path_ + LOG_SUFFIX);
+    }
+    std::string header;
+    WriteHeader(header, LOG_MAGIC, generation_);
+    if (std::fwrite(header.data(), 1, header.size(), log_) != header.size()) {
+        throw std::runtime_error("cannot write journal " + path_ + LOG_SUFFIX);
+    }
+    SyncFile(log_);
+    pending_ = 0;
+    since_checkpoint_ = 0;
+    log_size_ = 0;
+}
+
+void Journal::SetCell(Position pos, std::string text) {
+    sheet_.SetCell(pos, text);
+    Append(Op::Set, pos, text);
+}
+
+void Journal::ClearCell(Position pos) {
+    sheet_.ClearCell(pos);
+    Append(Op::Clear, pos, {});
+}
+
+void Journal::EncodeRecord(std::string& out, Op op, Position pos, const std::string& text) {
+    out.push_back(static_cast<char>(op));
+    WriteVarint(out, static_cast<uint32_t>(pos.row));
+    WriteVarint(out, static_cast<uint32_t>(pos.col));
+    if (op == Op::Set) {
+        WriteVarint(out, static_cast<uint32_t>(text.size()));
+        out += text;
+    }
+}
+
+size_t Journal::DecodeRecords(const std::vector<char>& data, size_t offset, const RecordCallback& apply) {
+    while (offset < data.size()) {
+        size_t next = offset;
+        const auto op = static_cast<Op>(data[next++]);
+        uint32_t row;
+        uint32_t col;
+        if (!ReadVarint(data, next, row) || !ReadVarint(data, next, col)) {
+            break;
+        }
+        const Position pos{static_cast<int>(row), static_cast<int>(col)};
+        std::string text;
+        if (op == Op::Set) {
+            uint32_t size;
+            if (!ReadVarint(data, next, size) || data.size() - next < size) {
+                break;
+            }
+            text.assign(data.data() + next, size);
+            next += size;
+        } else if (op != Op::Clear) {
+            break;
+        }
+        apply(op, pos, std::move(text));
+        offset = next;
+    }
+    return offset;
+}
+
+void Journal::Append(Op op, Position pos, const std::string& text) {
+    record_.clear();
+    EncodeRecord(record_, op, pos, text);
+    if (std::fwrite(record_.data(), 1, record_.size(), log_) != record_.size()) {
+        throw std::runtime_error("cannot write journal " + path_ + LOG_SUFFIX);
+    }
+    log_size_ += record_.size();
+    ++since_checkpoint_;
+    if (++pending_ >= options_.sync_every) {
+        Sync();
+    }
+    if (options_.checkpoint_every > 0 && since_checkpoint_ >= options_.checkpoint_every) {
+        Checkpoint();
+    }
+}
+
+void Journal::Sync() {
+    SyncFile(log_);
+    pending_ = 0;
+}
+
+void Journal::Checkpoint() {
+    const std::string checkpoint = path_ + CHECKPOINT_SUFFIX;
+    const std::string tmp = checkpoint + TMP_SUFFIX;
+    std::string data;
+    WriteHeader(data, CHECKPOINT_MAGIC, generation_ + 1);
+    const Size size = sheet_.GetPrintableSize();
+    if (size.rows > 0 && size.cols > 0) {
+        for (const auto& pos : sheet_.GetCellsIn({{0, 0}, {size.rows - 1, size.cols - 1}})) {
+            EncodeRecord(data, Op::Set, pos, sheet_.GetCell(pos)->GetText());
+        }
+    }
+
+    std::FILE* file = std::fopen(tmp.c_str(), "wb");
+    if (file == nullptr) {
+        throw std::runtime_error("cannot create checkpoint " + tmp);
+    }
+    const bool written = std::fwrite(data.data(), 1, data.size(), file) == data.size();
+    SyncFile(file);
+    std::fclose(file);
+    if (!written) {
+        throw std::runtime_error("cannot write checkpoint " + tmp);
+    }
+    // до замены остаётся прежняя точка с журналом её поколения, после - новая
+    if (!MoveReplacing(tmp, checkpoint)) {
+        throw std::runtime_error("cannot replace checkpoint " + checkpoint);
+    }
+    SyncDirectory(checkpoint);
+    ++generation_;
+    // всё, что было в журнале, уже вошло в снимок
+    ResetLog();
+}
+
+size_t Journal::GetPendingCount() const {
+    return pending_;
+}
+
+size_t Journal::GetLogSize() const {
+    return log_size_;
+}
+
+size_t Journal::Recover(Sheet& sheet, const std::string& path) {
+    uint64_t generation = 0;
+    size_t offset = 0;
+    const auto checkpoint = ReadFile(path + CHECKPOINT_SUFFIX);
+    if (!checkpoint.empty()) {
+        if (!ReadHeader(checkpoint, CHECKPOINT_MAGIC, offset, generation)) {
+            throw std::runtime_error("bad checkpoint " + path + CHECKPOINT_SUFFIX);
+        }
+        std::vector<std::pair<Position, std::string>> texts;
+        std::vector<std::pair<Position, std::unique_ptr<FormulaInterface>>> formulas;
+        const size_t end = DecodeRecords(checkpoint, offset, [&](Op op, Position pos, std::string text) {
+            if (op != Op::Set || !pos.IsValid()) {
+                throw std::runtime_error("bad checkpoint " + path + CHECKPOINT_SUFFIX);
+            }
+            if (text.size() > 1 && text[0] == FORMULA_SIGN) {
+                formulas.emplace_back(pos, ParseFormula(text.substr(1)));
+            } else {
+                texts.emplace_back(pos, std::move(text));
+            }
+        });
+        // точка записывается целиком до замены: обрыв означает порчу файла
+        if (end != checkpoint.size()) {
+            throw std::runtime_error("bad checkpoint " + path + CHECKPOINT_SUFFIX);
+        }
+        sheet.LoadCells(std::move(texts), std::move(formulas));
+    }
+
+    const auto log = ReadFile(path + LOG_SUFFIX);
+    uint64_t log_generation;
+    if (!ReadHeader(log, LOG_MAGIC, offset, log_generation) || log_generation != generation) {
+        return 0;
+    }
+    // недописанная последняя запись отбрасывается
+    size_t replayed = 0;
+    DecodeRecords(log, offset, [&](Op op, Position pos, std::string text) {
+        if (op == Op::Set) {
+            sheet.SetCell(pos, std::move(text));
+        } else {
+            sheet.ClearCell(pos);
+        }
+        ++replayed;
+    });
+    return replayed;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "common.h"
+#include "sheet.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+struct JournalOptions {
+    // сколько операций копится в журнале до fsync
+    size_t sync_every = 64;
+    // после скольких операций журнал сворачивается в контрольную точку, 0 - только вручную
+    size_t checkpoint_every = 100000;
+};
+
+// Журнал изменений таблицы. Каждая операция SetCell/ClearCell дописывается
+// в файл <path>.log в компактном двоичном виде, fsync выполняется пачками.
+// Контрольная точка - снимок текстов ячеек в <path>.ckpt в том же формате
+// записей; она атомарно заменяет прежнюю, после чего журнал обрезается.
+// Оба файла начинаются с номера поколения контрольной точки: журнал другого
+// поколения (сбой между заменой точки и обрезкой журнала) уже вошёл в точку
+// и при восстановлении пропускается.
+class Journal {
+public:
+    Journal(Sheet& sheet, std::string path, JournalOptions options = {});
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+    ~Journal();
+
+    void SetCell(Position pos, std::string text);
+    void ClearCell(Position pos);
+
+    void Sync();
+    void Checkpoint();
+
+    size_t GetPendingCount() const;
+    // Байты записей журнала после заголовка.
+    size_t GetLogSize() const;
+
+    // Восстанавливает таблицу: загружает контрольную точку и проигрывает хвост журнала.
+    // Недописанная последняя запись отбрасывается. Возвращает число проигранных операций.
+    static size_t Recover(Sheet& sheet, const std::string& path);
+
+private:
+    enum class Op : uint8_t {
+        Set = 1,
+        Clear = 2,
+    };
+
+    using RecordCallback = std::function<void(Op op, Position pos, std::string text)>;
+
+    void Append(Op op, Position pos, const std::string& text);
+    // Открывает журнал заново пустым, с заголовком текущего поколения.
+    void ResetLog();
+    static void EncodeRecord(std::string& out, Op op, Position pos, const std::string& text);
+    // Передаёт apply записи data начиная с offset; возвращает конец последней
+    // целой записи.
+    static size_t DecodeRecords(const std::vector<char>& data, size_t offset, const RecordCallback& apply);
+
+    Sheet& sheet_;
+    const std::string path_;
+    const JournalOptions options_;
+    std::FILE* log_ = nullptr;
+    uint64_t generation_ = 0;
+    std::string record_;
+    size_t pending_ = 0;
+    size_t since_checkpoint_ = 0;
+    size_t log_size_ = 0;
+};
@@ -1,388 +1,1791 @@
-#include <limits>
-
-#include "common.h"
-#include "formula.h"
-#include "test_runner_p.h"
-
-#include "FormulaAST.h"
-
-inline std::ostream& operator<<(std::ostream& output, Position pos) {
-    return output << "(" << pos.row << ", " << pos.col << ")";
-}
-
-inline Position operator"" _pos(const char* str, std::size_t) {
-    return Position::FromString(str);
-}
-
-inline std::ostream& operator<<(std::ostream& output, Size size) {
-    return output << "(" << size.rows << ", " << size.cols << ")";
-}
-
-inline std::ostream& operator<<(std::ostream& output, const CellInterface::Value& value) {
-    std::visit(
-        [&](const auto& x) {
-            output << x;
-        },
-        value);
-    return output;
-}
-
-namespace {
-
-void TestPositionAndStringConversion() {
-    auto testSingle = [](Position pos, std::string_view str) {
-        ASSERT_EQUAL(pos.ToString(), str);
-        ASSERT_EQUAL(Position::FromString(str), pos);
-    };
-
-    for (int i = 0; i < 25; ++i) {
-        testSingle(Position{i, i}, char('A' + i) + std::to_string(i + 1));
-    }
-
-    testSingle(Position{0, 0}, "A1");
-    testSingle(Position{0, 1}, "B1");
-    testSingle(Position{0, 25}, "Z1");
-    testSingle(Position{0, 26}, "AA1");
-    testSingle(Position{0, 27}, "AB1");
-    testSingle(Position{0, 51}, "AZ1");
-    testSingle(Position{0, 52}, "BA1");
-    testSingle(Position{0, 53}, "BB1");
-    testSingle(Position{0, 77}, "BZ1");
-    testSingle(Position{0, 78}, "CA1");
-    testSingle(Position{0, 701}, "ZZ1");
-    testSingle(Position{0, 702}, "AAA1");
-    testSingle(Position{136, 2}, "C137");
-    testSingle(Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}, "XFD16384");
-}
-
-void TestPositionToStringInvalid() {
-    ASSERT_EQUAL((Position{-1, -1}).ToString(), "");
-    ASSERT_EQUAL((Position{-10, 0}).ToString(), "");
-    ASSERT_EQUAL((Position{1, -3}).ToString(), "");
-}
-
-void TestStringToPositionInvalid() {
-    ASSERT(!Position::FromString("").IsValid());
-    ASSERT(!Position::FromString("A").IsValid());
-    ASSERT(!Position::FromString("1").IsValid());
-    ASSERT(!Position::FromString("e2").IsValid());
-    ASSERT(!Position::FromString("A0").IsValid());
-    ASSERT(!Position::FromString("A-1").IsValid());
-    ASSERT(!Position::FromString("A+1").IsValid());
-    ASSERT(!Position::FromString("R2D2").IsValid());
-    ASSERT(!Position::FromString("C3PO").IsValid());
-    ASSERT(!Position::FromString("XFD16385").IsValid());
-    ASSERT(!Position::FromString("XFE16384").IsValid());
-    ASSERT(!Position::FromString("A1234567890123456789").IsValid());
-    ASSERT(!Position::FromString("ABCDEFGHIJKLMNOPQRS8").IsValid());
-}
-
-void TestEmpty() {
-    auto sheet = CreateSheet();
-    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
-}
-
-void TestInvalidPosition() {
-    auto sheet = CreateSheet();
-    try {
-        sheet->SetCell(Position{-1, 0}, "");
-    } catch (const InvalidPositionException&) {
-    }
-    try {
-        sheet->GetCell(Position{0, -2});
-    } catch (const InvalidPositionException&) {
-    }
-    try {
-        sheet->ClearCell(Position{Position::MAX_ROWS, 0});
-    } catch (const InvalidPositionException&) {
-    }
-}
-
-void TestSetCellPlainText() {
-    auto sheet = CreateSheet();
-
-    auto checkCell = [&](Position pos, std::string text) {
-        sheet->SetCell(pos, text);
-        CellInterface* cell = sheet->GetCell(pos);
-        ASSERT(cell != nullptr);
-        ASSERT_EQUAL(cell->GetText(), text);
-        ASSERT_EQUAL(std::get<std::string>(cell->GetValue()), text);
-    };
-
-    checkCell("A1"_pos, "Hello");
-    checkCell("A1"_pos, "World");
-    checkCell("B2"_pos, "Purr");
-    checkCell("A3"_pos, "Meow");
-
-    const SheetInterface& constSheet = *sheet;
-    ASSERT_EQUAL(constSheet.GetCell("B2"_pos)->GetText(), "Purr");
-
-    sheet->SetCell("A3"_pos, "'=escaped");
-    CellInterface* cell = sheet->GetCell("A3"_pos);
-    ASSERT_EQUAL(cell->GetText(), "'=escaped");
-    ASSERT_EQUAL(std::get<std::string>(cell->GetValue()), "=escaped");
-}
-
-void TestClearCell() {
-    auto sheet = CreateSheet();
-
-    sheet->SetCell("C2"_pos, "Me gusta");
-    sheet->ClearCell("C2"_pos);
-    ASSERT(sheet->GetCell("C2"_pos) == nullptr);
-
-    sheet->ClearCell("A1"_pos);
-    sheet->ClearCell("J10"_pos);
-}
-
-void TestFormulaArithmetic() {
-    auto sheet = CreateSheet();
-    auto evaluate = [&](std::string expr) {
-        return std::get<double>(ParseFormula(std::move(expr))->Evaluate(*sheet));
-    };
-
-    ASSERT_EQUAL(evaluate("1"), 1);
-    ASSERT_EQUAL(evaluate("42"), 42);
-    ASSERT_EQUAL(evaluate("2 + 2"), 4);
-    ASSERT_EQUAL(evaluate("2 + 2*2"), 6);
-    ASSERT_EQUAL(evaluate("4/2 + 6/3"), 4);
-    ASSERT_EQUAL(evaluate("(2+3)*4 + (3-4)*5"), 15);
-    ASSERT_EQUAL(evaluate("(12+13) * (14+(13-24/(1+1))*55-46)"), 575);
-}
-
-void TestFormulaReferences() {
-    auto sheet = CreateSheet();
-    auto evaluate = [&](std::string expr) {
-        return std::get<double>(ParseFormula(std::move(expr))->Evaluate(*sheet));
-    };
-
-    sheet->SetCell("A1"_pos, "1");
-    ASSERT_EQUAL(evaluate("A1"), 1);
-    sheet->SetCell("A2"_pos, "2");
-    ASSERT_EQUAL(evaluate("A1+A2"), 3);
-
-    // Тест на нули:
-    sheet->SetCell("B3"_pos, "");
-    ASSERT_EQUAL(evaluate("A1+B3"), 1);  // Ячейка с пустым текстом
-    ASSERT_EQUAL(evaluate("A1+B1"), 1);  // Пустая ячейка
-    ASSERT_EQUAL(evaluate("A1+E4"), 1);  // Ячейка за пределами таблицы
-}
-
-void TestFormulaExpressionFormatting() {
-    auto reformat = [](std::string expr) {
-        return ParseFormula(std::move(expr))->GetExpression();
-    };
-
-    ASSERT_EQUAL(reformat("  1  "), "1");
-    ASSERT_EQUAL(reformat("  -1  "), "-1");
-    ASSERT_EQUAL(reformat("2 + 2"), "2+2");
-    ASSERT_EQUAL(reformat("(2*3)+4"), "2*3+4");
-    ASSERT_EQUAL(reformat("(2*3)-4"), "2*3-4");
-    ASSERT_EQUAL(reformat("( ( (  1) ) )"), "1");
-}
-
-void TestFormulaReferencedCells() {
-    ASSERT(ParseFormula("1")->GetReferencedCells().empty());
-    auto a1 = ParseFormula("A1");
-    ASSERT_EQUAL(a1->GetReferencedCells(), (std::vector{"A1"_pos}));
-
-    auto b2c3 = ParseFormula("B2+C3");
-    ASSERT_EQUAL(b2c3->GetReferencedCells(), (std::vector{"B2"_pos, "C3"_pos}));
-
-    auto tricky = ParseFormula("A1 + A2 + A1 + A3 + A1 + A2 + A1");
-    ASSERT_EQUAL(tricky->GetExpression(), "A1+A2+A1+A3+A1+A2+A1");
-    ASSERT_EQUAL(tricky->GetReferencedCells(), (std::vector{"A1"_pos, "A2"_pos, "A3"_pos}));
-}
-
-void TestErrorValue() {
-    auto sheet = CreateSheet();
-    sheet->SetCell("E2"_pos, "A1");
-    sheet->SetCell("E4"_pos, "=E2");
-    ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(),
-                    CellInterface::Value(FormulaError::Category::Value));
-
-    sheet->SetCell("E2"_pos, "3D");
-    ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(),
-                    CellInterface::Value(FormulaError::Category::Value));
-}
-
-void TestErrorArithmetic() {
-    auto sheet = CreateSheet();
-
-    constexpr double max = std::numeric_limits<double>::max();
-
-    sheet->SetCell("A1"_pos, "=1/0");
-    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                    CellInterface::Value(FormulaError::Category::Arithmetic));
-
-    sheet->SetCell("A1"_pos, "=1e+200/1e-200");
-    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                    CellInterface::Value(FormulaError::Category::Arithmetic));
-
-    sheet->SetCell("A1"_pos, "=0/0");
-    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                    CellInterface::Value(FormulaError::Category::Arithmetic));
-
-    {
-        std::ostringstream formula;
-        formula << '=' << max << '+' << max;
-        sheet->SetCell("A1"_pos, formula.str());
-        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                        CellInterface::Value(FormulaError::Category::Arithmetic));
-    }
-
-    {
-        std::ostringstream formula;
-        formula << '=' << -max << '-' << max;
-        sheet->SetCell("A1"_pos, formula.str());
-        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                        CellInterface::Value(FormulaError::Category::Arithmetic));
-    }
-
-    {
-        std::ostringstream formula;
-        formula << '=' << max << '*' << max;
-        sheet->SetCell("A1"_pos, formula.str());
-        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                        CellInterface::Value(FormulaError::Category::Arithmetic));
-    }
-}
-
-void TestEmptyCellTreatedAsZero() {
-    auto sheet = CreateSheet();
-    sheet->SetCell("A1"_pos, "=B2");
-    sheet->GetCell("A1"_pos);
-    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-    CellInterface::Value(0.0));
-}
-
-void TestFormulaInvalidPosition() {
-    auto sheet = CreateSheet();
-    auto try_formula = [&](const std::string& formula) {
-        try {
-            sheet->SetCell("A1"_pos, formula);
-            ASSERT(false);
-        } catch (const FormulaException&) {
-        } 
-    };
-
-    try_formula("=X0");
-    try_formula("=ABCD1");
-    try_formula("=A123456");
-    try_formula("=ABCDEFGHIJKLMNOPQRS1234567890");
-    try_formula("=XFD16385");
-    try_formula("=XFE16384");
-    try_formula("=R2D2");
-}
-
-void TestPrint() {
-    auto sheet = CreateSheet();
-    sheet->SetCell("A2"_pos, "meow");
-    sheet->SetCell("B2"_pos, "=35");
-
-    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 2}));
-
-    std::ostringstream texts;
-    sheet->PrintTexts(texts);
-    ASSERT_EQUAL(texts.str(), "\t\nmeow\t=35\n");
-
-    std::ostringstream values;
-    sheet->PrintValues(values);
-    ASSERT_EQUAL(values.str(), "\t\nmeow\t35\n");
-}
-
-void TestCellReferences() {
-    auto sheet = CreateSheet();
-    sheet->SetCell("A1"_pos, "1");
-    sheet->SetCell("A2"_pos, "=A1");
-    sheet->SetCell("B2"_pos, "=A1");
-
-    ASSERT(sheet->GetCell("A1"_pos)->GetReferencedCells().empty());
-    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetReferencedCells(), std::vector{"A1"_pos});
-    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetReferencedCells(), std::vector{"A1"_pos});
-
-    // Ссылка на пустую ячейку
-    sheet->SetCell("B2"_pos, "=B1");
-    ASSERT(sheet->GetCell("B1"_pos)->GetReferencedCells().empty());
-    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetReferencedCells(), std::vector{"B1"_pos});
-
-    sheet->SetCell("A2"_pos, "");
-    ASSERT(sheet->GetCell("A1"_pos)->GetReferencedCells().empty());
-    ASSERT(sheet->GetCell("A2"_pos)->GetReferencedCells().empty());
-
-    // Ссылка на ячейку за пределами таблицы
-    sheet->SetCell("B1"_pos, "=C3");
-    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetReferencedCells(), std::vector{"C3"_pos});
-}
-
-void TestFormulaIncorrect() {
-    auto isIncorrect = [](std::string expression) {
-        try {
-            ParseFormula(std::move(expression));
-        } catch (const FormulaException&) {
-            return true;
-        }
-        return false;
-    };
-
-    ASSERT(isIncorrect("A2B"));
-    ASSERT(isIncorrect("3X"));
-    ASSERT(isIncorrect("A0++"));
-    ASSERT(isIncorrect("((1)"));
-    ASSERT(isIncorrect("2+4-"));
-}
-
-void TestCellCircularReferences() {
-    auto sheet = CreateSheet();
-    sheet->SetCell("E2"_pos, "=E4");
-    sheet->SetCell("E4"_pos, "=X9");
-    sheet->SetCell("X9"_pos, "=M6");
-    sheet->SetCell("M6"_pos, "Ready");
-
-    bool caught = false;
-    try {
-        sheet->SetCell("M6"_pos, "=E2");
-    } catch (const CircularDependencyException&) {
-        caught = true;
-    }
-
-    ASSERT(caught);
-    ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
-}
-}  // namespace
-
-int main() {
-    auto sheet = CreateSheet();
-
-    auto isIncorrect = [](std::string expression) {
-        try {
-            ParseFormula(std::move(expression));
-        } catch (const FormulaException&) {
-            return true;
-        }
-        return false;
-    };
-    isIncorrect("A2B");
-    TestRunner tr;
-
-    RUN_TEST(tr, TestFormulaInvalidPosition);
-    RUN_TEST(tr, TestFormulaReferences);
-    RUN_TEST(tr, TestPositionAndStringConversion);
-    RUN_TEST(tr, TestPositionToStringInvalid);
-    RUN_TEST(tr, TestStringToPositionInvalid);
-    RUN_TEST(tr, TestEmpty);
-    RUN_TEST(tr, TestInvalidPosition);
-    RUN_TEST(tr, TestSetCellPlainText);
-    RUN_TEST(tr, TestClearCell);
-    RUN_TEST(tr, TestFormulaArithmetic);
-    RUN_TEST(tr, TestFormulaReferences);
-    RUN_TEST(tr, TestFormulaExpressionFormatting);
-    RUN_TEST(tr, TestFormulaReferencedCells);
-    RUN_TEST(tr, TestErrorValue);
-    RUN_TEST(tr, TestErrorArithmetic);
-    RUN_TEST(tr, TestEmptyCellTreatedAsZero);
-    RUN_TEST(tr, TestPrint);
-    RUN_TEST(tr, TestCellReferences);
-    RUN_TEST(tr, TestFormulaIncorrect);
-    RUN_TEST(tr, TestCellCircularReferences);
-    std::cout << "all tests passed" << std::endl;
-}
+#include <limits>
+
+#include "common.h"
+#include "formula.h"
+#include "test_runner_p.h"
+
+#include "FormulaAST.h"
+#include "importer.h"
+#include "journal.h"
+#include "profiler.h"
+#include "sheet.h"
+#include "sweep.h"
+#include "value_export.h"
+#include "workbook.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <set>
+#include <thread>
+
+inline std::ostream& operator<<(std::ostream& output, Position pos) {
+    return output << "(" << pos.row << ", " << pos.col << ")";
+}
+
+inline Position operator"" _pos(const char* str, std::size_t) {
+    return Position::FromString(str);
+}
+
+inline std::ostream& operator<<(std::ostream& output, Size size) {
+    return output << "(" << size.rows << ", " << size.cols << ")";
+}
+
+inline std::ostream& operator<<(std::ostream& output, const CellInterface::Value& value) {
+    std::visit(
+        [&](const auto& x) {
+            output << x;
+        },
+        value);
+    return output;
+}
+
+namespace {
+
+void TestPositionAndStringConversion() {
+    auto testSingle = [](Position pos, std::string_view str) {
+        ASSERT_EQUAL(pos.ToString(), str);
+        ASSERT_EQUAL(Position::FromString(str), pos);
+        char name[Position::MAX_NAME_LENGTH];
+        ASSERT_EQUAL(std::string_view(name, pos.ToChars(name)), str);
+    };
+
+    for (int i = 0; i < 25; ++i) {
+        testSingle(Position{i, i}, char('A' + i) + std::to_string(i + 1));
+    }
+
+    testSingle(Position{0, 0}, "A1");
+    testSingle(Position{0, 1}, "B1");
+    testSingle(Position{0, 25}, "Z1");
+    testSingle(Position{0, 26}, "AA1");
+    testSingle(Position{0, 27}, "AB1");
+    testSingle(Position{0, 51}, "AZ1");
+    testSingle(Position{0, 52}, "BA1");
+    testSingle(Position{0, 53}, "BB1");
+    testSingle(Position{0, 77}, "BZ1");
+    testSingle(Position{0, 78}, "CA1");
+    testSingle(Position{0, 701}, "ZZ1");
+    testSingle(Position{0, 702}, "AAA1");
+    testSingle(Position{136, 2}, "C137");
+    testSingle(Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}, "XFD16384");
+}
+
+void TestPositionToStringInvalid() {
+    ASSERT_EQUAL((Position{-1, -1}).ToString(), "");
+    ASSERT_EQUAL((Position{-10, 0}).ToString(), "");
+    ASSERT_EQUAL((Position{1, -3}).ToString(), "");
+    ASSERT_EQUAL((Position{Position::MAX_ROWS, 0}).ToString(), "");
+    char name[Position::MAX_NAME_LENGTH];
+    ASSERT_EQUAL((Position{0, Position::MAX_COLS}).ToChars(name), 0u);
+}
+
+void TestStringToPositionInvalid() {
+    ASSERT(!Position::FromString("").IsValid());
+    ASSERT(!Position::FromString("A").IsValid());
+    ASSERT(!Position::FromString("1").IsValid());
+    ASSERT(!Position::FromString("e2").IsValid());
+    ASSERT(!Position::FromString("A0").IsValid());
+    ASSERT(!Position::FromString("A-1").IsValid());
+    ASSERT(!Position::FromString("A+1").IsValid());
+    ASSERT(!Position::FromString("R2D2").IsValid());
+    ASSERT(!Position::FromString("C3PO").IsValid());
+    ASSERT(!Position::FromString("XFD16385").IsValid());
+    ASSERT(!Position::FromString("XFE16384").IsValid());
+    ASSERT(!Position::FromString("A1234567890123456789").IsValid());
+    ASSERT(!Position::FromString("ABCDEFGHIJKLMNOPQRS8").IsValid());
+    ASSERT(!Position::FromString("A 1").IsValid());
+    ASSERT(!Position::FromString("A1 ").IsValid());
+    ASSERT(!Position::FromString("A1B").IsValid());
+    ASSERT(!Position::FromString("a1").IsValid());
+    ASSERT(!Position::FromString("A99999999999").IsValid());
+}
+
+void TestEmpty() {
+    auto sheet = CreateSheet();
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
+}
+
+void TestInvalidPosition() {
+    auto sheet = CreateSheet();
+    try {
+        sheet->SetCell(Position{-1, 0}, "");
+    } catch (const InvalidPositionException&) {
+    }
+    try {
+        sheet->GetCell(Position{0, -2});
+    } catch (const InvalidPositionException&) {
+    }
+    try {
+        sheet->ClearCell(Position{Position::MAX_ROWS, 0});
+    } catch (const InvalidPositionException&) {
+    }
+}
+
+void TestSetCellPlainText() {
+    auto sheet = CreateSheet();
+
+    auto checkCell = [&](Position pos, std::string text) {
+        sheet->SetCell(pos, text);
+        CellInterface* cell = sheet->GetCell(pos);
+        ASSERT(cell != nullptr);
+        ASSERT_EQUAL(cell->GetText(), text);
+        ASSERT_EQUAL(std::get<std::string>(cell->GetValue()), text);
+    };
+
+    checkCell("A1"_pos, "Hello");
+    checkCell("A1"_pos, "World");
+    checkCell("B2"_pos, "Purr");
+    checkCell("A3"_pos, "Meow");
+
+    const SheetInterface& constSheet = *sheet;
+    ASSERT_EQUAL(constSheet.GetCell("B2"_pos)->GetText(), "Purr");
+
+    sheet->SetCell("A3"_pos, "'=escaped");
+    CellInterface* cell = sheet->GetCell("A3"_pos);
+    ASSERT_EQUAL(cell->GetText(), "'=escaped");
+    ASSERT_EQUAL(std::get<std::string>(cell->GetValue()), "=escaped");
+}
+
+void TestClearCell() {
+    auto sheet = CreateSheet();
+
+    sheet->SetCell("C2"_pos, "Me gusta");
+    sheet->ClearCell("C2"_pos);
+    ASSERT(sheet->GetCell("C2"_pos) == nullptr);
+
+    sheet->ClearCell("A1"_pos);
+    sheet->ClearCell("J10"_pos);
+}
+
+void TestFormulaArithmetic() {
+    auto sheet = CreateSheet();
+    auto evaluate = [&](std::string expr) {
+        return std::get<double>(ParseFormula(std::move(expr))->Evaluate(*sheet));
+    };
+
+    ASSERT_EQUAL(evaluate("1"), 1);
+    ASSERT_EQUAL(evaluate("42"), 42);
+    ASSERT_EQUAL(evaluate("2 + 2"), 4);
+    ASSERT_EQUAL(evaluate("2 + 2*2"), 6);
+    ASSERT_EQUAL(evaluate("4/2 + 6/3"), 4);
+    ASSERT_EQUAL(evaluate("(2+3)*4 + (3-4)*5"), 15);
+    ASSERT_EQUAL(evaluate("(12+13) * (14+(13-24/(1+1))*55-46)"), 575);
+}
+
+void TestFormulaReferences() {
+    auto sheet = CreateSheet();
+    auto evaluate = [&](std::string expr) {
+        return std::get<double>(ParseFormula(std::move(expr))->Evaluate(*sheet));
+    };
+
+    sheet->SetCell("A1"_pos, "1");
+    ASSERT_EQUAL(evaluate("A1"), 1);
+    sheet->SetCell("A2"_pos, "2");
+    ASSERT_EQUAL(evaluate("A1+A2"), 3);
+
+    // Тест на нули:
+    sheet->SetCell("B3"_pos, "");
+    ASSERT_EQUAL(evaluate("A1+B3"), 1);  // Ячейка с пустым текстом
+    ASSERT_EQUAL(evaluate("A1+B1"), 1);  // Пустая ячейка
+    ASSERT_EQUAL(evaluate("A1+E4"), 1);  // Ячейка за пределами таблицы
+}
+
+void TestFormulaExpressionFormatting() {
+    auto reformat = [](std::string expr) {
+        return ParseFormula(std::move(expr))->GetExpression();
+    };
+
+    ASSERT_EQUAL(reformat("  1  "), "1");
+    ASSERT_EQUAL(reformat("  -1  "), "-1");
+    ASSERT_EQUAL(reformat("2 + 2"), "2+2");
+    ASSERT_EQUAL(reformat("(2*3)+4"), "2*3+4");
+    ASSERT_EQUAL(reformat("(2*3)-4"), "2*3-4");
+    ASSERT_EQUAL(reformat("( ( (  1) ) )"), "1");
+}
+
+void TestFormulaReferencedCells() {
+    ASSERT(ParseFormula("1")->GetReferencedCells().empty());
+    auto a1 = ParseFormula("A1");
+    ASSERT_EQUAL(a1->GetReferencedCells(), (std::vector{"A1"_pos}));
+
+    auto b2c3 = ParseFormula("B2+C3");
+    ASSERT_EQUAL(b2c3->GetReferencedCells(), (std::vector{"B2"_pos, "C3"_pos}));
+
+    auto tricky = ParseFormula("A1 + A2 + A1 + A3 + A1 + A2 + A1");
+    ASSERT_EQUAL(tricky->GetExpression(), "A1+A2+A1+A3+A1+A2+A1");
+    ASSERT_EQUAL(tricky->GetReferencedCells(), (std::vector{"A1"_pos, "A2"_pos, "A3"_pos}));
+}
+
+void TestErrorValue() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("E2"_pos, "A1");
+    sheet->SetCell("E4"_pos, "=E2");
+    ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(),
+                    CellInterface::Value(FormulaError::Category::Value));
+
+    sheet->SetCell("E2"_pos, "3D");
+    ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(),
+                    CellInterface::Value(FormulaError::Category::Value));
+}
+
+void TestErrorArithmetic() {
+    auto sheet = CreateSheet();
+
+    constexpr double max = std::numeric_limits<double>::max();
+
+    sheet->SetCell("A1"_pos, "=1/0");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+                    CellInterface::Value(FormulaError::Category::Arithmetic));
+
+    sheet->SetCell("A1"_pos, "=1e+200/1e-200");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+                    CellInterface::Value(FormulaError::Category::Arithmetic));
+
+    sheet->SetCell("A1"_pos, "=0/0");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+                    CellInterface::Value(FormulaError::Category::Arithmetic));
+
+    {
+        std::ostringstream formula;
+        formula << '=' << max << '+' << max;
+        sheet->SetCell("A1"_pos, formula.str());
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+                        CellInterface::Value(FormulaError::Category::Arithmetic));
+    }
+
+    {
+        std::ostringstream formula;
+        formula << '=' << -max << '-' << max;
+        sheet->SetCell("A1"_pos, formula.str());
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+                        CellInterface::Value(FormulaError::Category::Arithmetic));
+    }
+
+    {
+        std::ostringstream formula;
+        formula << '=' << max << '*' << max;
+        sheet->SetCell("A1"_pos, formula.str());
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+                        CellInterface::Value(FormulaError::Category::Arithmetic));
+    }
+}
+
+void TestEmptyCellTreatedAsZero() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "=B2");
+    sheet->GetCell("A1"_pos);
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+    CellInterface::Value(0.0));
+}
+
+void TestFormulaInvalidPosition() {
+    auto sheet = CreateSheet();
+    auto try_formula = [&](const std::string& formula) {
+        try {
+            sheet->SetCell("A1"_pos, formula);
+            ASSERT(false);
+        } catch (const FormulaException&) {
+        } 
+    };
+
+    try_formula("=X0");
+    try_formula("=ABCD1");
+    try_formula("=A123456");
+    try_formula("=ABCDEFGHIJKLMNOPQRS1234567890");
+    try_formula("=XFD16385");
+    try_formula("=XFE16384");
+    try_formula("=R2D2");
+}
+
+void TestPrint() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A2"_pos, "meow");
+    sheet->SetCell("B2"_pos, "=35");
+
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 2}));
+
+    std::ostringstream texts;
+    sheet->PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), "\t\nmeow\t=35\n");
+
+    std::ostringstream values;
+    sheet->PrintValues(values);
+    ASSERT_EQUAL(values.str(), "\t\nmeow\t35\n");
+}
+
+void TestCellReferences() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("A2"_pos, "=A1");
+    sheet->SetCell("B2"_pos, "=A1");
+
+    ASSERT(sheet->GetCell("A1"_pos)->GetReferencedCells().empty());
+    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetReferencedCells(), std::vector{"A1"_pos});
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetReferencedCells(), std::vector{"A1"_pos});
+
+    // Ссылка на пустую ячейку не создаёт её
+    sheet->SetCell("B2"_pos, "=B1");
+    ASSERT(sheet->GetCell("B1"_pos) == nullptr);
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetReferencedCells(), std::vector{"B1"_pos});
+
+    sheet->SetCell("A2"_pos, "");
+    ASSERT(sheet->GetCell("A1"_pos)->GetReferencedCells().empty());
+    ASSERT(sheet->GetCell("A2"_pos)->GetReferencedCells().empty());
+
+    // Ссылка на ячейку за пределами таблицы
+    sheet->SetCell("B1"_pos, "=C3");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetReferencedCells(), std::vector{"C3"_pos});
+}
+
+void TestFormulaIncorrect() {
+    auto isIncorrect = [](std::string expression) {
+        try {
+            ParseFormula(std::move(expression));
+        } catch (const FormulaException&) {
+            return true;
+        }
+        return false;
+    };
+
+    ASSERT(isIncorrect("A2B"));
+    ASSERT(isIncorrect("3X"));
+    ASSERT(isIncorrect("A0++"));
+    ASSERT(isIncorrect("((1)"));
+    ASSERT(isIncorrect("2+4-"));
+}
+
+void TestCellCircularReferences() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("E2"_pos, "=E4");
+    sheet->SetCell("E4"_pos, "=X9");
+    sheet->SetCell("X9"_pos, "=M6");
+    sheet->SetCell("M6"_pos, "Ready");
+
+    bool caught = false;
+    try {
+        sheet->SetCell("M6"_pos, "=E2");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+
+    ASSERT(caught);
+    ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
+
+    // лестница из ромбов: общие входы проверяются один раз, а не по числу путей
+    Sheet ladder;
+    ladder.SetCell("A1"_pos, "1");
+    ladder.SetCell("B1"_pos, "1");
+    for (int row = 1; row < 200; ++row) {
+        const std::string prev = std::to_string(row);
+        ladder.SetCell({row, 0}, "=A" + prev + "+B" + prev);
+        ladder.SetCell({row, 1}, "=A" + prev + "-B" + prev);
+    }
+    try {
+        ladder.SetCell("A1"_pos, "=B200");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+}
+
+void TestImportTexts() {
+    auto source = CreateSheet();
+    source->SetCell("A1"_pos, "=B1+C2");
+    source->SetCell("B1"_pos, "2");
+    source->SetCell("C2"_pos, "=B1*3");
+    source->SetCell("A3"_pos, "'=escaped");
+    source->SetCell("D3"_pos, "meow");
+
+    std::ostringstream texts;
+    source->PrintTexts(texts);
+
+    Sheet sheet;
+    std::istringstream input(texts.str());
+    ImportOptions options;
+    options.buffer_size = 7;  // строки пересекают границы блоков
+    options.threads = 2;
+    const auto stats = ImportTexts(sheet, input, options);
+    ASSERT_EQUAL(stats.bytes, texts.str().size());
+    ASSERT_EQUAL(stats.rows, 3u);
+    ASSERT_EQUAL(stats.cells, 5u);
+    ASSERT_EQUAL(stats.formulas, 2u);
+
+    std::ostringstream imported;
+    sheet.PrintTexts(imported);
+    ASSERT_EQUAL(imported.str(), texts.str());
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(8.0));
+
+    sheet.SetCell("B1"_pos, "1");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(4.0));
+}
+
+void TestImportInvalidFormula() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "old");
+    sheet.SetCell("C1"_pos, "=A1");
+    // одна неверная формула среди верных: таблица остаётся прежней
+    std::istringstream input("1\t=A1*2\tx\n=A1+\t2\n");
+    try {
+        ImportTexts(sheet, input);
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 3}));
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), std::string("old"));
+    ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+
+    // цикл внутри импорта и через прежнюю ячейку C1
+    for (const char* text : {"=B1\t=A1\n", "=C1\n"}) {
+        std::istringstream cycle(text);
+        try {
+            ImportTexts(sheet, cycle);
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), std::string("old"));
+    }
+
+    // пакет заменяет прежние ячейки и сбрасывает зависимые от них
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+    std::istringstream replace("=B1+1\t2\n");
+    ImportTexts(sheet, replace);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(3.0));
+    sheet.SetCell("B1"_pos, "5");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(6.0));
+
+    // цикл через другой лист книги отвергается до записи пакета
+    Workbook book;
+    auto& data = book.AddSheet("Data");
+    auto& report = book.AddSheet("Report");
+    report.SetCell("A1"_pos, "=Data!B1");
+    data.SetCell("C1"_pos, "=Report!A1");
+    for (const char* text : {"x\t=C1\n", "x\t=Report!A1\n"}) {
+        std::istringstream cycle(text);
+        try {
+            ImportTexts(data, cycle);
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+        ASSERT(data.GetCell("A1"_pos) == nullptr);
+        ASSERT(data.GetCell("B1"_pos) == nullptr);
+    }
+}
+
+void TestJournalRecovery() {
+    const auto path = (std::filesystem::temp_directory_path() / "spreadsheet_journal_test").string();
+    std::remove((path + ".log").c_str());
+    std::remove((path + ".ckpt").c_str());
+
+    std::string expected;
+    {
+        Sheet sheet;
+        JournalOptions options;
+        options.sync_every = 2;
+        options.checkpoint_every = 0;
+        Journal journal(sheet, path, options);
+        journal.SetCell("A1"_pos, "1");
+        journal.SetCell("B1"_pos, "=A1+1");
+        journal.Checkpoint();
+        ASSERT_EQUAL(journal.GetLogSize(), 0u);
+
+        journal.SetCell("A1"_pos, "5");
+        journal.SetCell("C3"_pos, "meow");
+        journal.ClearCell("C3"_pos);
+        journal.SetCell("A2"_pos, "=B1*2");
+        ASSERT_EQUAL(journal.GetPendingCount(), 0u);
+
+        std::ostringstream texts;
+        sheet.PrintTexts(texts);
+        expected = texts.str();
+    }
+
+    // недописанная запись в конце журнала игнорируется
+    {
+        std::FILE* log = std::fopen((path + ".log").c_str(), "ab");
+        const char torn[] = {1, 3};
+        std::fwrite(torn, 1, sizeof(torn), log);
+        std::fclose(log);
+    }
+
+    Sheet recovered;
+    ASSERT_EQUAL(Journal::Recover(recovered, path), 4u);
+    std::ostringstream texts;
+    recovered.PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), expected);
+    ASSERT_EQUAL(recovered.GetCell("A2"_pos)->GetValue(), CellInterface::Value(12.0));
+
+    // Тексты с табуляцией и переводом строки переживают контрольную точку.
+    // Журнал прежнего поколения (сбой до его обрезки) не проигрывается поверх
+    // новой точки.
+    std::vector<char> stale_log;
+    {
+        Sheet sheet;
+        Journal::Recover(sheet, path);
+        Journal journal(sheet, path);
+        journal.SetCell("B2"_pos, "two\tcols\nand rows");
+        journal.SetCell("C1"_pos, "=A2+1");
+        journal.Sync();
+        std::ifstream log(path + ".log", std::ios::binary);
+        stale_log.assign(std::istreambuf_iterator<char>(log), std::istreambuf_iterator<char>());
+        journal.Checkpoint();
+        journal.SetCell("C1"_pos, "=A1");
+    }
+    {
+        std::ofstream log(path + ".log", std::ios::binary | std::ios::trunc);
+        log.write(stale_log.data(), stale_log.size());
+    }
+    Sheet after_checkpoint;
+    ASSERT_EQUAL(Journal::Recover(after_checkpoint, path), 0u);
+    ASSERT_EQUAL(after_checkpoint.GetCell("B2"_pos)->GetText(), std::string("two\tcols\nand rows"));
+    ASSERT_EQUAL(after_checkpoint.GetCell("C1"_pos)->GetValue(), CellInterface::Value(13.0));
+    ASSERT_EQUAL(after_checkpoint.GetCell("A2"_pos)->GetValue(), CellInterface::Value(12.0));
+    {
+        // журнал без точки своего поколения начинается заново
+        Journal journal(after_checkpoint, path);
+        ASSERT_EQUAL(journal.GetLogSize(), 0u);
+        journal.SetCell("D1"_pos, "4");
+    }
+    Sheet reopened;
+    ASSERT_EQUAL(Journal::Recover(reopened, path), 1u);
+    ASSERT_EQUAL(reopened.GetCell("D1"_pos)->GetText(), std::string("4"));
+    ASSERT_EQUAL(reopened.GetCell("C1"_pos)->GetText(), std::string("=A2+1"));
+
+    // журнал, открытый после обрыва, пишет новые записи вместо недописанной
+    const auto torn_path = path + "_torn";
+    std::remove((torn_path + ".log").c_str());
+    std::remove((torn_path + ".ckpt").c_str());
+    {
+        Sheet sheet;
+        Journal journal(sheet, torn_path);
+        journal.SetCell("A1"_pos, "one");
+        journal.SetCell("A2"_pos, "two");
+    }
+    const auto torn_size = std::filesystem::file_size(torn_path + ".log");
+    std::filesystem::resize_file(torn_path + ".log", torn_size - 2);
+    {
+        Sheet sheet;
+        ASSERT_EQUAL(Journal::Recover(sheet, torn_path), 1u);
+        Journal journal(sheet, torn_path);
+        ASSERT(std::filesystem::file_size(torn_path + ".log") < torn_size - 2);
+        journal.SetCell("B1"_pos, "b1");
+        journal.SetCell("B2"_pos, "b2");
+    }
+    Sheet after_torn;
+    ASSERT_EQUAL(Journal::Recover(after_torn, torn_path), 3u);
+    ASSERT_EQUAL(after_torn.GetCell("A1"_pos)->GetText(), std::string("one"));
+    ASSERT(after_torn.GetCell("A2"_pos) == nullptr);
+    ASSERT_EQUAL(after_torn.GetCell("B1"_pos)->GetText(), std::string("b1"));
+    ASSERT_EQUAL(after_torn.GetCell("B2"_pos)->GetText(), std::string("b2"));
+
+    std::remove((path + ".log").c_str());
+    std::remove((path + ".ckpt").c_str());
+    std::remove((torn_path + ".log").c_str());
+    std::remove((torn_path + ".ckpt").c_str());
+}
+
+#ifdef SPREADSHEET_PROFILING
+void TestProfiler() {
+    auto& profiler = Profiler::Instance();
+    profiler.Reset();
+    profiler.Enable();
+
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "2");
+    sheet.SetCell("A2"_pos, "=A1*3");
+    sheet.SetCell("A3"_pos, "=A2+A1");
+    sheet.SetCell("B1"_pos, "=A1");
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(8.0));
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(8.0));
+    sheet.SetCell("A1"_pos, "1");
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(4.0));
+    profiler.Enable(false);
+
+    const auto a3 = profiler.GetProfile(sheet, "A3"_pos);
+    ASSERT_EQUAL(a3.evaluations, 2u);
+    ASSERT_EQUAL(a3.cache_hits, 1u);
+    ASSERT_EQUAL(a3.parses, 1u);
+    ASSERT(a3.total_time >= a3.self_time);
+    ASSERT_EQUAL(profiler.GetExecuteCount(), 4u);
+
+    // A1 -> {A2, A3, B1}
+    const auto a1 = profiler.GetProfile(sheet, "A1"_pos);
+    ASSERT(a1.invalidation_fanout >= 3u);
+    ASSERT_EQUAL(profiler.GetTopCells(1, Profiler::Metric::InvalidationFanout).front().pos, "A1"_pos);
+    ASSERT_EQUAL(profiler.GetTopCells(100).size(), 4u);
+    ASSERT_EQUAL(profiler.GetHotChain(sheet, "A3"_pos).front(), "A3"_pos);
+    ASSERT_EQUAL(profiler.GetHotChain(sheet, "A3"_pos).back(), "A1"_pos);
+
+    // выключенный профилировщик ничего не пишет
+    profiler.Reset();
+    sheet.SetCell("A1"_pos, "5");
+    sheet.GetCell("A3"_pos)->GetValue();
+    ASSERT(profiler.GetTopCells(10).empty());
+
+    // листы книги и копия таблицы ведут свои профили одних и тех же позиций
+    Workbook book;
+    auto& first = book.AddSheet("first");
+    auto& second = book.AddSheet("second");
+    first.SetCell("A1"_pos, "1");
+    first.SetCell("A2"_pos, "=A1+1");
+    second.SetCell("A1"_pos, "=B1");
+    second.SetCell("A2"_pos, "=A1*2");
+    second.SetCell("B1"_pos, "=C1");
+    auto clone = first.Clone();
+    profiler.Enable();
+    first.GetCell("A2"_pos)->GetValue();
+    first.GetCell("A2"_pos)->GetValue();
+    second.GetCell("A2"_pos)->GetValue();
+    clone->GetCell("A2"_pos)->GetValue();
+    clone->GetCell("A2"_pos)->GetValue();
+    clone->GetCell("A2"_pos)->GetValue();
+    profiler.Enable(false);
+    ASSERT_EQUAL(profiler.GetProfile(first, "A2"_pos).evaluations, 1u);
+    ASSERT_EQUAL(profiler.GetProfile(first, "A2"_pos).cache_hits, 1u);
+    ASSERT_EQUAL(profiler.GetProfile(*clone, "A2"_pos).cache_hits, 2u);
+    ASSERT_EQUAL(profiler.GetProfile(second, "A2"_pos).evaluations, 1u);
+    ASSERT_EQUAL(profiler.GetProfile(second, "B1"_pos).evaluations, 1u);
+    ASSERT_EQUAL(profiler.GetProfile(first, "B1"_pos).evaluations, 0u);
+    // цепочка строится по формулам и профилям своего листа
+    const std::vector<Position> second_chain {"A2"_pos, "A1"_pos, "B1"_pos, "C1"_pos};
+    ASSERT(profiler.GetHotChain(second, "A2"_pos) == second_chain);
+    ASSERT(profiler.GetHotChain(first, "A2"_pos) == std::vector<Position>({"A2"_pos, "A1"_pos}));
+    const auto top = profiler.GetTopCells(100, Profiler::Metric::Evaluations);
+    ASSERT_EQUAL(std::count_if(top.begin(), top.end(), [](const CellProfile& profile) {
+                     return profile.pos == "A2"_pos;
+                 }),
+                 3);
+    // профили уничтоженной таблицы забываются
+    const SheetInterface* clone_address = clone.get();
+    clone.reset();
+    for (const auto& profile : profiler.GetTopCells(100)) {
+        ASSERT(profile.sheet != clone_address);
+    }
+}
+#endif
+
+void TestReferenceToEmptyCell() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "=C30+D4");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 1}));
+    ASSERT(sheet->GetCell("C30"_pos) == nullptr);
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+
+    std::ostringstream texts;
+    sheet->PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), "=C30+D4\n");
+
+    // зависимость от пустой позиции сохраняется, когда ячейка появляется и исчезает
+    sheet->SetCell("C30"_pos, "2");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(2.0));
+    sheet->SetCell("C30"_pos, "5");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(5.0));
+    sheet->ClearCell("C30"_pos);
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 1}));
+
+    bool caught = false;
+    try {
+        sheet->SetCell("D4"_pos, "=A1");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT(sheet->GetCell("D4"_pos) == nullptr);
+}
+
+void TestEagerRecalculation() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*0");
+    sheet.SetCell("C1"_pos, "=B1+1");
+    sheet.SetCell("D1"_pos, "=A1+1");
+    sheet.SetCell("E1"_pos, "=D1+C1");
+    sheet.SetRecalcMode(RecalcMode::Eager);
+
+    std::vector<std::vector<Position>> notifications;
+    const auto id = sheet.Subscribe([&notifications](const std::vector<Position>& changes) {
+        notifications.push_back(changes);
+    });
+
+    // B1 пересчитывается в тот же 0, поэтому C1 не трогается
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(notifications.size(), 1u);
+    ASSERT_EQUAL(notifications.back(), (std::vector{"A1"_pos, "D1"_pos, "E1"_pos}));
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(4.0));
+
+    // то же значение - никаких уведомлений
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(notifications.size(), 1u);
+    ASSERT(sheet.GetLastChanges().empty());
+
+    sheet.ClearCell("A1"_pos);
+    ASSERT_EQUAL(notifications.back(), (std::vector{"A1"_pos, "D1"_pos, "E1"_pos}));
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+    sheet.SetCell("B1"_pos, "'text");
+    ASSERT_EQUAL(sheet.GetLastChanges(), (std::vector{"B1"_pos, "C1"_pos, "E1"_pos}));
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Value));
+
+    sheet.Unsubscribe(id);
+    sheet.SetCell("B1"_pos, "3");
+    ASSERT_EQUAL(notifications.size(), 3u);
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(5.0));
+
+    // ромб A1 -> {B1, C1}, B1 -> C1: C1 пересчитывается после B1 при любом
+    // порядке обхода зависимых A1
+    for (const auto& [middle, last] : {std::pair{"B1"_pos, "C1"_pos}, std::pair{"C1"_pos, "B1"_pos}}) {
+        Sheet diamond;
+        diamond.SetRecalcMode(RecalcMode::Eager);
+        diamond.SetCell("A1"_pos, "2");
+        diamond.SetCell(middle, "=A1");
+        diamond.SetCell(last, "=A1/" + middle.ToString());
+        ASSERT_EQUAL(diamond.GetCell(last)->GetValue(), CellInterface::Value(1.0));
+        diamond.SetCell("A1"_pos, "3");
+        ASSERT_EQUAL(diamond.GetCell(last)->GetValue(), CellInterface::Value(1.0));
+        diamond.SetCell("A1"_pos, "=1/0");
+        ASSERT_EQUAL(diamond.GetCell(last)->GetValue(), CellInterface::Value(FormulaError::Category::Arithmetic));
+        diamond.SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(diamond.GetCell(last)->GetValue(), CellInterface::Value(1.0));
+    }
+}
+
+void TestValueChangeCutoff() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1-A1");
+    sheet.SetCell("C1"_pos, "=B1+1");
+    sheet.SetCell("D1"_pos, "=C1*2+E1");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(2.0));
+    const auto c1_changed = static_cast<const Cell*>(sheet.GetCell("C1"_pos))->GetChangedAt();
+
+    sheet.SetCell("A1"_pos, "7");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(2.0));
+    ASSERT_EQUAL(static_cast<const Cell*>(sheet.GetCell("C1"_pos))->GetChangedAt(), c1_changed);
+
+    // появление, изменение и очистка ячейки, на которую ссылаются
+    sheet.SetCell("E1"_pos, "3");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(5.0));
+    sheet.SetCell("E1"_pos, "=1+2");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(5.0));
+    sheet.ClearCell("E1"_pos);
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+    sheet.SetCell("B1"_pos, "=A1");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(16.0));
+    sheet.SetCell("A1"_pos, "x");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Value));
+    sheet.SetCell("A1"_pos, "0");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+#ifdef SPREADSHEET_PROFILING
+    auto& profiler = Profiler::Instance();
+    sheet.SetCell("B1"_pos, "=A1*0");
+    sheet.GetCell("D1"_pos)->GetValue();
+    profiler.Reset();
+    profiler.Enable();
+    for (int i = 1; i <= 10; ++i) {
+        sheet.SetCell("A1"_pos, std::to_string(i));
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(2.0));
+    }
+    profiler.Enable(false);
+    // пересчитывается только B1, C1 и D1 лишь перепроверяются
+    ASSERT_EQUAL(profiler.GetExecuteCount(), 10u);
+    ASSERT_EQUAL(profiler.GetProfile(sheet, "D1"_pos).evaluations, 0u);
+#endif
+}
+
+void TestNumericColumnStore() {
+    Sheet sheet;
+    for (int row = 0; row < 100; ++row) {
+        sheet.SetCell({row, 0}, std::to_string(row));
+    }
+    sheet.SetCell("B1"_pos, "=A10+A100");
+    ASSERT(sheet.GetNumericColumn(1) == nullptr);
+    const auto* column = sheet.GetNumericColumn(0);
+    ASSERT(column != nullptr);
+    ASSERT_EQUAL(column->GetCount(), 100u);
+    ASSERT_EQUAL(column->GetRows(), 100);
+    ASSERT_EQUAL(column->GetData()[42], 42.0);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(108.0));
+
+    sheet.SetCell("A10"_pos, "'1e3");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(1099.0));
+    sheet.SetCell("A10"_pos, "ten");
+    ASSERT(!column->IsValid(9));
+    ASSERT_EQUAL(column->GetCount(), 99u);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Value));
+    sheet.ClearCell("A10"_pos);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(99.0));
+
+    for (int row = 0; row < 80; ++row) {
+        sheet.ClearCell({row, 0});
+    }
+    ASSERT(sheet.GetNumericColumn(0) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(99.0));
+}
+
+void TestBatchEvaluation() {
+    Sheet batch;
+    Sheet scalar;
+    for (auto* sheet : {&batch, &scalar}) {
+        for (int row = 0; row < 600; ++row) {
+            const auto r = std::to_string(row + 1);
+            sheet->SetCell({row, 0}, std::to_string(row % 7));
+            sheet->SetCell({row, 1}, std::to_string(row * 0.5));
+            sheet->SetCell({row, 2}, "=-A" + r + "*B" + r + "+1/A" + r + "-(A" + r + "+B" + r + ")/2");
+        }
+        sheet->SetCell("A10"_pos, "text");
+        sheet->SetCell("A11"_pos, "'12");
+        sheet->SetCell("B12"_pos, "=1/0");
+        sheet->SetCell("B13"_pos, "");
+        sheet->SetCell("B14"_pos, "1e308");
+        sheet->SetCell("A14"_pos, "1e10");
+        sheet->ClearCell("A15"_pos);
+    }
+    batch.EvaluateAll();
+    for (int row = 0; row < 600; ++row) {
+        ASSERT_EQUAL(batch.GetCell({row, 2})->GetValue(), scalar.GetCell({row, 2})->GetValue());
+    }
+    ASSERT_EQUAL(batch.GetCell("C1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Arithmetic));
+    ASSERT_EQUAL(batch.GetCell("C10"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+    ASSERT_EQUAL(batch.GetCell("C14"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Arithmetic));
+
+    // пакетно сохранённые значения участвуют в обычной инвалидации
+    batch.SetCell("A3"_pos, "4");
+    scalar.SetCell("A3"_pos, "4");
+    std::ostringstream batch_out;
+    std::ostringstream scalar_out;
+    batch.PrintValues(batch_out);
+    for (int row = 0; row < 600; ++row) {
+        ASSERT_EQUAL(batch.GetCell({row, 2})->GetValue(), scalar.GetCell({row, 2})->GetValue());
+    }
+    scalar.PrintValues(scalar_out);
+    ASSERT_EQUAL(batch_out.str(), scalar_out.str());
+}
+
+void TestFormulaShapes() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "3");
+    sheet.SetCell("A2"_pos, "0");
+    sheet.SetCell("A3"_pos, "text");
+    sheet.SetCell("A4"_pos, "=1/0");
+    sheet.SetCell("A5"_pos, "'2.5");
+    sheet.SetCell("A6"_pos, "=A3");
+    sheet.SetCell("A7"_pos, "1e308");
+    // A8 пуст
+
+    const std::vector<std::string> operands = {"A1", "A2", "A3", "A4", "A5", "A6", "A7", "A8", "2", "1e308"};
+    std::vector<std::string> expressions;
+    for (const auto& lhs : operands) {
+        expressions.push_back(lhs);
+        expressions.push_back("-" + lhs);
+        expressions.push_back("+" + lhs);
+        for (const auto& rhs : operands) {
+            for (const char* op : {"+", "-", "*", "/"}) {
+                expressions.push_back(lhs + op + rhs);
+            }
+        }
+    }
+    for (const auto& expression : expressions) {
+        FormulaInterface::Value expected;
+        try {
+            expected = ParseFormulaAST(expression).Execute(sheet);
+        } catch (const FormulaError& error) {
+            expected = error;
+        }
+        if (!(ParseFormula(expression)->Evaluate(sheet) == expected)) {
+            throw std::runtime_error("shape evaluator differs from the tree on =" + expression);
+        }
+    }
+}
+
+void TestAsyncRecalculation() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    for (int row = 1; row < 2000; ++row) {
+        sheet.SetCell({row, 0}, "=" + Position{row - 1, 0}.ToString() + "+1");
+        sheet.SetCell({row, 1}, "=" + Position{row, 0}.ToString() + "*2");
+    }
+    ASSERT(!sheet.TryGetValue("B2000"_pos).has_value());
+    ASSERT_EQUAL(*sheet.TryGetValue("C1"_pos), CellInterface::Value(std::string()));
+
+    auto task = sheet.RecalculateAsync();
+    ASSERT_EQUAL(task->GetTotal(), 3999u);
+    ASSERT(task->Wait());
+    ASSERT_EQUAL(task->GetDone(), task->GetTotal());
+    ASSERT_EQUAL(*sheet.TryGetValue("B2000"_pos), CellInterface::Value(4000.0));
+
+    // правка отменяет идущий пересчёт и ждёт его остановки
+    task = sheet.RecalculateAsync();
+    ASSERT_EQUAL(task->GetTotal(), 0u);
+    sheet.SetCell("A1"_pos, "2");
+    task = sheet.RecalculateAsync();
+    sheet.SetCell("A1"_pos, "3");
+    ASSERT(task->IsCancelled());
+    ASSERT(task->GetDone() <= task->GetTotal());
+    if (!task->Wait()) {
+        ASSERT(task->GetDone() < task->GetTotal());
+    }
+    ASSERT_EQUAL(sheet.GetCell("B2000"_pos)->GetValue(), CellInterface::Value(4004.0));
+
+    sheet.SetCell("A1"_pos, "4");
+    task = sheet.RecalculateAsync();
+    std::ostringstream out;
+    sheet.PrintValues(out);
+    ASSERT(task->Wait());
+    ASSERT_EQUAL(*sheet.TryGetValue("B1999"_pos), CellInterface::Value(4004.0));
+}
+
+void TestCellMap() {
+    ASSERT_EQUAL(CellKey::FromPosition({16383, 16383}).value, (1u << 28) - 1);
+    ASSERT_EQUAL(CellKey::FromPosition("C7"_pos).ToPosition(), "C7"_pos);
+
+    CellMap<int> map;
+    std::map<Position, int> expected;
+    ASSERT(map.find("A1"_pos) == map.end());
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> coord(0, 40);
+    for (int i = 0; i < 20000; ++i) {
+        const Position pos {coord(rng), coord(rng)};
+        if (rng() % 3 == 0) {
+            ASSERT_EQUAL(map.erase(pos), expected.erase(pos));
+        } else {
+            map[pos] = i;
+            expected[pos] = i;
+        }
+    }
+    ASSERT_EQUAL(map.size(), expected.size());
+    for (const auto& [pos, value] : expected) {
+        ASSERT_EQUAL(map.at(pos), value);
+    }
+    size_t count = 0;
+    for (const auto& [pos, value] : map) {
+        ASSERT_EQUAL(expected.at(pos), value);
+        ++count;
+    }
+    ASSERT_EQUAL(count, expected.size());
+    ASSERT(map.find(Position::NONE) == map.end());
+
+    CellSet set {"A1"_pos};
+    std::set<Position> expected_set {"A1"_pos};
+    ASSERT(!set.insert("A1"_pos));
+    for (int i = 0; i < 20000; ++i) {
+        const Position pos {coord(rng), coord(rng)};
+        if (rng() % 3 == 0) {
+            ASSERT_EQUAL(set.erase(pos), expected_set.erase(pos));
+        } else {
+            ASSERT_EQUAL(set.insert(pos), expected_set.insert(pos).second);
+        }
+    }
+    ASSERT_EQUAL(set.size(), expected_set.size());
+    ASSERT(std::set<Position>(set.begin(), set.end()) == expected_set);
+    ASSERT_EQUAL(set.count(Position::NONE), 0u);
+    for (const auto& pos : expected_set) {
+        set.erase(pos);
+    }
+    set.shrink_to_fit();
+    ASSERT(set.empty() && set.begin() == set.end());
+}
+
+void TestClone() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "10");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    sheet.SetCell("C1"_pos, "=B1+A2");
+    sheet.SetCell("A2"_pos, "text");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+
+    auto clone = sheet.Clone();
+    ASSERT_EQUAL(clone->GetPrintableSize(), sheet.GetPrintableSize());
+    ASSERT_EQUAL(clone->GetCell("B1"_pos)->GetText(), std::string("=A1*2"));
+    ASSERT_EQUAL(clone->GetCell("B1"_pos)->GetValue(), CellInterface::Value(20.0));
+
+    // правки копии не видны исходной таблице и наоборот
+    clone->SetCell("A2"_pos, "1");
+    ASSERT_EQUAL(clone->GetCell("C1"_pos)->GetValue(), CellInterface::Value(21.0));
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+    sheet.SetCell("A1"_pos, "100");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(200.0));
+    ASSERT_EQUAL(clone->GetCell("B1"_pos)->GetValue(), CellInterface::Value(20.0));
+    clone->ClearCell("A1"_pos);
+    ASSERT_EQUAL(clone->GetCell("C1"_pos)->GetValue(), CellInterface::Value(1.0));
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), std::string("100"));
+    try {
+        clone->SetCell("A2"_pos, "=C1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+
+    // сценарии считаются параллельно
+    Sheet model;
+    for (int row = 0; row < 100; ++row) {
+        model.SetCell({row, 0}, std::to_string(row));
+        model.SetCell({row, 1}, "=" + Position{row, 0}.ToString() + "*C1");
+    }
+    std::vector<std::unique_ptr<Sheet>> scenarios;
+    for (int i = 0; i < 4; ++i) {
+        scenarios.push_back(model.Clone());
+        scenarios.back()->SetCell("C1"_pos, std::to_string(i));
+    }
+    std::vector<std::thread> workers;
+    for (auto& scenario : scenarios) {
+        workers.emplace_back([&scenario] {
+            scenario->EvaluateAll();
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    for (int i = 0; i < 4; ++i) {
+        ASSERT_EQUAL(scenarios[i]->GetCell("B100"_pos)->GetValue(), CellInterface::Value(99.0 * i));
+    }
+    ASSERT_EQUAL(model.GetCell("B100"_pos)->GetValue(), CellInterface::Value(0.0));
+}
+
+void TestSweep() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "2");
+    sheet.SetCell("A2"_pos, "3");
+    sheet.SetCell("A3"_pos, "text");
+    sheet.SetCell("B1"_pos, "=A1*A2+10");
+    sheet.SetCell("B2"_pos, "=1/(A1-4)");
+    sheet.SetCell("B3"_pos, "=B1+A3");
+    sheet.SetCell("B4"_pos, "=A3+B2");
+    sheet.SetCell("C1"_pos, "=-B1/B2");
+    sheet.SetCell("C2"_pos, "=A2*5");
+
+    const std::vector<Position> outputs = {"B1"_pos, "B2"_pos, "B3"_pos, "B4"_pos, "C1"_pos, "C2"_pos, "A3"_pos};
+    Sweep sweep(sheet, {"A1"_pos}, outputs);
+    // C2 от входа не зависит
+    ASSERT_EQUAL(sweep.GetFormulaCount(), 5u);
+
+    std::vector<double> inputs;
+    for (int i = -300; i < 300; ++i) {
+        inputs.push_back(i / 2.);
+    }
+    const auto result = sweep.Run({inputs}, 3);
+    ASSERT_EQUAL(result.size(), outputs.size());
+    // каждый сценарий совпадает с правкой копии таблицы
+    for (size_t s = 0; s < inputs.size(); s += 7) {
+        auto scenario = sheet.Clone();
+        scenario->SetCell("A1"_pos, std::to_string(inputs[s]));
+        for (size_t o = 0; o < outputs.size(); ++o) {
+            if (!(result[o][s] == scenario->GetCell(outputs[o])->GetValue())) {
+                throw std::runtime_error("sweep differs from sheet at " + outputs[o].ToString());
+            }
+        }
+    }
+    ASSERT_EQUAL(result[1][308], CellInterface::Value(FormulaError::Category::Arithmetic));
+    ASSERT_EQUAL(result[3][0], CellInterface::Value(FormulaError::Category::Value));
+    ASSERT_EQUAL(result[6][0], CellInterface::Value(std::string("text")));
+    // таблица не изменилась
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), std::string("2"));
+
+    try {
+        sweep.Run({inputs, inputs});
+        ASSERT(false);
+    } catch (const std::invalid_argument&) {
+    }
+
+    // A1 * A1 + 10 = 35 при A1 = 5
+    sheet.SetCell("A2"_pos, "=A1");
+    const auto root = GoalSeek(sheet, "A1"_pos, "B1"_pos, 35., 1.);
+    ASSERT(root.has_value());
+    ASSERT(std::abs(*root - 5.) < 1e-6);
+    ASSERT(!GoalSeek(sheet, "A1"_pos, "A3"_pos, 1., 0.).has_value());
+    ASSERT(!GoalSeek(sheet, "A1"_pos, "B4"_pos, 1., 0.).has_value());
+
+    // ссылка на удалённую строку даёт #REF! в каждом сценарии
+    Sheet deleted;
+    deleted.SetCell("A1"_pos, "1");
+    deleted.SetCell("A2"_pos, "5");
+    deleted.SetCell("B1"_pos, "=A1+A2*2");
+    deleted.SetCell("C1"_pos, "=A1*3");
+    deleted.DeleteRows(1);
+    ASSERT_EQUAL(deleted.GetCell("B1"_pos)->GetText(), std::string("=A1+#REF!*2"));
+    Sweep ref_sweep(deleted, {"A1"_pos}, {"B1"_pos, "C1"_pos});
+    const auto ref_result = ref_sweep.Run({{1., 2.}}, 1);
+    ASSERT_EQUAL(ref_result[0][1], CellInterface::Value(FormulaError::Category::Ref));
+    ASSERT_EQUAL(ref_result[1][1], CellInterface::Value(6.0));
+}
+
+void TestInsertDeleteLines() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "2");
+    sheet.SetCell("A3"_pos, "3");
+    sheet.SetCell("B1"_pos, "=A1+A3");
+    sheet.SetCell("B3"_pos, "=A2*10");
+    sheet.SetCell("C5"_pos, "=B3+A4");
+    ASSERT_EQUAL(sheet.GetCell("C5"_pos)->GetValue(), CellInterface::Value(20.0));
+
+    sheet.InsertRows(1, 2);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size {7, 3}));
+    ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetText(), std::string("2"));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), std::string("=A1+A5"));
+    ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetText(), std::string("=A4*10"));
+    ASSERT_EQUAL(sheet.GetCell("C7"_pos)->GetText(), std::string("=B5+A6"));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(4.0));
+    ASSERT_EQUAL(sheet.GetCell("C7"_pos)->GetValue(), CellInterface::Value(20.0));
+    // граф зависимостей переехал вместе с ячейками
+    sheet.SetCell("A4"_pos, "5");
+    ASSERT_EQUAL(sheet.GetCell("C7"_pos)->GetValue(), CellInterface::Value(50.0));
+    sheet.SetCell("A6"_pos, "1");
+    ASSERT_EQUAL(sheet.GetCell("C7"_pos)->GetValue(), CellInterface::Value(51.0));
+
+    // ссылки на удалённые ячейки становятся #REF!
+    sheet.DeleteRows(3, 2);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), std::string("=A1+#REF!"));
+    ASSERT_EQUAL(sheet.GetCell("C5"_pos)->GetText(), std::string("=#REF!+A4"));
+    ASSERT_EQUAL(sheet.GetCell("C5"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+    ASSERT(sheet.GetCell("C5"_pos)->GetReferencedCells() == std::vector<Position> {"A4"_pos});
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size {5, 3}));
+    // формула с #REF! разбирается заново
+    sheet.SetCell("D1"_pos, "=#REF!*2+B1");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), std::string("=#REF!*2+B1"));
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+
+    sheet.InsertCols(0);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), std::string("=B1+#REF!"));
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetText(), std::string("=#REF!*2+C1"));
+    sheet.DeleteCols(1);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), std::string("=#REF!+#REF!"));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), std::string("=#REF!*2+B1"));
+
+    try {
+        sheet.InsertRows(0, Position::MAX_ROWS);
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+
+    // числовой столбец сдвигается вместе с ячейками
+    Sheet numbers;
+    for (int row = 0; row < 200; ++row) {
+        numbers.SetCell({row, 0}, std::to_string(row));
+    }
+    numbers.SetCell("B1"_pos, "=A150+A200");
+    ASSERT(numbers.GetNumericColumn(0) != nullptr);
+    numbers.DeleteRows(10, 20);
+    ASSERT_EQUAL(numbers.GetCell("B1"_pos)->GetText(), std::string("=A130+A180"));
+    ASSERT_EQUAL(numbers.GetCell("B1"_pos)->GetValue(), CellInterface::Value(149.0 + 199.0));
+    numbers.InsertRows(0, 5);
+    ASSERT_EQUAL(numbers.GetCell("B6"_pos)->GetValue(), CellInterface::Value(149.0 + 199.0));
+    double value = 0.;
+    ASSERT(numbers.TryGetNumber("A16"_pos, value) && value == 30.);
+    ASSERT(!numbers.TryGetNumber("A1"_pos, value));
+    numbers.DeleteRows(0, 160);
+    ASSERT(numbers.GetNumericColumn(0) == nullptr);
+    ASSERT(numbers.GetCell("B1"_pos) == nullptr);
+    ASSERT(numbers.TryGetNumber("A1"_pos, value) == false);
+    ASSERT_EQUAL(numbers.GetCell("A1"_pos)->GetText(), std::string("175"));
+
+    // в режиме Eager значения актуальны сразу после сдвига
+    Sheet eager;
+    eager.SetCell("A1"_pos, "1");
+    eager.SetCell("A2"_pos, "=A1+1");
+    eager.SetRecalcMode(RecalcMode::Eager);
+    eager.DeleteRows(0);
+    ASSERT(static_cast<const Cell*>(eager.GetCell("A1"_pos))->IsUpToDate());
+    ASSERT_EQUAL(eager.GetCell("A1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+    ASSERT(eager.GetLastChanges() == std::vector<Position>({"A1"_pos, "A2"_pos}));
+}
+
+void TestFillRange() {
+    Sheet sheet;
+    for (int row = 0; row < 100; ++row) {
+        sheet.SetCell({row, 0}, std::to_string(row));
+        sheet.SetCell({row, 1}, "2");
+    }
+    sheet.SetCell("C1"_pos, "=A1*B1+1");
+    sheet.FillRange({"C1"_pos, "C1"_pos}, {"C1"_pos, "C100"_pos});
+    ASSERT_EQUAL(sheet.GetCell("C100"_pos)->GetText(), std::string("=A100*B100+1"));
+    ASSERT_EQUAL(sheet.GetCell("C100"_pos)->GetValue(), CellInterface::Value(199.0));
+    sheet.SetCell("A100"_pos, "1");
+    ASSERT_EQUAL(sheet.GetCell("C100"_pos)->GetValue(), CellInterface::Value(3.0));
+
+    // узор 1x2 повторяется по строке, ссылки сдвигаются вместе с копией
+    sheet.SetCell("E1"_pos, "3");
+    sheet.SetCell("F1"_pos, "=E1");
+    sheet.FillRange({"E1"_pos, "F1"_pos}, {"E2"_pos, "H3"_pos});
+    ASSERT_EQUAL(sheet.GetCell("G3"_pos)->GetText(), std::string("3"));
+    ASSERT_EQUAL(sheet.GetCell("H3"_pos)->GetText(), std::string("=G3"));
+    ASSERT_EQUAL(sheet.GetCell("H3"_pos)->GetValue(), CellInterface::Value(3.0));
+
+    // ссылка за край таблицы становится #REF!, пустые ячейки источника очищают цель
+    sheet.SetCell("J2"_pos, "=I1+1");
+    sheet.SetCell("K2"_pos, "5");
+    sheet.CopyRange({"J2"_pos, "J3"_pos}, "A1"_pos);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), std::string("=#REF!+1"));
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+    ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(1.0));
+
+    // цикл проверяется до изменений
+    sheet.SetCell("M1"_pos, "=N1");
+    sheet.SetCell("N2"_pos, "=M2");
+    try {
+        sheet.CopyRange({"M1"_pos, "M1"_pos}, "M2"_pos);
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT(sheet.GetCell("M2"_pos) == nullptr);
+    try {
+        sheet.CopyRange({"A1"_pos, "B2"_pos}, {Position::MAX_ROWS - 1, 0});
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+
+    // перекрытие источника и цели: копируется исходное содержимое
+    Sheet overlap;
+    overlap.SetCell("A1"_pos, "1");
+    overlap.SetCell("A2"_pos, "=A1+1");
+    overlap.CopyRange({"A1"_pos, "A2"_pos}, "A2"_pos);
+    ASSERT_EQUAL(overlap.GetCell("A2"_pos)->GetText(), std::string("1"));
+    ASSERT_EQUAL(overlap.GetCell("A3"_pos)->GetText(), std::string("=A2+1"));
+    ASSERT_EQUAL(overlap.GetCell("A3"_pos)->GetValue(), CellInterface::Value(2.0));
+
+    Sheet eager;
+    eager.SetRecalcMode(RecalcMode::Eager);
+    eager.SetCell("A1"_pos, "1");
+    eager.SetCell("B1"_pos, "=A1*10");
+    eager.FillRange({"A1"_pos, "B1"_pos}, {"A2"_pos, "B3"_pos});
+    ASSERT(eager.GetLastChanges() == std::vector<Position>({"A2"_pos, "B2"_pos, "A3"_pos, "B3"_pos}));
+    ASSERT_EQUAL(eager.GetCell("B3"_pos)->GetValue(), CellInterface::Value(10.0));
+    // зависимые от перезаписанных ячеек пересчитываются
+    eager.SetCell("C1"_pos, "=A3+1");
+    eager.SetCell("D1"_pos, "7");
+    eager.CopyRange({"D1"_pos, "D1"_pos}, "A3"_pos);
+    ASSERT(eager.GetLastChanges() == std::vector<Position>({"C1"_pos, "A3"_pos, "B3"_pos}));
+    ASSERT_EQUAL(eager.GetCell("C1"_pos)->GetValue(), CellInterface::Value(8.0));
+}
+
+void TestClearRange() {
+    Sheet sheet;
+    for (int row = 0; row < 100; ++row) {
+        sheet.SetCell({row, 0}, std::to_string(row));
+        sheet.SetCell({row, 1}, "1");
+    }
+    sheet.SetCell("C5"_pos, "x");
+    sheet.SetCell("D1"_pos, "=A100+B1");
+    sheet.SetCell("E1"_pos, "=D1*2");
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(200.0));
+    ASSERT(sheet.GetNumericColumn(0) != nullptr);
+
+    const auto revision = sheet.GetRevision();
+    sheet.ClearRange({"A1"_pos, "C100"_pos});
+    ASSERT_EQUAL(sheet.GetRevision(), revision + 1);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size {1, 5}));
+    ASSERT(sheet.GetCell("C5"_pos) == nullptr);
+    ASSERT(sheet.GetNumericColumn(0) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(0.0));
+    ASSERT_EQUAL(sheet.GetChangedAt("A100"_pos), revision + 1);
+
+    // пустой диапазон - не правка
+    sheet.ClearRange({"A1"_pos, "C100"_pos});
+    ASSERT_EQUAL(sheet.GetRevision(), revision + 1);
+
+    // частично задетые строки и столбцы
+    Sheet partial;
+    for (int row = 0; row < 3; ++row) {
+        for (int col = 0; col < 3; ++col) {
+            partial.SetCell({row, col}, "1");
+        }
+    }
+    partial.ClearRange({"B2"_pos, "C3"_pos});
+    ASSERT_EQUAL(partial.GetPrintableSize(), (Size {3, 3}));
+    partial.ClearRange({"A2"_pos, "A3"_pos});
+    ASSERT_EQUAL(partial.GetPrintableSize(), (Size {1, 3}));
+    std::ostringstream texts;
+    partial.PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), "1\t1\t1\n");
+
+    Sheet eager;
+    eager.SetRecalcMode(RecalcMode::Eager);
+    eager.SetCell("A1"_pos, "1");
+    eager.SetCell("A2"_pos, "2");
+    eager.SetCell("B1"_pos, "=A1+1");
+    eager.ClearRange({"A1"_pos, "A2"_pos});
+    ASSERT(eager.GetLastChanges() == std::vector<Position>({"A1"_pos, "B1"_pos, "A2"_pos}));
+    ASSERT_EQUAL(eager.GetCell("B1"_pos)->GetValue(), CellInterface::Value(1.0));
+}
+
+void TestViewport() {
+    Sheet sheet;
+    for (int row = 0; row < 1000; ++row) {
+        sheet.SetCell({row, 0}, std::to_string(row));
+        sheet.SetCell({row, 1}, "=A" + std::to_string(row + 1) + "*2");
+    }
+    sheet.SetCell("C1"_pos, "=B999+1");
+
+    sheet.EvaluateRange({"B1"_pos, "B10"_pos});
+    ASSERT(sheet.TryGetValue("B10"_pos) == CellInterface::Value(18.0));
+    ASSERT(!sheet.TryGetValue("B11"_pos).has_value());
+    ASSERT(!sheet.TryGetValue("C1"_pos).has_value());
+
+    // входы окна вычисляются, соседи - нет
+    std::ostringstream values;
+    sheet.PrintValues(values, {"C1"_pos, "C1"_pos});
+    ASSERT_EQUAL(values.str(), "1997\n");
+    ASSERT(sheet.TryGetValue("B999"_pos) == CellInterface::Value(1996.0));
+    ASSERT(!sheet.TryGetValue("B998"_pos).has_value());
+
+    std::ostringstream texts;
+    sheet.PrintTexts(texts, {"A2"_pos, "B3"_pos});
+    ASSERT_EQUAL(texts.str(), "1\t=A2*2\n2\t=A3*2\n");
+
+    // окно за пределами заполненной части печатается пустым
+    std::ostringstream empty;
+    sheet.PrintValues(empty, {"Z1"_pos, "AA2"_pos});
+    ASSERT_EQUAL(empty.str(), "\t\n\t\n");
+
+    try {
+        sheet.PrintTexts(texts, {"B3"_pos, "A2"_pos});
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+}
+
+void TestValueExport() {
+    Sheet sheet;
+    for (int row = 0; row < 6; ++row) {
+        sheet.SetCell({row, 0}, "=" + std::to_string(row) + "*0.5");
+        sheet.SetCell({row, 1}, "=7");
+        sheet.SetCell({row, 2}, row == 1 ? "y" : "x");
+    }
+    sheet.SetCell("D1"_pos, "=1/0");
+    sheet.SetCell("D2"_pos, "=A2+0.1");
+    sheet.SetCell("D3"_pos, "'=text");
+    const CellRange range{"A1"_pos, "E6"_pos};
+
+    std::vector<char> buffer(16);
+    const size_t size = ExportValues(sheet, range, buffer.data(), buffer.size());
+    ASSERT(size > buffer.size());
+    const std::vector<char> prefix = buffer;
+    buffer.resize(size);
+    ASSERT_EQUAL(ExportValues(sheet, range, buffer.data(), buffer.size()), size);
+    ASSERT(std::equal(prefix.begin(), prefix.end(), buffer.begin()));
+
+    std::vector<char> plain(1024);
+    plain.resize(ExportValues(sheet, range, plain.data(), plain.size(), {false}));
+    // повтор =7 и прогрессия A1:A6 занимают по одному значению
+    ASSERT(size + 8 * 8 < plain.size());
+
+    for (const auto& data : {buffer, plain}) {
+        const ValueGrid grid = ImportValues(data.data(), data.size());
+        ASSERT(grid.size == (Size{6, 5}));
+        for (int row = 0; row < 6; ++row) {
+            for (int col = 0; col < 5; ++col) {
+                const auto* cell = sheet.GetCell({row, col});
+                ASSERT_EQUAL(grid.Get(row, col), cell != nullptr ? cell->GetValue() : CellInterface::Value());
+            }
+        }
+    }
+
+    // обрезанная или чужая выгрузка не разбирается
+    for (size_t cut = 0; cut < size; ++cut) {
+        try {
+            ImportValues(buffer.data(), cut);
+            ASSERT(false);
+        } catch (const std::invalid_argument&) {
+        }
+    }
+    buffer[0] = 'X';
+    try {
+        ImportValues(buffer.data(), buffer.size());
+        ASSERT(false);
+    } catch (const std::invalid_argument&) {
+    }
+
+    // заголовок на всю таблицу без данных отвергается до выделения памяти
+    const char huge[] = {'S', 'V', 1, '\x80', '\x80', '\x01', '\x80', '\x80', '\x01', 0, 1};
+    try {
+        ImportValues(huge, sizeof(huge));
+        ASSERT(false);
+    } catch (const std::invalid_argument&) {
+    }
+
+    // почти прогрессии с непредставимым шагом восстанавливаются побитово
+    const auto bits = [](double value) {
+        uint64_t result;
+        std::memcpy(&result, &value, sizeof(result));
+        return result;
+    };
+    Sheet numbers;
+    const double start = 912.0685437784988;
+    const double step = -0.0008868972645463826 - start;
+    std::vector<double> column {start, -0.0008868972645463826};
+    for (int i = 2; i < 8; ++i) {
+        column.push_back(start + i * step);
+    }
+    for (int i = 0; i < 8; ++i) {
+        column.push_back(0.1 * (i + 1));
+    }
+    for (size_t row = 0; row < column.size(); ++row) {
+        char text[MAX_NUMBER_LENGTH];
+        numbers.SetCell({static_cast<int>(row), 0}, "=" + std::string(text, FormatNumber(column[row], text)));
+    }
+    const CellRange numbers_range{{0, 0}, {static_cast<int>(column.size()) - 1, 0}};
+    std::vector<char> data(1024);
+    data.resize(ExportValues(numbers, numbers_range, data.data(), data.size()));
+    const ValueGrid grid = ImportValues(data.data(), data.size());
+    for (size_t row = 0; row < column.size(); ++row) {
+        ASSERT_EQUAL(bits(std::get<double>(grid.Get(static_cast<int>(row), 0))), bits(column[row]));
+    }
+}
+
+void TestValueChanges() {
+    using Changes = std::vector<std::pair<Position, CellInterface::Value>>;
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    sheet.SetCell("C1"_pos, "x");
+    auto changes = sheet.GetValueChanges(0);
+    ASSERT_EQUAL(changes.revision, sheet.GetRevision());
+    ASSERT(changes.values == (Changes {{"A1"_pos, "1"}, {"B1"_pos, 2.0}, {"C1"_pos, "x"}}));
+    ASSERT(sheet.GetValueChanges(changes.revision).values.empty());
+
+    sheet.SetCell("A1"_pos, "2");
+    sheet.SetCell("C1"_pos, "x");
+    changes = sheet.GetValueChanges(changes.revision);
+    ASSERT(changes.values == (Changes {{"A1"_pos, "2"}, {"B1"_pos, 4.0}}));
+
+    // B1 пересчитана, но получила прежнее значение
+    sheet.SetCell("A1"_pos, "=1+1");
+    sheet.ClearCell("C1"_pos);
+    changes = sheet.GetValueChanges(changes.revision);
+    ASSERT(changes.values == (Changes {{"A1"_pos, 2.0}, {"C1"_pos, ""}}));
+
+    // сдвинутые ячейки выгружаются по обоим адресам
+    sheet.InsertRows(0);
+    changes = sheet.GetValueChanges(changes.revision);
+    ASSERT(changes.values == (Changes {{"A1"_pos, ""}, {"B1"_pos, ""}, {"A2"_pos, 2.0}, {"B2"_pos, 4.0}}));
+
+    // журнал сжимается, не теряя изменений
+    const uint64_t before = changes.revision;
+    for (int i = 0; i < 5000; ++i) {
+        sheet.SetCell("A2"_pos, std::to_string(i));
+    }
+    ASSERT(sheet.GetValueChanges(before).values == (Changes {{"A2"_pos, "4999"}, {"B2"_pos, 9998.0}}));
+
+    sheet.SetRecalcMode(RecalcMode::Eager);
+    changes = sheet.GetValueChanges(sheet.GetRevision());
+    sheet.SetCell("A2"_pos, "=1/0");
+    changes = sheet.GetValueChanges(changes.revision);
+    ASSERT(changes.values == (Changes {{"A2"_pos, FormulaError(FormulaError::Category::Arithmetic)},
+                                       {"B2"_pos, FormulaError(FormulaError::Category::Arithmetic)}}));
+}
+
+void TestNumberFormat() {
+    const auto format = [](double value, NumberFormat number_format) {
+        char buffer[MAX_NUMBER_LENGTH];
+        return std::string(buffer, FormatNumber(value, buffer, number_format));
+    };
+    ASSERT_EQUAL(format(0.1, NumberFormat::Shortest), "0.1");
+    ASSERT_EQUAL(format(1234567, NumberFormat::Shortest), "1234567");
+    ASSERT_EQUAL(format(1e21, NumberFormat::Shortest), "1e+21");
+    ASSERT_EQUAL(format(-0.0, NumberFormat::Shortest), "-0");
+    ASSERT_EQUAL(format(1234567, NumberFormat::Stream), "1.23457e+06");
+    ASSERT_EQUAL(format(1. / 3, NumberFormat::Stream), "0.333333");
+
+    std::mt19937_64 rng(7);
+    for (int i = 0; i < 10000; ++i) {
+        double value;
+        const uint64_t bits = rng();
+        std::memcpy(&value, &bits, sizeof(value));
+        if (!std::isfinite(value)) {
+            continue;
+        }
+        double parsed = 0.;
+        ASSERT(ParseNumber(format(value, NumberFormat::Shortest), parsed));
+        ASSERT_EQUAL(parsed, value);
+    }
+
+    // литералы формулы печатаются без потери цифр
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=1234567.25+1/3");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "=1234567.25+1/3");
+    std::ostringstream shortest;
+    sheet.PrintValues(shortest);
+    ASSERT_EQUAL(shortest.str(), "1234567.5833333333\n");
+
+    sheet.SetNumberFormat(NumberFormat::Stream);
+    std::ostringstream compatible;
+    sheet.PrintValues(compatible);
+    ASSERT_EQUAL(compatible.str(), "1.23457e+06\n");
+}
+
+void TestMemoryStats() {
+    Sheet sheet;
+    ASSERT_EQUAL(sheet.GetMemoryStats().formulas, 0u);
+    for (int row = 0; row < 200; ++row) {
+        for (int col = 0; col < 20; ++col) {
+            sheet.SetCell({row, col}, col % 2 == 0 ? std::to_string(row * col)
+                                                   : "=" + Position{row, col - 1}.ToString() + "*2");
+        }
+    }
+    sheet.SetCell({200, 0}, "a rather long text that does not fit into a short string");
+    sheet.EvaluateAll();
+    const auto full = sheet.GetMemoryStats();
+    ASSERT(full.cells >= 4001 * sizeof(Cell));
+    ASSERT(full.texts > 0 && full.formulas > full.texts);
+    ASSERT(full.values > 0 && full.dependencies > 0 && full.indexes > 0 && full.change_log > 0);
+    ASSERT_EQUAL(full.GetTotal(), full.cells + full.texts + full.formulas + full.values + full.dependencies
+                                      + full.indexes + full.change_log);
+
+    // общее содержимое протянутых ячеек делится между ними
+    Sheet filled;
+    filled.SetCell("A1"_pos, "a rather long text that does not fit into a short string");
+    const size_t single = filled.GetMemoryStats().texts;
+    filled.FillRange({"A1"_pos, "A1"_pos}, {"A2"_pos, "A100"_pos});
+    ASSERT(filled.GetMemoryStats().texts <= single);
+
+    sheet.ClearRange({{0, 0}, {199, 19}});
+    sheet.ShrinkToFit();
+    const auto shrunk = sheet.GetMemoryStats();
+    ASSERT(shrunk.GetTotal() * 10 < full.GetTotal());
+    ASSERT_EQUAL(shrunk.formulas, 0u);
+    ASSERT(shrunk.indexes < full.indexes / 10);
+    ASSERT(shrunk.cells < full.cells / 10);
+
+    // после сжатия таблица работает как обычно
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{201, 1}));
+    sheet.SetCell("B1"_pos, "=A201");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+    sheet.SetCell("A201"_pos, "3");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(3.0));
+}
+
+void TestCellOperands() {
+    using Value = CellInterface::Value;
+    Sheet sheet;
+    const auto value = [&sheet](Position pos) {
+        return sheet.GetCell(pos)->GetValue();
+    };
+    sheet.SetCell("A1"_pos, "=A2+1");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    sheet.SetCell("C1"_pos, "=B1+A1+D1");
+    // входы вычисляются по цепочке через неактуальные операнды
+    ASSERT_EQUAL(value("C1"_pos), Value(3.0));
+
+    // операнд следует за значением ячейки
+    sheet.SetCell("A2"_pos, "4");
+    ASSERT_EQUAL(value("C1"_pos), Value(15.0));
+    sheet.SetCell("A2"_pos, "text");
+    ASSERT_EQUAL(value("C1"_pos), Value(FormulaError::Category::Value));
+    sheet.SetCell("A2"_pos, "=1/0");
+    ASSERT_EQUAL(value("B1"_pos), Value(FormulaError::Category::Arithmetic));
+    sheet.SetCell("A2"_pos, "");
+    ASSERT_EQUAL(value("C1"_pos), Value(3.0));
+
+    // удаление и создание ячеек перепривязывает входы
+    sheet.ClearCell("A1"_pos);
+    ASSERT_EQUAL(value("C1"_pos), Value(0.0));
+    sheet.SetCell("D1"_pos, "5");
+    ASSERT_EQUAL(value("C1"_pos), Value(5.0));
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(value("C1"_pos), Value(11.0));
+    sheet.ClearRange({"A1"_pos, "A2"_pos});
+    ASSERT_EQUAL(value("C1"_pos), Value(5.0));
+
+    // сдвиг строк и столбцов
+    sheet.SetCell("A1"_pos, "1");
+    sheet.InsertRows(0, 3);
+    sheet.SetCell("A4"_pos, "7");
+    ASSERT_EQUAL(value("C4"_pos), Value(26.0));
+    sheet.DeleteCols(0);
+    ASSERT_EQUAL(value("B4"_pos), Value(FormulaError::Category::Ref));
+    sheet.DeleteRows(0, 3);
+    sheet.SetCell("C1"_pos, "1");
+    ASSERT_EQUAL(value("B1"_pos), Value(FormulaError::Category::Ref));
+    sheet.SetCell("A1"_pos, "=C1*3");
+    ASSERT_EQUAL(value("A1"_pos), Value(3.0));
+
+    // копия привязывает входы к своим ячейкам
+    auto clone = sheet.Clone();
+    clone->SetCell("C1"_pos, "2");
+    ASSERT_EQUAL(clone->GetCell("A1"_pos)->GetValue(), Value(6.0));
+    ASSERT_EQUAL(value("A1"_pos), Value(3.0));
+
+    // протянутые формулы читают свои входы
+    sheet.SetCell("C2"_pos, "10");
+    sheet.FillRange({"A1"_pos, "A1"_pos}, {"A2"_pos, "A3"_pos});
+    ASSERT_EQUAL(value("A2"_pos), Value(30.0));
+    ASSERT_EQUAL(value("A3"_pos), Value(0.0));
+    sheet.SetCell("C3"_pos, "=C2+1");
+    ASSERT_EQUAL(value("A3"_pos), Value(33.0));
+}
+
+void TestWorkbook() {
+    Workbook book;
+    auto& data = book.AddSheet("Data");
+    auto& report = book.AddSheet("Report");
+    data.SetCell("A1"_pos, "10");
+    report.SetCell("A1"_pos, "=Data!A1*2");
+    report.SetCell("A2"_pos, "=A1+1");
+    ASSERT_EQUAL(report.GetCell("A1"_pos)->GetText(), std::string("=Data!A1*2"));
+    ASSERT_EQUAL(report.GetCell("A2"_pos)->GetValue(), CellInterface::Value(21.0));
+    ASSERT(report.GetCell("A1"_pos)->GetReferencedCells().empty());
+
+    // правка одного листа сбрасывает зависимые ячейки другого
+    data.SetCell("A1"_pos, "5");
+    ASSERT_EQUAL(report.GetCell("A2"_pos)->GetValue(), CellInterface::Value(11.0));
+    data.ClearCell("A1"_pos);
+    ASSERT_EQUAL(report.GetCell("A2"_pos)->GetValue(), CellInterface::Value(1.0));
+    data.SetCell("A1"_pos, "3");
+    data.InsertRows(0);
+    ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+    data.DeleteRows(0);
+    data.SetRecalcMode(RecalcMode::Eager);
+    data.SetCell("A1"_pos, "7");
+    ASSERT_EQUAL(report.GetCell("A2"_pos)->GetValue(), CellInterface::Value(15.0));
+
+    // лист, которого ещё нет, даёт #REF!, пока его не добавят
+    report.SetCell("B1"_pos, "=Later!A1+1");
+    ASSERT_EQUAL(report.GetCell("B1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+    auto& later = book.AddSheet("Later");
+    ASSERT_EQUAL(report.GetCell("B1"_pos)->GetValue(), CellInterface::Value(1.0));
+    later.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(report.GetCell("B1"_pos)->GetValue(), CellInterface::Value(3.0));
+
+    // цикл через листы
+    data.SetCell("B1"_pos, "=Report!C1");
+    try {
+        report.SetCell("C1"_pos, "=Data!B1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT(report.GetCell("C1"_pos) == nullptr);
+    // копия формулы и сдвиг строк не переписывают ссылки других листов:
+    // цикл через них тоже отвергается, лист остаётся прежним
+    report.SetCell("D1"_pos, "=Data!D1");
+    data.SetCell("D2"_pos, "=Report!D1");
+    try {
+        data.FillRange({"D2"_pos, "D2"_pos}, {"D1"_pos, "D1"_pos});
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT(data.GetCell("D1"_pos) == nullptr);
+    data.SetCell("F1"_pos, "=G1");
+    try {
+        // в D1 попадает =E1, без ссылок на листы; цикл замыкает прежняя E1
+        data.SetCell("E1"_pos, "=Report!D1");
+        data.FillRange({"F1"_pos, "F1"_pos}, {"D1"_pos, "D1"_pos});
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT(data.GetCell("D1"_pos) == nullptr);
+    data.ClearCell("E1"_pos);
+    data.ClearCell("F1"_pos);
+    report.ClearCell("D1"_pos);
+    data.ClearCell("D2"_pos);
+    report.SetCell("E1"_pos, "=Data!A1");
+    data.SetCell("A2"_pos, "=Report!E1");
+    try {
+        // Report!E1 после удаления строки читала бы бывшую A2
+        data.DeleteRows(0);
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(data.GetCell("A2"_pos)->GetText(), std::string("=Report!E1"));
+    ASSERT_EQUAL(data.GetCell("A1"_pos)->GetText(), std::string("7"));
+    data.ClearCell("A2"_pos);
+    report.ClearCell("E1"_pos);
+
+    try {
+        book.AddSheet("Data");
+        ASSERT(false);
+    } catch (const std::invalid_argument&) {
+    }
+    try {
+        book.AddSheet("2nd");
+        ASSERT(false);
+    } catch (const std::invalid_argument&) {
+    }
+    ASSERT(book.GetSheetNames() == std::vector<std::string>({"Data", "Later", "Report"}));
+
+    // вычисление всей книги: Report после Data и Later, Summary после Report
+    auto& summary = book.AddSheet("Summary");
+    summary.SetCell("A1"_pos, "=Report!A2+Report!B1");
+    later.SetCell("A1"_pos, "4");
+    book.EvaluateAll(4);
+    ASSERT(summary.TryGetValue("A1"_pos) == CellInterface::Value(20.0));
+    ASSERT(report.TryGetValue("B1"_pos) == CellInterface::Value(5.0));
+
+    // отдельная таблица других листов не видит
+    Sheet alone;
+    alone.SetCell("A1"_pos, "=Data!A1");
+    ASSERT_EQUAL(alone.GetCell("A1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+}
+}  // namespace
+
+int main() {
+    auto sheet = CreateSheet();
+
+    auto isIncorrect = [](std::string expression) {
+        try {
+            ParseFormula(std::move(expression));
+        } catch (const FormulaException&) {
+            return true;
+        }
+        return false;
+    };
+    isIncorrect("A2B");
+    TestRunner tr;
+
+    RUN_TEST(tr, TestFormulaInvalidPosition);
+    RUN_TEST(tr, TestFormulaReferences);
+    RUN_TEST(tr, TestPositionAndStringConversion);
+    RUN_TEST(tr, TestPositionToStringInvalid);
+    RUN_TEST(tr, TestStringToPositionInvalid);
+    RUN_TEST(tr, TestEmpty);
+    RUN_TEST(tr, TestInvalidPosition);
+    RUN_TEST(tr, TestSetCellPlainText);
+    RUN_TEST(tr, TestClearCell);
+    RUN_TEST(tr, TestFormulaArithmetic);
+    RUN_TEST(tr, TestFormulaReferences);
+    RUN_TEST(tr, TestFormulaExpressionFormatting);
+    RUN_TEST(tr, TestFormulaReferencedCells);
+    RUN_TEST(tr, TestErrorValue);
+    RUN_TEST(tr, TestErrorArithmetic);
+    RUN_TEST(tr, TestEmptyCellTreatedAsZero);
+    RUN_TEST(tr, TestPrint);
+    RUN_TEST(tr, TestCellReferences);
+    RUN_TEST(tr, TestFormulaIncorrect);
+    RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestReferenceToEmptyCell);
+    RUN_TEST(tr, TestEagerRecalculation);
+    RUN_TEST(tr, TestValueChangeCutoff);
+    RUN_TEST(tr, TestNumericColumnStore);
+    RUN_TEST(tr, TestBatchEvaluation);
+    RUN_TEST(tr, TestFormulaShapes);
+    RUN_TEST(tr, TestAsyncRecalculation);
+    RUN_TEST(tr, TestCellMap);
+    RUN_TEST(tr, TestClone);
+    RUN_TEST(tr, TestSweep);
+    RUN_TEST(tr, TestInsertDeleteLines);
+    RUN_TEST(tr, TestFillRange);
+    RUN_TEST(tr, TestClearRange);
+    RUN_TEST(tr, TestWorkbook);
+    RUN_TEST(tr, TestViewport);
+    RUN_TEST(tr, TestValueExport);
+    RUN_TEST(tr, TestValueChanges);
+    RUN_TEST(tr, TestNumberFormat);
+    RUN_TEST(tr, TestMemoryStats);
+    RUN_TEST(tr, TestCellOperands);
+    RUN_TEST(tr, TestImportTexts);
+    RUN_TEST(tr, TestImportInvalidFormula);
+    RUN_TEST(tr, TestJournalRecovery);
+#ifdef SPREADSHEET_PROFILING
+    RUN_TEST(tr, TestProfiler);
+#endif
+    std::cout << "all tests passed" << std::endl;
+}
@@ -0,0 +1,101 @@
+#include "numeric_column.h"
+
+#include <algorithm>
+
+void NumericColumn::Set(int row, double value) {
+    if (static_cast<size_t>(row) >= values_.size()) {
+        values_.resize(row + 1, 0.);
+        validity_.resize(row / BITS + 1, 0);
+    }
+    values_[row] = value;
+    auto& word = validity_[row / BITS];
+    const uint64_t bit = uint64_t{1} << (row % BITS);
+    if ((word & bit) == 0) {
+        word |= bit;
+        ++count_;
+    }
+}
+
+void NumericColumn::Reset(int row) {
+    if (!IsValid(row)) {
+        return;
+    }
+    validity_[row / BITS] &= ~(uint64_t{1} << (row % BITS));
+    values_[row] = 0.;
+    --count_;
+}
+
+void NumericColumn::InsertRows(int row, int count) {
+    const size_t old_size = values_.size();
+    if (static_cast<size_t>(row) >= old_size) {
+        return;
+    }
+    values_.insert(values_.begin() + row, count, 0.);
+    validity_.resize((values_.size() - 1) / BITS + 1, 0);
+    for (size_t i = old_size; i-- > static_cast<size_t>(row);) {
+        AssignBit(i + count, GetBit(i));
+    }
+    for (size_t i = row; i < static_cast<size_t>(row) + count; ++i) {
+        AssignBit(i, false);
+    }
+}
+
+void NumericColumn::EraseRows(int row, int count) {
+    const size_t old_size = values_.size();
+    if (static_cast<size_t>(row) >= old_size) {
+        return;
+    }
+    const size_t last = std::min(old_size, static_cast<size_t>(row) + count);
+    for (size_t i = row; i < last; ++i) {
+        count_ -= GetBit(i);
+    }
+    const size_t erased = last - row;
+    for (size_t i = last; i < old_size; ++i) {
+        AssignBit(i - erased, GetBit(i));
+    }
+    for (size_t i = old_size - erased; i < old_size; ++i) {
+        AssignBit(i, false);
+    }
+    values_.erase(values_.begin() + row, values_.begin() + last);
+    validity_.resize(values_.empty() ? 0 : (values_.size() - 1) / BITS + 1);
+}
+
+void NumericColumn::AssignBit(size_t row, bool value) {
+    const uint64_t bit = uint64_t{1} << (row % BITS);
+    if (value) {
+        validity_[row / BITS] |= bit;
+    } else {
+        validity_[row / BITS] &= ~bit;
+    }
+}
+
+size_t NumericColumn::GetCount() const {
+    return count_;
+}
+
+int NumericColumn::GetRows() const {
+    return static_cast<int>(values_.size());
+}
+
+const double* NumericColumn::GetData() const {
+    return values_.data();
+}
+
+const uint64_t* NumericColumn::GetValidity() const {
+    return validity_.data();
+}
+
+size_t NumericColumn::GetMemoryUsage() const {
+    return values_.capacity() * sizeof(double) + validity_.capacity() * sizeof(uint64_t);
+}
+
+void NumericColumn::ShrinkToFit() {
+    size_t rows = values_.size();
+    while (rows > 0 && !GetBit(rows - 1)) {
+        --rows;
+    }
+    values_.resize(rows);
+    validity_.resize(rows == 0 ? 0 : (rows - 1) / BITS + 1);
+    values_.shrink_to_fit();
+    validity_.shrink_to_fit();
+}
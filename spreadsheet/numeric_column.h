@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Плотное хранилище чисел одного столбца: значения лежат подряд по номеру
+// строки, заполненность строк отмечена в битовой маске.
+class NumericColumn {
+public:
+    void Set(int row, double value);
+    void Reset(int row);
+    // Сдвигают строки от row и ниже одним переносом массива значений.
+    void InsertRows(int row, int count);
+    void EraseRows(int row, int count);
+
+    bool Get(int row, double& value) const {
+        if (!IsValid(row)) {
+            return false;
+        }
+        value = values_[row];
+        return true;
+    }
+
+    bool IsValid(int row) const {
+        return row >= 0 && static_cast<size_t>(row) < values_.size()
+            && (validity_[row / BITS] >> (row % BITS) & 1u);
+    }
+
+    // Число заполненных строк.
+    size_t GetCount() const;
+    // Длина массива значений: номер последней заполненной строки + 1.
+    int GetRows() const;
+    const double* GetData() const;
+    // Бит row % 64 слова row / 64.
+    const uint64_t* GetValidity() const;
+
+    // Байты массивов значений и маски.
+    size_t GetMemoryUsage() const;
+    // Отбрасывает незаполненные строки в конце и лишнюю ёмкость массивов.
+    void ShrinkToFit();
+
+private:
+    static constexpr int BITS = 64;
+
+    bool GetBit(size_t row) const {
+        return validity_[row / BITS] >> (row % BITS) & 1u;
+    }
+    void AssignBit(size_t row, bool value);
+
+    std::vector<double> values_;
+    std::vector<uint64_t> validity_;
+    size_t count_ = 0;
+};
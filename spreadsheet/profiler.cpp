@@ -0,0 +1,214 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <functional>
+#include <unordered_set>
+
+namespace {
+
+// время вложенных вычислений текущего потока, см. EvaluationScope
+thread_local std::chrono::nanoseconds children_time{0};
+
+std::chrono::nanoseconds Since(Profiler::Clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Profiler::Clock::now() - start);
+}
+
+uint64_t MetricValue(const CellProfile& profile, Profiler::Metric metric) {
+    switch (metric) {
+        case Profiler::Metric::TotalTime:
+            return profile.total_time.count();
+        case Profiler::Metric::SelfTime:
+            return profile.self_time.count();
+        case Profiler::Metric::Evaluations:
+            return profile.evaluations;
+        case Profiler::Metric::InvalidationFanout:
+            return profile.invalidation_fanout;
+        case Profiler::Metric::ParseTime:
+            return profile.parse_time.count();
+    }
+    return 0;
+}
+
+}  // namespace
+
+double CellProfile::HitRate() const {
+    const auto reads = evaluations + cache_hits;
+    return reads > 0 ? static_cast<double>(cache_hits) / reads : 0.;
+}
+
+Profiler& Profiler::Instance() {
+    static Profiler profiler;
+    return profiler;
+}
+
+void Profiler::Enable(bool enabled) {
+    enabled_.store(enabled, std::memory_order_relaxed);
+}
+
+void Profiler::Reset() {
+    std::lock_guard guard(mutex_);
+    sheets_.clear();
+    executes_ = 0;
+    execute_time_ = std::chrono::nanoseconds{0};
+}
+
+CellProfile& Profiler::GetRecord(const SheetInterface& sheet, Position pos) {
+    auto& profile = sheets_[&sheet][pos];
+    profile.sheet = &sheet;
+    profile.pos = pos;
+    return profile;
+}
+
+void Profiler::RecordCacheHit(const SheetInterface& sheet, Position pos) {
+    std::lock_guard guard(mutex_);
+    ++GetRecord(sheet, pos).cache_hits;
+}
+
+void Profiler::RecordEvaluation(const SheetInterface& sheet, Position pos, std::chrono::nanoseconds total,
+                                std::chrono::nanoseconds self) {
+    std::lock_guard guard(mutex_);
+    auto& profile = GetRecord(sheet, pos);
+    ++profile.evaluations;
+    profile.total_time += total;
+    profile.self_time += self;
+}
+
+void Profiler::RecordInvalidation(const SheetInterface& sheet, Position pos, size_t fanout) {
+    std::lock_guard guard(mutex_);
+    auto& profile = GetRecord(sheet, pos);
+    ++profile.invalidations;
+    profile.invalidation_fanout += fanout;
+}
+
+void Profiler::RecordParse(const SheetInterface& sheet, Position pos, std::chrono::nanoseconds time) {
+    std::lock_guard guard(mutex_);
+    auto& profile = GetRecord(sheet, pos);
+    ++profile.parses;
+    profile.parse_time += time;
+}
+
+void Profiler::RecordExecute(std::chrono::nanoseconds time) {
+    std::lock_guard guard(mutex_);
+    ++executes_;
+    execute_time_ += time;
+}
+
+void Profiler::ForgetSheet(const SheetInterface& sheet) {
+    std::lock_guard guard(mutex_);
+    sheets_.erase(&sheet);
+}
+
+CellProfile Profiler::GetProfile(const SheetInterface& sheet, Position pos) const {
+    std::lock_guard guard(mutex_);
+    const auto cells = sheets_.find(&sheet);
+    if (cells != sheets_.end()) {
+        const auto it = cells->second.find(pos);
+        if (it != cells->second.end()) {
+            return it->second;
+        }
+    }
+    CellProfile empty;
+    empty.sheet = &sheet;
+    empty.pos = pos;
+    return empty;
+}
+
+std::vector<CellProfile> Profiler::GetTopCells(size_t count, Metric metric) const {
+    std::vector<CellProfile> result;
+    {
+        std::lock_guard guard(mutex_);
+        for (const auto& [sheet, cells] : sheets_) {
+            for (const auto& [pos, profile] : cells) {
+                result.push_back(profile);
+            }
+        }
+    }
+    count = std::min(count, result.size());
+    std::partial_sort(result.begin(), result.begin() + count, result.end(),
+                      [metric](const CellProfile& lhs, const CellProfile& rhs) {
+                          const auto l = MetricValue(lhs, metric);
+                          const auto r = MetricValue(rhs, metric);
+                          if (l != r) {
+                              return l > r;
+                          }
+                          return lhs.pos == rhs.pos ? std::less<>()(lhs.sheet, rhs.sheet) : lhs.pos < rhs.pos;
+                      });
+    result.resize(count);
+    return result;
+}
+
+std::vector<Position> Profiler::GetHotChain(const SheetInterface& sheet, Position pos) const {
+    std::vector<Position> chain;
+    std::unordered_set<Position, PositionHash> visited;
+    while (pos.IsValid() && visited.insert(pos).second) {
+        chain.push_back(pos);
+        const auto* cell = sheet.GetCell(pos);
+        if (cell == nullptr) {
+            break;
+        }
+        Position next = Position::NONE;
+        std::chrono::nanoseconds best{-1};
+        for (const auto& ref : cell->GetReferencedCells()) {
+            const auto time = GetProfile(sheet, ref).total_time;
+            if (time > best) {
+                best = time;
+                next = ref;
+            }
+        }
+        pos = next;
+    }
+    return chain;
+}
+
+uint64_t Profiler::GetExecuteCount() const {
+    std::lock_guard guard(mutex_);
+    return executes_;
+}
+
+std::chrono::nanoseconds Profiler::GetExecuteTime() const {
+    std::lock_guard guard(mutex_);
+    return execute_time_;
+}
+
+Profiler::EvaluationScope::EvaluationScope(const SheetInterface& sheet, Position pos)
+    : sheet_(sheet), pos_(pos), active_(Profiler::Instance().IsEnabled()) {
+    if (active_) {
+        outer_children_ = children_time;
+        children_time = std::chrono::nanoseconds{0};
+        start_ = Clock::now();
+    }
+}
+
+Profiler::EvaluationScope::~EvaluationScope() {
+    if (active_) {
+        const auto total = Since(start_);
+        Profiler::Instance().RecordEvaluation(sheet_, pos_, total, total - children_time);
+        children_time = outer_children_ + total;
+    }
+}
+
+Profiler::ParseScope::ParseScope(const SheetInterface& sheet, Position pos)
+    : sheet_(sheet), pos_(pos), active_(Profiler::Instance().IsEnabled()) {
+    if (active_) {
+        start_ = Clock::now();
+    }
+}
+
+Profiler::ParseScope::~ParseScope() {
+    if (active_) {
+        Profiler::Instance().RecordParse(sheet_, pos_, Since(start_));
+    }
+}
+
+Profiler::ExecuteScope::ExecuteScope()
+    : active_(Profiler::Instance().IsEnabled()) {
+    if (active_) {
+        start_ = Clock::now();
+    }
+}
+
+Profiler::ExecuteScope::~ExecuteScope() {
+    if (active_) {
+        Profiler::Instance().RecordExecute(Since(start_));
+    }
+}
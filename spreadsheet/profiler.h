@@ -0,0 +1,150 @@
+#pragma once
+
+#include "cell_map.h"
+#include "common.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Профилировщик вычислений. Собирается при определённом SPREADSHEET_PROFILING
+// (опция CMake), включается во время работы через Profiler::Instance().Enable().
+// Без макроса точки замера раскрываются в пустоту, при выключенном профилировщике
+// стоят одну проверку флага.
+// Профили ведутся по каждой таблице отдельно: у листов книги и копии таблицы
+// (Clone) счётчики одних и тех же позиций не смешиваются.
+
+struct CellProfile {
+    const SheetInterface* sheet = nullptr;
+    Position pos;
+    uint64_t evaluations = 0;
+    uint64_t cache_hits = 0;
+    uint64_t invalidations = 0;
+    uint64_t invalidation_fanout = 0;
+    uint64_t parses = 0;
+    // время вычисления вместе с вычислением зависимостей
+    std::chrono::nanoseconds total_time{0};
+    // время вычисления собственной формулы
+    std::chrono::nanoseconds self_time{0};
+    std::chrono::nanoseconds parse_time{0};
+
+    double HitRate() const;
+};
+
+class Profiler {
+public:
+    enum class Metric {
+        TotalTime,
+        SelfTime,
+        Evaluations,
+        InvalidationFanout,
+        ParseTime,
+    };
+
+    using Clock = std::chrono::steady_clock;
+
+    static Profiler& Instance();
+
+    void Enable(bool enabled = true);
+    bool IsEnabled() const {
+        return enabled_.load(std::memory_order_relaxed);
+    }
+    void Reset();
+
+    void RecordCacheHit(const SheetInterface& sheet, Position pos);
+    void RecordEvaluation(const SheetInterface& sheet, Position pos, std::chrono::nanoseconds total,
+                          std::chrono::nanoseconds self);
+    void RecordInvalidation(const SheetInterface& sheet, Position pos, size_t fanout);
+    void RecordParse(const SheetInterface& sheet, Position pos, std::chrono::nanoseconds time);
+    void RecordExecute(std::chrono::nanoseconds time);
+    // Забывает профили уничтожаемой таблицы: её адрес может достаться новой.
+    void ForgetSheet(const SheetInterface& sheet);
+
+    CellProfile GetProfile(const SheetInterface& sheet, Position pos) const;
+    // N самых дорогих ячеек всех таблиц по выбранной метрике
+    std::vector<CellProfile> GetTopCells(size_t count, Metric metric = Metric::TotalTime) const;
+    // Цепочка от pos вниз по самым дорогим по TotalTime влияющим ячейкам.
+    std::vector<Position> GetHotChain(const SheetInterface& sheet, Position pos) const;
+
+    uint64_t GetExecuteCount() const;
+    std::chrono::nanoseconds GetExecuteTime() const;
+
+    // Замер времени вычисления ячейки; вложенные вычисления вычитаются из self_time.
+    class EvaluationScope {
+    public:
+        EvaluationScope(const SheetInterface& sheet, Position pos);
+        ~EvaluationScope();
+
+    private:
+        const SheetInterface& sheet_;
+        Position pos_;
+        bool active_;
+        std::chrono::nanoseconds outer_children_{0};
+        Clock::time_point start_;
+    };
+
+    class ParseScope {
+    public:
+        ParseScope(const SheetInterface& sheet, Position pos);
+        ~ParseScope();
+
+    private:
+        const SheetInterface& sheet_;
+        Position pos_;
+        bool active_;
+        Clock::time_point start_;
+    };
+
+    class ExecuteScope {
+    public:
+        ExecuteScope();
+        ~ExecuteScope();
+
+    private:
+        bool active_;
+        Clock::time_point start_;
+    };
+
+private:
+    Profiler() = default;
+
+    CellProfile& GetRecord(const SheetInterface& sheet, Position pos);
+
+    std::atomic<bool> enabled_ = false;
+    mutable std::mutex mutex_;
+    std::unordered_map<const SheetInterface*, CellMap<CellProfile>> sheets_;
+    uint64_t executes_ = 0;
+    std::chrono::nanoseconds execute_time_{0};
+};
+
+#ifdef SPREADSHEET_PROFILING
+#define PROFILE_CONCAT_IMPL(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_IMPL(a, b)
+#define PROFILE_CACHE_HIT(sheet, pos)                         \
+    do {                                                      \
+        if (Profiler::Instance().IsEnabled()) {               \
+            Profiler::Instance().RecordCacheHit(sheet, pos);  \
+        }                                                     \
+    } while (0)
+#define PROFILE_EVALUATION(sheet, pos) \
+    Profiler::EvaluationScope PROFILE_CONCAT(profile_scope_, __LINE__)(sheet, pos)
+#define PROFILE_PARSE(sheet, pos) Profiler::ParseScope PROFILE_CONCAT(profile_scope_, __LINE__)(sheet, pos)
+#define PROFILE_EXECUTE() Profiler::ExecuteScope PROFILE_CONCAT(profile_scope_, __LINE__)
+#define PROFILE_INVALIDATION(sheet, pos, fanout)                          \
+    do {                                                                  \
+        if (Profiler::Instance().IsEnabled()) {                           \
+            Profiler::Instance().RecordInvalidation(sheet, pos, fanout);  \
+        }                                                                 \
+    } while (0)
+#define PROFILE_FORGET_SHEET(sheet) Profiler::Instance().ForgetSheet(sheet)
+#else
+#define PROFILE_CACHE_HIT(sheet, pos) do {} while (0)
+#define PROFILE_EVALUATION(sheet, pos)
+#define PROFILE_PARSE(sheet, pos)
+#define PROFILE_EXECUTE()
+#define PROFILE_INVALIDATION(sheet, pos, fanout) do {} while (0)
+#define PROFILE_FORGET_SHEET(sheet) do {} while (0)
+#endif
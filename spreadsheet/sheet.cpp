@@ -1,121 +1,1637 @@
-#include "sheet.h"
-
-#include "cell.h"
-#include "common.h"
-
-#include <algorithm>
-#include <functional>
-#include <iostream>
-#include <optional>
-
-using namespace std::literals;
-
-Sheet::Sheet() {
-}
-
-Sheet::~Sheet() {}
-
-void Sheet::SetCell(Position pos, std::string text) {
-    if (!CheckPosition(pos)) {
-        throw InvalidPositionException("Invalid cell position");
-    }
-    cells_[pos] = std::make_unique<Cell>(text, pos, *this);
-    rows_idx_[pos.row].insert(pos.col);
-    cols_idx_[pos.col].insert(pos.row);
-    if (pos.row >= size_.rows) {
-        size_.rows = pos.row + 1;
-    }
-    if (pos.col >= size_.cols) {
-        size_.cols = pos.col + 1;
-    }
-}
-
-const CellInterface* Sheet::GetCell(Position pos) const {
-    if (!CheckPosition(pos)) {
-        throw InvalidPositionException("Invalid cell position");
-    }
-    const auto cell = cells_.find(pos);
-    if (cell != nullptr) {
-        return cell->second.get();
-    }
-    return nullptr;
-}
-
-CellInterface* Sheet::GetCell(Position pos) {
-    if (!CheckPosition(pos)) {
-        throw InvalidPositionException("Invalid cell position");
-    }
-    auto cell = cells_.find(pos);
-    if (cell != nullptr) {
-        return cell->second.get();
-    }
-    return nullptr;
-}
-
-void Sheet::ClearCell(Position pos) {
-    if (!CheckPosition(pos)) {
-        throw InvalidPositionException("Invalid cell position");
-    }
-    auto cell = cells_.find(pos);
-    if (cell != nullptr) {
-        cells_.erase(cell);
-        rows_idx_[pos.row].erase(pos.col);
-        cols_idx_[pos.col].erase(pos.row);
-        UpdateSize();
-    }
-}
-
-void Sheet::UpdateSize() {
-    while (size_.rows > 0 && rows_idx_[size_.rows - 1].empty()) {
-        rows_idx_.erase(size_.rows - 1);
-        --size_.rows;
-    }
-    while (size_.cols > 0 && cols_idx_[size_.cols - 1].empty()) {
-        cols_idx_.erase(size_.cols - 1);
-        --size_.cols;
-    }
-}
-
-bool Sheet::CheckPosition(const Position& pos) const {
-    return pos.IsValid();
-}
-
-Size Sheet::GetPrintableSize() const {
-    return size_;
-}
-
-template <typename Func>
-void Sheet::Print(std::ostream& output, Func pred) const {
-    for (int row_id = 0; row_id < size_.rows; ++row_id) {
-        bool first_col = true;
-        for (int col_id = 0; col_id < size_.cols; ++col_id) {
-            const auto cell = cells_.find(Position {row_id, col_id});
-            if (first_col) {
-                first_col = false;
-            } else {
-                output << '\t';
-            }
-            if (cell != nullptr) {
-                pred(output, *cell->second);
-            }
-        }
-        output << '\n';
-    }
-}
-
-void Sheet::PrintValues(std::ostream& output) const {
-    Print(output, [&output](std::ostream& os, const CellInterface& cell) {
-        std::visit(ValueVisitor { output }, cell.GetValue());
-    });
-}
-
-void Sheet::PrintTexts(std::ostream& output) const {
-    Print(output, [](std::ostream& os, const CellInterface& cell) {
-        os << cell.GetText();
-    });
-
-}
-
-std::unique_ptr<SheetInterface> CreateSheet() {
-    return std::make_unique<Sheet>();
-}
+#include "sheet.h"
+
+#include "batch_eval.h"
+#include "cell.h"
+#include "common.h"
+#include "profiler.h"
+#include "workbook.h"
+
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <numeric>
+#include <optional>
+
+using namespace std::literals;
+
+namespace {
+
+// столбец переводится в плотное хранилище, набрав столько чисел,
+// и возвращается обратно, когда их становится меньше половины порога
+const int NUMERIC_PROMOTE_COUNT = 64;
+const int NUMERIC_DEMOTE_COUNT = NUMERIC_PROMOTE_COUNT / 2;
+
+// более короткие серии одинаковых формул вычисляются по одной
+const int MIN_BATCH_ROWS = 8;
+
+// Вставка (count > 0) или удаление (count < 0) |count| строк или столбцов с first.
+struct LineShift {
+    bool rows;
+    int first;
+    int count;
+
+    int GetLine(Position pos) const {
+        return rows ? pos.row : pos.col;
+    }
+
+    bool Affects(Position pos) const {
+        return GetLine(pos) >= first;
+    }
+
+    // Новая позиция; Position::NONE для удалённой или ушедшей за край таблицы.
+    Position Map(Position pos) const {
+        if (!Affects(pos)) {
+            return pos;
+        }
+        int& line = rows ? pos.row : pos.col;
+        if (count < 0 && line < first - count) {
+            return Position::NONE;
+        }
+        line += count;
+        return pos.IsValid() ? pos : Position::NONE;
+    }
+};
+
+bool IsNumberCell(const CellInterface* cell, double& value) {
+    return cell != nullptr && static_cast<const Cell*>(cell)->GetNumber(value);
+}
+
+// Формулы в pos_a и pos_b одинаковы с точностью до сдвига всех ссылок на pos_b - pos_a.
+bool IsSameRelativeProgram(const std::vector<FormulaInstruction>& lhs, Position pos_a,
+                           const std::vector<FormulaInstruction>& rhs, Position pos_b) {
+    if (lhs.size() != rhs.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < lhs.size(); ++i) {
+        if (lhs[i].op != rhs[i].op) {
+            return false;
+        }
+        if (lhs[i].op == FormulaInstruction::Op::Number && !(lhs[i].number == rhs[i].number)) {
+            return false;
+        }
+        if (lhs[i].op == FormulaInstruction::Op::Cell
+            && (lhs[i].cell.row - pos_a.row != rhs[i].cell.row - pos_b.row
+                || lhs[i].cell.col - pos_a.col != rhs[i].cell.col - pos_b.col)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Серия, ссылающаяся на свой столбец, может зависеть сама от себя.
+bool ReferencesColumn(const std::vector<FormulaInstruction>& code, int col) {
+    return std::any_of(code.begin(), code.end(), [col](const FormulaInstruction& instruction) {
+        return instruction.op == FormulaInstruction::Op::Cell && instruction.cell.col == col;
+    });
+}
+
+// Хеш-контейнер стандартной библиотеки: массив корзин и узлы из значения
+// и указателя на следующий узел.
+template <typename Container>
+size_t GetHashMemory(const Container& container) {
+    return container.bucket_count() * sizeof(void*)
+        + container.size() * (sizeof(typename Container::value_type) + sizeof(void*));
+}
+
+template <typename T>
+size_t GetCellMapMemory(const CellMap<T>& map) {
+    return map.capacity() * (sizeof(uint32_t) + sizeof(typename CellMap<T>::value_type));
+}
+
+// Словарь множеств: индекс строк или столбцов.
+template <typename Index>
+size_t GetIndexMemory(const Index& index) {
+    size_t usage = GetHashMemory(index);
+    for (const auto& [key, items] : index) {
+        usage += GetHashMemory(items);
+    }
+    return usage;
+}
+
+// Граф зависимостей.
+size_t GetIndexMemory(const CellMap<CellSet>& index) {
+    size_t usage = GetCellMapMemory(index);
+    for (const auto& [pos, items] : index) {
+        usage += items.capacity() * sizeof(uint32_t);
+    }
+    return usage;
+}
+
+template <typename Index>
+void ShrinkIndex(Index& index) {
+    for (auto it = index.begin(); it != index.end();) {
+        if (it->second.empty()) {
+            it = index.erase(it);
+        } else {
+            it->second.rehash(0);
+            ++it;
+        }
+    }
+    index.rehash(0);
+}
+
+void ShrinkIndex(CellMap<CellSet>& index) {
+    std::vector<Position> empty;
+    for (auto& [pos, items] : index) {
+        if (items.empty()) {
+            empty.push_back(pos);
+        } else {
+            items.shrink_to_fit();
+        }
+    }
+    for (const auto& pos : empty) {
+        index.erase(pos);
+    }
+    index.shrink_to_fit();
+}
+
+}  // namespace
+
+Sheet::Sheet() {
+}
+
+Sheet::~Sheet() {
+    CancelRecalc();
+    PROFILE_FORGET_SHEET(*this);
+}
+
+std::unique_ptr<Sheet> Sheet::Clone() const {
+    // кеши ячеек читаются под тем же мьютексом, что и у фонового пересчёта
+    std::lock_guard guard(eval_mutex_);
+    auto clone = std::make_unique<Sheet>();
+    clone->cols_idx_ = cols_idx_;
+    clone->rows_idx_ = rows_idx_;
+    clone->size_ = size_;
+    clone->cells_.reserve(cells_.size());
+    for (const auto& [pos, cell] : cells_) {
+        clone->cells_[pos] = std::make_unique<Cell>(static_cast<const Cell&>(*cell), *clone);
+    }
+    clone->dependents_ = dependents_;
+    clone->cleared_at_ = cleared_at_;
+    clone->revision_ = revision_;
+    clone->change_log_ = change_log_;
+    clone->compact_log_at_ = compact_log_at_;
+    clone->numeric_counts_ = numeric_counts_;
+    clone->numeric_cols_ = numeric_cols_;
+    clone->recalc_mode_ = recalc_mode_;
+    clone->number_format_ = number_format_;
+    clone->workbook_ = workbook_;
+    return clone;
+}
+
+void Sheet::SetCell(Position pos, std::string text) {
+    DoSetCell(pos, std::move(text));
+}
+
+void Sheet::SetCell(Position pos, std::unique_ptr<FormulaInterface> formula) {
+    DoSetCell(pos, std::move(formula));
+}
+
+template <typename Content>
+void Sheet::DoSetCell(Position pos, Content content) {
+    if (!CheckPosition(pos)) {
+        throw InvalidPositionException("Invalid cell position");
+    }
+    CancelRecalc();
+    ++revision_;
+    const auto old_value = GetEagerValue(pos);
+    auto cell = cells_.find(pos);
+    double number;
+    const bool was_number = cell != cells_.end() && IsNumberCell(cell->second.get(), number);
+    if (cell != cells_.end()) {
+        static_cast<Cell&>(*cell->second).Set(std::move(content));
+    } else {
+        std::unique_ptr<Cell> new_cell;
+        if constexpr (std::is_same_v<Content, std::string>) {
+            new_cell = std::make_unique<Cell>(std::move(content), pos, *this);
+        } else {
+            new_cell = std::make_unique<Cell>("", pos, *this);
+            new_cell->Set(std::move(content));
+        }
+        cells_[pos] = std::move(new_cell);
+        ++layout_version_;
+        cleared_at_.erase(pos);
+        AddToIndex(pos);
+    }
+    UpdateNumericStore(pos, was_number);
+    OnCellChanged(pos, old_value);
+}
+
+void Sheet::AddToIndex(const Position& pos) {
+    rows_idx_.Write()[pos.row].insert(pos.col);
+    cols_idx_.Write()[pos.col].insert(pos.row);
+    if (pos.row >= size_.rows) {
+        size_.rows = pos.row + 1;
+    }
+    if (pos.col >= size_.cols) {
+        size_.cols = pos.col + 1;
+    }
+}
+
+const CellInterface* Sheet::GetCell(Position pos) const {
+    if (!CheckPosition(pos)) {
+        throw InvalidPositionException("Invalid cell position");
+    }
+    const auto cell = cells_.find(pos);
+    if (cell != cells_.end()) {
+        return cell->second.get();
+    }
+    return nullptr;
+}
+
+CellInterface* Sheet::GetCell(Position pos) {
+    if (!CheckPosition(pos)) {
+        throw InvalidPositionException("Invalid cell position");
+    }
+    auto cell = cells_.find(pos);
+    if (cell != cells_.end()) {
+        return cell->second.get();
+    }
+    return nullptr;
+}
+
+void Sheet::ClearCell(Position pos) {
+    if (!CheckPosition(pos)) {
+        throw InvalidPositionException("Invalid cell position");
+    }
+    if (cells_.find(pos) != cells_.end()) {
+        CancelRecalc();
+        ++revision_;
+        const auto old_value = GetEagerValue(pos);
+        EraseCell(pos);
+        UpdateSize();
+        OnCellChanged(pos, old_value);
+    }
+}
+
+// Удаляет существующую ячейку в рамках текущей правки; размер не пересчитывает.
+void Sheet::EraseCell(Position pos) {
+    auto cell = cells_.find(pos);
+    double number;
+    const bool was_number = IsNumberCell(cell->second.get(), number);
+    static_cast<Cell&>(*cell->second).ClearRefs();
+    cells_.erase(cell);
+    ++layout_version_;
+    if (GetDependents(pos) != nullptr) {
+        cleared_at_[pos] = revision_;
+    }
+    rows_idx_.Write()[pos.row].erase(pos.col);
+    cols_idx_.Write()[pos.col].erase(pos.row);
+    UpdateNumericStore(pos, was_number);
+}
+
+void Sheet::ClearRange(const CellRange& range) {
+    if (!range.IsValid()) {
+        throw InvalidPositionException("Invalid cell range");
+    }
+    std::vector<Position> cleared = GetCellsIn(range);
+    if (cleared.empty()) {
+        return;
+    }
+
+    CancelRecalc();
+    ++revision_;
+    // строки удалённых чисел по столбцам: числовое хранилище правится один раз на столбец
+    std::unordered_map<int, std::vector<int>> numbers;
+    for (const auto& pos : cleared) {
+        auto cell = cells_.find(pos);
+        double number;
+        if (IsNumberCell(cell->second.get(), number)) {
+            numbers[pos.col].push_back(pos.row);
+        }
+        static_cast<Cell&>(*cell->second).ClearRefs();
+        cells_.erase(cell);
+        if (GetDependents(pos) != nullptr) {
+            cleared_at_[pos] = revision_;
+        }
+    }
+    ++layout_version_;
+    for (const auto& [col, rows] : numbers) {
+        ReleaseNumbers(col, rows);
+    }
+    // строка (столбец), целиком попавшая в диапазон, удаляется из индекса
+    // одной записью, остальные - по ячейкам
+    const auto erase_lines = [](auto& index, int first, int last, int from, int to) {
+        for (int line = first; line <= last; ++line) {
+            auto items = index.find(line);
+            if (items == index.end()) {
+                continue;
+            }
+            const bool covered = std::all_of(items->second.begin(), items->second.end(), [&](int item) {
+                return item >= from && item <= to;
+            });
+            if (covered) {
+                index.erase(items);
+                continue;
+            }
+            for (auto item = items->second.begin(); item != items->second.end();) {
+                item = *item >= from && *item <= to ? items->second.erase(item) : std::next(item);
+            }
+        }
+    };
+    erase_lines(rows_idx_.Write(), range.from.row, std::min(range.to.row, size_.rows - 1), range.from.col,
+                range.to.col);
+    erase_lines(cols_idx_.Write(), range.from.col, std::min(range.to.col, size_.cols - 1), range.from.row,
+                range.to.row);
+    UpdateSize();
+
+    // зависимые внутри диапазона удалены вместе с ячейками; распространение
+    // останавливается на уже сброшенных ячейках, так что каждая сбрасывается один раз
+    for (const auto& pos : cleared) {
+        InvalidateDependents(pos);
+    }
+    if (recalc_mode_ == RecalcMode::Eager) {
+        NotifyBulkChange(std::move(cleared));
+    }
+}
+
+// Ячейки диапазона по индексу строк: в каждой строке просматривается меньшее
+// из ширины диапазона и числа ячеек строки.
+std::vector<Position> Sheet::GetCellsIn(const CellRange& range) const {
+    std::vector<Position> result;
+    const int last_row = std::min(range.to.row, size_.rows - 1);
+    const size_t width = range.to.col - range.from.col + 1;
+    for (int row = range.from.row; row <= last_row; ++row) {
+        const auto cols = rows_idx_->find(row);
+        if (cols == rows_idx_->end()) {
+            continue;
+        }
+        if (cols->second.size() > width) {
+            for (int col = range.from.col; col <= range.to.col; ++col) {
+                if (cols->second.count(col) > 0) {
+                    result.push_back({row, col});
+                }
+            }
+            continue;
+        }
+        for (const int col : cols->second) {
+            if (col >= range.from.col && col <= range.to.col) {
+                result.push_back({row, col});
+            }
+        }
+    }
+    return result;
+}
+
+void Sheet::FillRange(const CellRange& src, const CellRange& dst) {
+    if (!src.IsValid() || !dst.IsValid()) {
+        throw InvalidPositionException("Invalid cell range");
+    }
+    const Size size = src.GetSize();
+    // снимок источника: dst может его перекрывать
+    std::vector<std::unique_ptr<Cell>> sources(static_cast<size_t>(size.rows) * size.cols);
+    for (int row = 0; row < size.rows; ++row) {
+        for (int col = 0; col < size.cols; ++col) {
+            auto cell = cells_.find({src.from.row + row, src.from.col + col});
+            if (cell != cells_.end()) {
+                sources[row * size.cols + col] =
+                    std::make_unique<Cell>(static_cast<const Cell&>(*cell->second), *this);
+            }
+        }
+    }
+    const auto source_of = [&](Position target) {
+        const int row = (target.row - dst.from.row) % size.rows;
+        const int col = (target.col - dst.from.col) % size.cols;
+        return std::make_pair(sources[row * size.cols + col].get(),
+                              Position {src.from.row + row, src.from.col + col});
+    };
+
+    RefMap new_refs;
+    // позиции, в которые попадут формулы со ссылками на другие листы
+    std::vector<Position> linked;
+    for (int row = dst.from.row; row <= dst.to.row; ++row) {
+        for (int col = dst.from.col; col <= dst.to.col; ++col) {
+            const auto [source, source_pos] = source_of({row, col});
+            if (source == nullptr || source->GetFormula() == nullptr) {
+                continue;
+            }
+            if (!source->GetFormula()->GetSheetReferences().empty()) {
+                linked.push_back({row, col});
+            }
+            std::vector<Position> refs;
+            for (auto ref : source->GetReferencedCells()) {
+                ref.row += row - source_pos.row;
+                ref.col += col - source_pos.col;
+                if (ref.IsValid()) {
+                    refs.push_back(ref);
+                }
+            }
+            if (!refs.empty()) {
+                new_refs[{row, col}] = std::move(refs);
+            }
+        }
+    }
+    if (HasCycle([&dst](Position pos) { return dst.Contains(pos); }, new_refs)) {
+        throw CircularDependencyException("circular dependency");
+    }
+    // ссылки на другие листы копируются без сдвига и могут замкнуть цикл через них
+    const auto changed_links = [&](Position pos, Workbook::Links& links) {
+        if (!dst.Contains(pos)) {
+            return false;
+        }
+        const auto* source = source_of(pos).first;
+        if (source != nullptr && source->GetFormula() != nullptr) {
+            auto refs = new_refs.find(pos);
+            if (refs != new_refs.end()) {
+                links.cells = refs->second;
+            }
+            links.sheets = source->GetFormula()->GetSheetReferences();
+        }
+        return true;
+    };
+    if (!name_.empty() && workbook_->HasCycle(*this, changed_links, linked)) {
+        throw CircularDependencyException("circular dependency");
+    }
+
+    CancelRecalc();
+    ++revision_;
+    std::vector<Position> cleared;
+    for (int row = dst.from.row; row <= dst.to.row; ++row) {
+        for (int col = dst.from.col; col <= dst.to.col; ++col) {
+            const Position pos {row, col};
+            const auto [source, source_pos] = source_of(pos);
+            auto cell = cells_.find(pos);
+            if (source == nullptr) {
+                if (cell != cells_.end()) {
+                    EraseCell(pos);
+                    cleared.push_back(pos);
+                }
+                continue;
+            }
+            double number;
+            const bool was_number = cell != cells_.end() && IsNumberCell(cell->second.get(), number);
+            if (cell == cells_.end()) {
+                cells_[pos] = std::make_unique<Cell>("", pos, *this);
+                ++layout_version_;
+                cleared_at_.erase(pos);
+                AddToIndex(pos);
+            }
+            static_cast<Cell&>(*cells_.at(pos)).CopyFrom(*source, row - source_pos.row, col - source_pos.col);
+            UpdateNumericStore(pos, was_number);
+        }
+    }
+    UpdateSize();
+
+    for (int row = dst.from.row; row <= dst.to.row; ++row) {
+        for (int col = dst.from.col; col <= dst.to.col; ++col) {
+            InvalidateDependents({row, col});
+        }
+    }
+    if (recalc_mode_ == RecalcMode::Eager) {
+        NotifyBulkChange(std::move(cleared));
+    }
+}
+
+void Sheet::CopyRange(const CellRange& src, Position dst) {
+    const Size size = src.GetSize();
+    const CellRange dst_range {dst, {dst.row + size.rows - 1, dst.col + size.cols - 1}};
+    if (!src.IsValid() || !dst_range.IsValid()) {
+        throw InvalidPositionException("Invalid cell range");
+    }
+    FillRange(src, dst_range);
+}
+
+void Sheet::LoadCells(std::vector<std::pair<Position, std::string>> texts,
+                      std::vector<std::pair<Position, std::unique_ptr<FormulaInterface>>> formulas) {
+    PositionSet loaded;
+    RefMap new_refs;
+    CellMap<std::vector<SheetPosition>> sheet_refs;
+    for (const auto& [pos, text] : texts) {
+        if (!CheckPosition(pos)) {
+            throw InvalidPositionException("Invalid cell position");
+        }
+        loaded.insert(pos);
+    }
+    for (const auto& [pos, formula] : formulas) {
+        if (!CheckPosition(pos)) {
+            throw InvalidPositionException("Invalid cell position");
+        }
+        loaded.insert(pos);
+        new_refs[pos] = formula->GetReferencedCells();
+        if (!formula->GetSheetReferences().empty()) {
+            sheet_refs[pos] = formula->GetSheetReferences();
+        }
+    }
+    if (HasCycle([&loaded](Position pos) { return loaded.count(pos) != 0; }, new_refs)) {
+        throw CircularDependencyException("circular dependency");
+    }
+    // цикл может пройти и через другие листы книги
+    const auto changed_links = [&](Position pos, Workbook::Links& links) {
+        if (loaded.count(pos) == 0) {
+            return false;
+        }
+        auto refs = new_refs.find(pos);
+        if (refs != new_refs.end()) {
+            links.cells = refs->second;
+        }
+        auto linked_refs = sheet_refs.find(pos);
+        if (linked_refs != sheet_refs.end()) {
+            links.sheets = linked_refs->second;
+        }
+        return true;
+    };
+    std::vector<Position> starts;
+    for (const auto& [pos, refs] : sheet_refs) {
+        starts.push_back(pos);
+    }
+    if (!name_.empty() && workbook_->HasCycle(*this, changed_links, starts)) {
+        throw CircularDependencyException("circular dependency");
+    }
+    const auto linked_begin = std::stable_partition(formulas.begin(), formulas.end(), [](const auto& item) {
+        return item.second->GetSheetReferences().empty();
+    });
+    std::vector<std::pair<Position, std::unique_ptr<FormulaInterface>>> linked(
+        std::make_move_iterator(linked_begin), std::make_move_iterator(formulas.end()));
+    formulas.erase(linked_begin, formulas.end());
+
+    CancelRecalc();
+    ++revision_;
+    ++layout_version_;
+    // ячейка в позиции pos, новая или прежняя; was_number - была ли прежняя числом
+    const auto get_cell = [this](Position pos, bool& was_number) -> Cell* {
+        auto cell = cells_.find(pos);
+        double number;
+        was_number = cell != cells_.end() && IsNumberCell(cell->second.get(), number);
+        if (cell != cells_.end()) {
+            return static_cast<Cell*>(cell->second.get());
+        }
+        auto& new_cell = cells_[pos];
+        new_cell = std::make_unique<Cell>("", pos, *this);
+        cleared_at_.erase(pos);
+        AddToIndex(pos);
+        return static_cast<Cell*>(new_cell.get());
+    };
+    for (auto& [pos, text] : texts) {
+        bool was_number;
+        get_cell(pos, was_number)->Set(std::move(text));
+        UpdateNumericStore(pos, was_number);
+    }
+    for (auto& [pos, formula] : formulas) {
+        bool was_number;
+        auto* cell = get_cell(pos, was_number);
+        cell->ClearRefs();
+        cell->ReplaceFormula(std::move(formula));
+        UpdateNumericStore(pos, was_number);
+    }
+    auto& dependents = dependents_.Write();
+    for (const auto& [pos, formula] : formulas) {
+        for (const auto& ref : new_refs.at(pos)) {
+            dependents[ref].insert(pos);
+        }
+    }
+
+    for (const auto& pos : loaded) {
+        InvalidateDependents(pos);
+    }
+    if (recalc_mode_ == RecalcMode::Eager) {
+        NotifyBulkChange({});
+    }
+    for (auto& [pos, formula] : linked) {
+        DoSetCell(pos, std::move(formula));
+    }
+}
+
+bool Sheet::HasCycle(const std::function<bool(Position)>& replaced, const RefMap& new_refs) const {
+    const auto get_refs = [&](Position pos) -> std::vector<Position> {
+        if (replaced(pos)) {
+            auto refs = new_refs.find(pos);
+            return refs != new_refs.end() ? refs->second : std::vector<Position> {};
+        }
+        auto cell = cells_.find(pos);
+        return cell != cells_.end() ? cell->second->GetReferencedCells() : std::vector<Position> {};
+    };
+    // обход в глубину без рекурсии; 1 - позиция на пути обхода, 2 - обработана
+    CellMap<char> state;
+    state.reserve(new_refs.size());
+    // Обход идёт по строкам. В порядке слотов new_refs (тот же хеш) начало
+    // обхода вместе с ячейками, на которые ссылаются, ложилось бы в узкий
+    // участок state, и вставки становились квадратичными.
+    std::vector<Position> starts;
+    starts.reserve(new_refs.size());
+    for (const auto& [start, refs] : new_refs) {
+        starts.push_back(start);
+    }
+    std::sort(starts.begin(), starts.end());
+    struct Frame {
+        Position pos;
+        std::vector<Position> refs;
+        size_t next = 0;
+    };
+    std::vector<Frame> stack;
+    for (const auto& start : starts) {
+        if (state.find(start) != state.end()) {
+            continue;
+        }
+        state[start] = 1;
+        stack.push_back({start, new_refs.at(start)});
+        while (!stack.empty()) {
+            auto& frame = stack.back();
+            if (frame.next == frame.refs.size()) {
+                state[frame.pos] = 2;
+                stack.pop_back();
+                continue;
+            }
+            const Position next = frame.refs[frame.next++];
+            auto& next_state = state[next];
+            if (next_state != 0) {
+                if (next_state == 1) {
+                    return true;
+                }
+                continue;
+            }
+            next_state = 1;
+            stack.push_back({next, get_refs(next)});
+        }
+    }
+    return false;
+}
+
+void Sheet::NotifyBulkChange(std::vector<Position> changed) {
+    EvaluateAll();
+    for (const auto& [pos, cell] : cells_) {
+        if (static_cast<const Cell&>(*cell).GetChangedAt() == revision_) {
+            changed.push_back(pos);
+        }
+    }
+    std::sort(changed.begin(), changed.end());
+    changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+    last_changes_ = std::move(changed);
+    for (const auto& pos : last_changes_) {
+        LogChange(pos);
+    }
+    for (const auto& [id, callback] : subscribers_) {
+        callback(last_changes_);
+    }
+}
+
+void Sheet::InsertRows(int before, int count) {
+    ShiftLines(true, before, count, true);
+}
+
+void Sheet::DeleteRows(int first, int count) {
+    ShiftLines(true, first, count, false);
+}
+
+void Sheet::InsertCols(int before, int count) {
+    ShiftLines(false, before, count, true);
+}
+
+void Sheet::DeleteCols(int first, int count) {
+    ShiftLines(false, first, count, false);
+}
+
+bool Sheet::HasShiftCycle(bool rows, int first, int delta) const {
+    const LineShift shift {rows, first, delta};
+    // ячейка, которая после сдвига окажется в pos; NONE для вставленной строки (столбца)
+    const auto source_of = [&shift](Position pos) {
+        int& line = shift.rows ? pos.row : pos.col;
+        if (line >= shift.first) {
+            line -= shift.count;
+            if (line < shift.first) {
+                return Position::NONE;
+            }
+        }
+        return pos.IsValid() ? pos : Position::NONE;
+    };
+    const auto changed_links = [&](Position pos, Workbook::Links& links) {
+        const Position source = source_of(pos);
+        auto cell = source.IsValid() ? cells_.find(source) : cells_.end();
+        const auto* formula = cell != cells_.end() ? static_cast<const Cell&>(*cell->second).GetFormula() : nullptr;
+        if (formula != nullptr) {
+            for (const auto& ref : formula->GetReferencedCells()) {
+                const Position new_ref = shift.Map(ref);
+                if (new_ref.IsValid()) {
+                    links.cells.push_back(new_ref);
+                }
+            }
+            links.sheets = formula->GetSheetReferences();
+        }
+        return true;
+    };
+    // ячейки самого листа со ссылками на листы книги, на их новых местах
+    std::vector<Position> linked;
+    for (const auto& [sheet_name, by_pos] : workbook_->dependents_) {
+        for (const auto& [pos, dependents] : by_pos) {
+            for (const auto& dependent : dependents) {
+                if (dependent.sheet == this && shift.Map(dependent.pos).IsValid()) {
+                    linked.push_back(shift.Map(dependent.pos));
+                }
+            }
+        }
+    }
+    return workbook_->HasCycle(*this, changed_links, linked);
+}
+
+void Sheet::ShiftLines(bool rows, int first, int count, bool insert) {
+    const int max_lines = rows ? Position::MAX_ROWS : Position::MAX_COLS;
+    if (first < 0 || first >= max_lines || count < 0) {
+        throw InvalidPositionException("Invalid row or column range");
+    }
+    count = std::min(count, max_lines - first);
+    const int used = rows ? size_.rows : size_.cols;
+    if (insert && used > first && used + count > max_lines) {
+        throw InvalidPositionException("Insertion moves cells beyond the sheet");
+    }
+    if (count == 0) {
+        return;
+    }
+    const LineShift shift {rows, first, insert ? count : -count};
+    if (!name_.empty() && HasShiftCycle(rows, first, shift.count)) {
+        throw CircularDependencyException("circular dependency");
+    }
+    CancelRecalc();
+    ++revision_;
+    const auto map = [&shift](Position pos) {
+        return shift.Map(pos);
+    };
+
+    // ячейки, которые сдвигаются или удаляются
+    std::vector<Position> moved;
+    for (const auto& [line, others] : rows ? *rows_idx_ : *cols_idx_) {
+        if (line < first) {
+            continue;
+        }
+        for (const int other : others) {
+            moved.push_back(rows ? Position {line, other} : Position {other, line});
+        }
+    }
+    // формулы со ссылками в сдвигаемую часть: все они - зависимые сдвигаемых позиций
+    PositionSet rewritten;
+    for (const auto& [pos, dependents] : *dependents_) {
+        if (shift.Affects(pos)) {
+            rewritten.insert(dependents.begin(), dependents.end());
+        }
+    }
+    std::vector<std::pair<Position, std::unique_ptr<FormulaInterface>>> formulas;
+    for (const auto& pos : rewritten) {
+        const Position new_pos = shift.Map(pos);
+        if (new_pos.IsValid()) {
+            const auto* formula = static_cast<const Cell&>(*cells_.at(pos)).GetFormula();
+            formulas.emplace_back(new_pos, formula->MapCells(map));
+        }
+    }
+
+    // рёбра графа затронутых ячеек снимаются и после сдвига ставятся заново
+    PositionSet touched(moved.begin(), moved.end());
+    touched.insert(rewritten.begin(), rewritten.end());
+    auto& dependents = dependents_.Write();
+    for (const auto& pos : touched) {
+        const auto& cell = static_cast<const Cell&>(*cells_.at(pos));
+        for (const auto& ref : cell.GetReferencedCells()) {
+            auto it = dependents.find(ref);
+            it->second.erase(pos);
+            if (it->second.empty()) {
+                dependents.erase(it);
+            }
+        }
+        if (const auto* formula = cell.GetFormula()) {
+            for (const auto& ref : formula->GetSheetReferences()) {
+                RemoveSheetDependency(pos, ref);
+            }
+        }
+    }
+
+    ShiftNumericStore(rows, first, count, insert);
+    std::vector<std::pair<Position, std::unique_ptr<CellInterface>>> extracted;
+    auto& rows_idx = rows_idx_.Write();
+    auto& cols_idx = cols_idx_.Write();
+    for (const auto& pos : moved) {
+        auto cell = cells_.find(pos);
+        extracted.emplace_back(shift.Map(pos), std::move(cell->second));
+        cells_.erase(cell);
+        rows_idx[pos.row].erase(pos.col);
+        cols_idx[pos.col].erase(pos.row);
+    }
+    // удалённые ячейки уничтожаются вместе с extracted
+    for (auto& [pos, cell] : extracted) {
+        if (pos.IsValid()) {
+            static_cast<Cell&>(*cell).SetPosition(pos);
+            cells_[pos] = std::move(cell);
+            AddToIndex(pos);
+        }
+    }
+    ++layout_version_;
+    UpdateSize();
+    for (auto& [pos, formula] : formulas) {
+        static_cast<Cell&>(*cells_.at(pos)).ReplaceFormula(std::move(formula));
+    }
+    for (const auto& old_pos : touched) {
+        const Position pos = shift.Map(old_pos);
+        if (!pos.IsValid()) {
+            continue;
+        }
+        const auto& cell = static_cast<const Cell&>(*cells_.at(pos));
+        for (const auto& ref : cell.GetReferencedCells()) {
+            dependents[ref].insert(pos);
+        }
+        if (const auto* formula = cell.GetFormula()) {
+            for (const auto& ref : formula->GetSheetReferences()) {
+                AddSheetDependency(pos, ref);
+            }
+        }
+    }
+
+    std::vector<std::pair<Position, uint64_t>> cleared;
+    for (const auto& [pos, revision] : cleared_at_) {
+        if (shift.Affects(pos)) {
+            cleared.emplace_back(pos, revision);
+        }
+    }
+    for (const auto& [pos, revision] : cleared) {
+        cleared_at_.erase(pos);
+    }
+    for (const auto& [pos, revision] : cleared) {
+        const Position new_pos = shift.Map(pos);
+        if (new_pos.IsValid() && GetDependents(new_pos) != nullptr) {
+            cleared_at_[new_pos] = revision;
+        }
+    }
+
+    // значения сдвинутых ячеек не меняются, пересчитываются только
+    // переписанные формулы (и зависящие от них, если их значение изменится)
+    for (const auto& [pos, formula] : formulas) {
+        InvalidateDependents(pos);
+    }
+    // ссылки других листов книги не переписываются и читают новое содержимое прежних адресов
+    for (const auto& pos : moved) {
+        LogChange(pos, true);
+        InvalidateOtherSheets(pos);
+        const Position new_pos = shift.Map(pos);
+        if (new_pos.IsValid()) {
+            LogChange(new_pos, true);
+            InvalidateOtherSheets(new_pos);
+        }
+    }
+
+    if (recalc_mode_ == RecalcMode::Eager) {
+        std::vector<Position> changed;
+        for (const auto& pos : moved) {
+            changed.push_back(pos);
+            const Position new_pos = shift.Map(pos);
+            if (new_pos.IsValid()) {
+                changed.push_back(new_pos);
+            }
+        }
+        NotifyBulkChange(std::move(changed));
+    }
+}
+
+// Строки сдвигаются внутри плотных столбцов, столбцы переезжают целиком.
+void Sheet::ShiftNumericStore(bool rows, int first, int count, bool insert) {
+    if (numeric_counts_.empty()) {
+        return;
+    }
+    if (rows) {
+        if (!insert) {
+            for (const auto& [line, cols] : *rows_idx_) {
+                if (line < first || line >= first + count) {
+                    continue;
+                }
+                for (const int col : cols) {
+                    double number;
+                    if (IsNumberCell(cells_.at({line, col}).get(), number)) {
+                        --numeric_counts_[col];
+                    }
+                }
+            }
+        }
+        auto& numeric_cols = numeric_cols_.Write();
+        for (auto column = numeric_cols.begin(); column != numeric_cols.end();) {
+            if (numeric_counts_[column->first] < NUMERIC_DEMOTE_COUNT) {
+                column = numeric_cols.erase(column);
+                continue;
+            }
+            if (insert) {
+                column->second.InsertRows(first, count);
+            } else {
+                column->second.EraseRows(first, count);
+            }
+            ++column;
+        }
+        for (auto it = numeric_counts_.begin(); it != numeric_counts_.end();) {
+            it = it->second == 0 ? numeric_counts_.erase(it) : std::next(it);
+        }
+        return;
+    }
+
+    const LineShift shift {false, first, insert ? count : -count};
+    const auto shift_keys = [&shift](auto& map) {
+        std::vector<std::pair<int, typename std::decay_t<decltype(map)>::mapped_type>> entries;
+        for (auto it = map.begin(); it != map.end();) {
+            if (it->first >= shift.first) {
+                entries.emplace_back(it->first, std::move(it->second));
+                it = map.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        for (auto& [col, value] : entries) {
+            const int new_col = shift.Map({0, col}).col;
+            if (new_col >= 0) {
+                map.emplace(new_col, std::move(value));
+            }
+        }
+    };
+    shift_keys(numeric_counts_);
+    shift_keys(numeric_cols_.Write());
+}
+
+bool Sheet::TryGetNumber(Position pos, double& value) const {
+    auto column = numeric_cols_->find(pos.col);
+    return column != numeric_cols_->end() && column->second.Get(pos.row, value);
+}
+
+const NumericColumn* Sheet::GetNumericColumn(int col) const {
+    auto column = numeric_cols_->find(col);
+    return column != numeric_cols_->end() ? &column->second : nullptr;
+}
+
+void Sheet::UpdateNumericStore(Position pos, bool was_number) {
+    double number = 0.;
+    auto cell = cells_.find(pos);
+    const bool is_number = cell != cells_.end() && IsNumberCell(cell->second.get(), number);
+    if (!is_number && !was_number) {
+        return;
+    }
+    auto& count = numeric_counts_[pos.col];
+    count += static_cast<int>(is_number) - static_cast<int>(was_number);
+
+    auto& numeric_cols = numeric_cols_.Write();
+    auto column = numeric_cols.find(pos.col);
+    if (column != numeric_cols.end()) {
+        if (count < NUMERIC_DEMOTE_COUNT) {
+            numeric_cols.erase(column);
+        } else if (is_number) {
+            column->second.Set(pos.row, number);
+        } else {
+            column->second.Reset(pos.row);
+        }
+    } else if (count >= NUMERIC_PROMOTE_COUNT) {
+        PromoteColumn(pos.col);
+    }
+    if (count == 0) {
+        numeric_counts_.erase(pos.col);
+    }
+}
+
+void Sheet::ReleaseNumbers(int col, const std::vector<int>& rows) {
+    auto count = numeric_counts_.find(col);
+    count->second -= static_cast<int>(rows.size());
+    const int left = count->second;
+    if (left == 0) {
+        numeric_counts_.erase(count);
+    }
+    if (numeric_cols_->count(col) == 0) {
+        return;
+    }
+    auto& numeric_cols = numeric_cols_.Write();
+    auto column = numeric_cols.find(col);
+    if (left < NUMERIC_DEMOTE_COUNT) {
+        numeric_cols.erase(column);
+        return;
+    }
+    for (const int row : rows) {
+        column->second.Reset(row);
+    }
+}
+
+void Sheet::PromoteColumn(int col) {
+    auto& column = numeric_cols_.Write()[col];
+    for (const int row : cols_idx_->at(col)) {
+        double number;
+        if (IsNumberCell(cells_.at({row, col}).get(), number)) {
+            column.Set(row, number);
+        }
+    }
+}
+
+std::optional<CellInterface::Value> Sheet::GetEagerValue(Position pos) const {
+    if (recalc_mode_ != RecalcMode::Eager) {
+        return std::nullopt;
+    }
+    auto cell = cells_.find(pos);
+    if (cell == cells_.end()) {
+        return std::nullopt;
+    }
+    return cell->second->GetValue();
+}
+
+void Sheet::OnCellChanged(Position pos, const std::optional<CellInterface::Value>& old_value) {
+    if (recalc_mode_ == RecalcMode::Lazy) {
+        InvalidateDependents(pos);
+        return;
+    }
+
+    last_changes_.clear();
+    if (GetEagerValue(pos) == old_value) {
+        return;
+    }
+    PositionSet changed {pos};
+    for (const auto& affected : CollectAffected(pos)) {
+        auto& cell = static_cast<Cell&>(*cells_.at(affected));
+        const auto refs = cell.GetReferencedCells();
+        const bool inputs_changed = std::any_of(refs.begin(), refs.end(), [&changed](const Position& ref) {
+            return changed.count(ref) > 0;
+        });
+        if (inputs_changed && cell.Recalculate()) {
+            changed.insert(affected);
+        }
+    }
+
+    last_changes_.assign(changed.begin(), changed.end());
+    std::sort(last_changes_.begin(), last_changes_.end());
+    for (const auto& changed_pos : last_changes_) {
+        LogChange(changed_pos);
+        InvalidateOtherSheets(changed_pos);
+    }
+    for (const auto& [id, callback] : subscribers_) {
+        callback(last_changes_);
+    }
+}
+
+uint64_t Sheet::GetRevision() const {
+    return revision_;
+}
+
+uint64_t Sheet::GetLayoutVersion() const {
+    return layout_version_;
+}
+
+const CellOperand* Sheet::FindOperand(Position pos) const {
+    // пустая ячейка - всегда актуальный 0
+    static const CellOperand EMPTY_OPERAND{true};
+    const auto cell = cells_.find(pos);
+    if (cell == cells_.end()) {
+        return &EMPTY_OPERAND;
+    }
+    return &static_cast<const Cell&>(*cell->second).GetOperand();
+}
+
+uint64_t Sheet::GetChangedAt(Position pos) const {
+    auto cell = cells_.find(pos);
+    if (cell != cells_.end()) {
+        const auto& cell_ref = static_cast<const Cell&>(*cell->second);
+        cell_ref.GetValue();
+        return cell_ref.GetChangedAt();
+    }
+    auto cleared = cleared_at_.find(pos);
+    return cleared != cleared_at_.end() ? cleared->second : 0;
+}
+
+void Sheet::InvalidateDependents(Position pos) {
+    LogChange(pos);
+    InvalidateOtherSheets(pos);
+    const auto* dependents = GetDependents(pos);
+    PROFILE_INVALIDATION(*this, pos, dependents != nullptr ? dependents->size() : 0);
+    if (dependents == nullptr) {
+        return;
+    }
+    for (const auto& dependent : *dependents) {
+        auto* cell = GetCell(dependent);
+        if (cell != nullptr) {
+            cell->Invalidate();
+        }
+    }
+}
+
+void Sheet::LogChange(Position pos, bool moved) {
+    change_log_.push_back({revision_, pos, moved});
+    if (change_log_.size() >= compact_log_at_) {
+        CompactChangeLog();
+    }
+}
+
+void Sheet::CompactChangeLog() {
+    // от записей позиции нужна последняя: выгрузка берёт позиции с записью
+    // после since; признак сдвига объединяется, лишняя выгрузка безвредна
+    // номер записи в compacted плюс один
+    CellMap<size_t> last;
+    std::vector<ChangeRecord> compacted;
+    for (auto it = change_log_.rbegin(); it != change_log_.rend(); ++it) {
+        auto& slot = last[it->pos];
+        if (slot == 0) {
+            compacted.push_back(*it);
+            slot = compacted.size();
+        } else {
+            compacted[slot - 1].moved |= it->moved;
+        }
+    }
+    std::reverse(compacted.begin(), compacted.end());
+    change_log_ = std::move(compacted);
+    compact_log_at_ = std::max<size_t>(2 * change_log_.size(), 1024);
+}
+
+SheetMemoryStats Sheet::GetMemoryStats() const {
+    // кеши значений ячеек меняет и фоновый пересчёт
+    std::lock_guard guard(eval_mutex_);
+    SheetMemoryStats stats;
+    stats.cells = GetCellMapMemory(cells_);
+    for (const auto& [pos, cell] : cells_) {
+        static_cast<const Cell&>(*cell).CountMemory(stats);
+    }
+    stats.values += GetHashMemory(*numeric_cols_) + GetHashMemory(numeric_counts_);
+    for (const auto& [col, column] : *numeric_cols_) {
+        stats.values += column.GetMemoryUsage();
+    }
+    stats.dependencies = GetIndexMemory(*dependents_) + GetCellMapMemory(cleared_at_);
+    stats.indexes = GetIndexMemory(*rows_idx_) + GetIndexMemory(*cols_idx_);
+    stats.change_log = change_log_.capacity() * sizeof(ChangeRecord) + last_changes_.capacity() * sizeof(Position);
+    return stats;
+}
+
+void Sheet::ShrinkToFit() {
+    CancelRecalc();
+    cells_.shrink_to_fit();
+    cleared_at_.shrink_to_fit();
+    // очистка ячеек оставляет в индексах пустые строки и столбцы
+    ShrinkIndex(rows_idx_.Write());
+    ShrinkIndex(cols_idx_.Write());
+    ShrinkIndex(dependents_.Write());
+    auto& numeric_cols = numeric_cols_.Write();
+    for (auto& [col, column] : numeric_cols) {
+        column.ShrinkToFit();
+    }
+    numeric_cols.rehash(0);
+    numeric_counts_.rehash(0);
+    CompactChangeLog();
+    change_log_.shrink_to_fit();
+    last_changes_.shrink_to_fit();
+}
+
+ValueChanges Sheet::GetValueChanges(uint64_t since) const {
+    std::lock_guard guard(eval_mutex_);
+    ValueChanges result;
+    result.revision = revision_;
+    const auto first = std::upper_bound(change_log_.begin(), change_log_.end(), since,
+                                        [](uint64_t revision, const ChangeRecord& record) {
+                                            return revision < record.revision;
+                                        });
+    PositionSet candidates;
+    PositionSet moved;
+    for (auto it = first; it != change_log_.end(); ++it) {
+        candidates.insert(it->pos);
+        if (it->moved) {
+            moved.insert(it->pos);
+        }
+    }
+
+    FormulaColumns formulas;
+    for (const auto& pos : candidates) {
+        auto cell = cells_.find(pos);
+        if (cell == cells_.end()) {
+            continue;
+        }
+        const auto& cell_ref = static_cast<const Cell&>(*cell->second);
+        if (cell_ref.IsUpToDate()) {
+            continue;
+        }
+        if (const auto* formula = cell_ref.GetFormula()) {
+            formulas[pos.col].push_back({pos.row, &cell_ref, &formula->GetProgram()});
+        } else {
+            cell_ref.GetValue();
+        }
+    }
+    EvaluateFormulas(formulas);
+
+    // сброшенная ячейка, получившая прежнее значение, в выгрузку не попадает
+    for (const auto& pos : candidates) {
+        auto cell = cells_.find(pos);
+        if (cell == cells_.end()) {
+            result.values.emplace_back(pos, std::string());
+            continue;
+        }
+        const auto& cell_ref = static_cast<const Cell&>(*cell->second);
+        if (cell_ref.GetChangedAt() > since || moved.count(pos) > 0) {
+            result.values.emplace_back(pos, cell_ref.GetValue());
+        }
+    }
+    std::sort(result.values.begin(), result.values.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.first < rhs.first;
+    });
+    return result;
+}
+
+void Sheet::InvalidateFromSheet(Position pos) {
+    CancelRecalc();
+    // значение входа изменилось на правке другого листа; собственный номер правки
+    // растёт, чтобы зависящие ячейки этого листа не сочли свои входы прежними
+    ++revision_;
+    if (auto* cell = GetCell(pos)) {
+        cell->Invalidate();
+    }
+}
+
+void Sheet::InvalidateOtherSheets(Position pos) {
+    if (!name_.empty()) {
+        workbook_->InvalidateDependents(name_, pos);
+    }
+}
+
+// Ячейки, транзитивно зависящие от pos (без неё самой), в топологическом порядке.
+std::vector<Position> Sheet::CollectAffected(Position pos) const {
+    std::vector<Position> order;
+    PositionSet visited;
+    // обход в глубину без рекурсии: (позиция, все ли её зависимые уже обработаны).
+    // Позиция помечается при раскрытии, а не при добавлении в стек: иначе она
+    // может попасть в порядок раньше зависимой, до которой стек дошёл позже.
+    std::vector<std::pair<Position, bool>> stack {{pos, false}};
+    while (!stack.empty()) {
+        auto [current, expanded] = stack.back();
+        stack.pop_back();
+        if (expanded) {
+            order.push_back(current);
+            continue;
+        }
+        if (!visited.insert(current)) {
+            continue;
+        }
+        stack.push_back({current, true});
+        if (const auto* dependents = GetDependents(current)) {
+            for (const auto& dependent : *dependents) {
+                if (visited.count(dependent) == 0) {
+                    stack.push_back({dependent, false});
+                }
+            }
+        }
+    }
+    order.pop_back();  // сама pos
+    std::reverse(order.begin(), order.end());
+    return order;
+}
+
+void Sheet::SetRecalcMode(RecalcMode mode) {
+    CancelRecalc();
+    recalc_mode_ = mode;
+    last_changes_.clear();
+    if (mode == RecalcMode::Eager) {
+        EvaluateAll();
+    }
+}
+
+RecalcMode Sheet::GetRecalcMode() const {
+    return recalc_mode_;
+}
+
+void Sheet::SetNumberFormat(NumberFormat format) {
+    number_format_ = format;
+}
+
+NumberFormat Sheet::GetNumberFormat() const {
+    return number_format_;
+}
+
+size_t Sheet::Subscribe(ChangeCallback callback) {
+    subscribers_[next_subscriber_id_] = std::move(callback);
+    return next_subscriber_id_++;
+}
+
+void Sheet::Unsubscribe(size_t id) {
+    subscribers_.erase(id);
+}
+
+const std::vector<Position>& Sheet::GetLastChanges() const {
+    return last_changes_;
+}
+
+void Sheet::AddDependency(Position from, Position to) {
+    dependents_.Write()[to].insert(from);
+}
+
+void Sheet::AddSheetDependency(Position from, const SheetPosition& to) {
+    if (!name_.empty()) {
+        workbook_->AddDependency(*this, from, to);
+    }
+}
+
+void Sheet::RemoveSheetDependency(Position from, const SheetPosition& to) {
+    if (!name_.empty()) {
+        workbook_->RemoveDependency(*this, from, to);
+    }
+}
+
+SheetInterface* Sheet::FindSheet(std::string_view name) const {
+    return workbook_ != nullptr ? workbook_->GetSheet(name) : nullptr;
+}
+
+void Sheet::RemoveDependency(Position from, Position to) {
+    if (dependents_->count(to) == 0) {
+        return;
+    }
+    auto& dependents = dependents_.Write();
+    auto it = dependents.find(to);
+    it->second.erase(from);
+    if (it->second.empty()) {
+        dependents.erase(it);
+        cleared_at_.erase(to);
+    }
+}
+
+const Sheet::PositionSet* Sheet::GetDependents(Position pos) const {
+    auto it = dependents_->find(pos);
+    return it != dependents_->end() ? &it->second : nullptr;
+}
+
+void Sheet::UpdateSize() {
+    auto& rows_idx = rows_idx_.Write();
+    while (size_.rows > 0 && rows_idx[size_.rows - 1].empty()) {
+        rows_idx.erase(size_.rows - 1);
+        --size_.rows;
+    }
+    auto& cols_idx = cols_idx_.Write();
+    while (size_.cols > 0 && cols_idx[size_.cols - 1].empty()) {
+        cols_idx.erase(size_.cols - 1);
+        --size_.cols;
+    }
+}
+
+bool Sheet::CheckPosition(const Position& pos) const {
+    return pos.IsValid();
+}
+
+Size Sheet::GetPrintableSize() const {
+    return size_;
+}
+
+template <typename Func>
+void Sheet::Print(std::ostream& output, Position from, Size size, Func pred) const {
+    for (int row_id = from.row; row_id < from.row + size.rows; ++row_id) {
+        bool first_col = true;
+        for (int col_id = from.col; col_id < from.col + size.cols; ++col_id) {
+            const auto cell = cells_.find(Position {row_id, col_id});
+            if (first_col) {
+                first_col = false;
+            } else {
+                output << '\t';
+            }
+            if (cell != cells_.end()) {
+                pred(output, *cell->second);
+            }
+        }
+        output << '\n';
+    }
+}
+
+void Sheet::EvaluateAll() const {
+    std::lock_guard guard(eval_mutex_);
+    // Слоты cells_ перемешаны хешем, а ячейки обычно создаются по строкам:
+    // ячейки раскладываются по строкам подсчётом (без разыменования), чтобы
+    // дальше читать их в порядке создания, а не вразброс.
+    std::vector<int> row_begin(size_.rows + 1, 0);
+    for (const auto& [pos, cell] : cells_) {
+        ++row_begin[pos.row + 1];
+    }
+    std::partial_sum(row_begin.begin(), row_begin.end(), row_begin.begin());
+    std::vector<std::pair<Position, const Cell*>> ordered(cells_.size());
+    for (const auto& [pos, cell] : cells_) {
+        ordered[row_begin[pos.row]++] = {pos, static_cast<const Cell*>(cell.get())};
+    }
+
+    // неактуальные формулы по столбцам
+    FormulaColumns formulas;
+    for (const auto& [pos, cell] : ordered) {
+        const auto& cell_ref = *cell;
+        if (cell_ref.IsUpToDate()) {
+            continue;
+        }
+        if (const auto* formula = cell_ref.GetFormula()) {
+            formulas[pos.col].push_back({pos.row, &cell_ref, &formula->GetProgram()});
+        } else {
+            // текст ни от чего не зависит, вычисляем, пока ячейка в кеше
+            cell_ref.GetValue();
+        }
+    }
+    EvaluateFormulas(formulas);
+}
+
+void Sheet::EvaluateRange(const CellRange& range) const {
+    if (!range.IsValid()) {
+        throw InvalidPositionException("Invalid cell range");
+    }
+    std::lock_guard guard(eval_mutex_);
+    FormulaColumns formulas;
+    for (const auto& pos : GetCellsIn(range)) {
+        const auto& cell = static_cast<const Cell&>(*cells_.at(pos));
+        if (cell.IsUpToDate()) {
+            continue;
+        }
+        if (const auto* formula = cell.GetFormula()) {
+            formulas[pos.col].push_back({pos.row, &cell, &formula->GetProgram()});
+        } else {
+            cell.GetValue();
+        }
+    }
+    // входы вне диапазона вычисляются по мере надобности при чтении формулами
+    EvaluateFormulas(formulas);
+}
+
+void Sheet::EvaluateFormulas(FormulaColumns& formulas) const {
+    for (auto& [col, column] : formulas) {
+        // EvaluateAll и EvaluateRange собирают строки уже по возрастанию
+        const auto by_row = [](const FormulaRow& lhs, const FormulaRow& rhs) {
+            return lhs.row < rhs.row;
+        };
+        if (!std::is_sorted(column.begin(), column.end(), by_row)) {
+            std::sort(column.begin(), column.end(), by_row);
+        }
+        size_t begin = 0;
+        while (begin < column.size()) {
+            const Position first {column[begin].row, col};
+            const auto& code = *column[begin].program;
+            size_t end = begin + 1;
+            while (end < column.size() && column[end].row == column[end - 1].row + 1
+                   && IsSameRelativeProgram(code, first, *column[end].program, {column[end].row, col})) {
+                ++end;
+            }
+            if (end - begin >= MIN_BATCH_ROWS && !code.empty() && !ReferencesColumn(code, col)) {
+                EvaluateRun(col, column.data() + begin, static_cast<int>(end - begin));
+            }
+            begin = end;
+        }
+    }
+    // формулы вне серий и строки, которые серия не смогла вычислить
+    for (const auto& [col, column] : formulas) {
+        for (const auto& formula : column) {
+            if (!formula.cell->IsUpToDate()) {
+                formula.cell->GetValue();
+            }
+        }
+    }
+}
+
+void Sheet::EvaluateRun(int col, const FormulaRow* run, int rows) const {
+    const auto& code = *run[0].program;
+    // строки, где вход - не число, вычисляются обычным путём, чтобы сохранить
+    // порядок, в котором формула находит ошибки
+    std::vector<char> fallback(rows, 0);
+    std::vector<std::vector<double>> inputs;
+    for (const auto& instruction : code) {
+        if (instruction.op != FormulaInstruction::Op::Cell) {
+            continue;
+        }
+        auto& values = inputs.emplace_back(rows);
+        const int input_col = instruction.cell.col;
+        const auto* numeric = GetNumericColumn(input_col);
+        for (int i = 0; i < rows; ++i) {
+            const Position pos {instruction.cell.row + i, input_col};
+            if (numeric != nullptr && numeric->Get(pos.row, values[i])) {
+                continue;
+            }
+            if (!ReadNumber(pos, values[i])) {
+                fallback[i] = 1;
+            }
+        }
+    }
+
+    std::vector<const double*> input_data;
+    for (const auto& values : inputs) {
+        input_data.push_back(values.data());
+    }
+    std::vector<double> result(rows);
+    std::unique_ptr<bool[]> arithm_error(new bool[rows]);
+    EvaluateBatch(code, input_data, rows, result.data(), arithm_error.get());
+
+    for (int i = 0; i < rows; ++i) {
+        const auto& cell = *run[i].cell;
+        // ячейка могла вычислиться раньше как вход другой формулы
+        if (fallback[i] || cell.IsUpToDate()) {
+            continue;
+        }
+        if (arithm_error[i]) {
+            cell.StoreValue(FormulaError(FormulaError::Category::Arithmetic));
+        } else {
+            cell.StoreValue(result[i]);
+        }
+    }
+}
+
+std::shared_ptr<RecalcTask> Sheet::RecalculateAsync() {
+    CancelRecalc();
+    std::vector<const Cell*> dirty;
+    for (const auto& [pos, cell] : cells_) {
+        const auto& cell_ref = static_cast<const Cell&>(*cell);
+        if (!cell_ref.IsUpToDate()) {
+            dirty.push_back(&cell_ref);
+        }
+    }
+    auto task = std::make_shared<RecalcTask>();
+    task->total_ = dirty.size();
+    // задача живёт в recalc_task_, пока поток не завершится (см. CancelRecalc)
+    task->result_ = std::async(std::launch::async, [this, task = task.get(), dirty = std::move(dirty)] {
+        for (const auto* cell : dirty) {
+            if (task->IsCancelled()) {
+                return false;
+            }
+            {
+                std::lock_guard guard(eval_mutex_);
+                cell->GetValue();
+            }
+            ++task->done_;
+        }
+        return true;
+    }).share();
+    recalc_task_ = task;
+    return task;
+}
+
+void Sheet::CancelRecalc() {
+    if (recalc_task_ != nullptr) {
+        recalc_task_->Cancel();
+        recalc_task_->result_.wait();
+        recalc_task_.reset();
+    }
+}
+
+std::optional<CellInterface::Value> Sheet::TryGetValue(Position pos) const {
+    if (!CheckPosition(pos)) {
+        throw InvalidPositionException("Invalid cell position");
+    }
+    std::lock_guard guard(eval_mutex_);
+    auto cell = cells_.find(pos);
+    if (cell == cells_.end()) {
+        return CellInterface::Value {};
+    }
+    const auto& cell_ref = static_cast<const Cell&>(*cell->second);
+    if (!cell_ref.IsUpToDate()) {
+        return std::nullopt;
+    }
+    return cell_ref.GetValue();
+}
+
+// Значение ячейки так, как его видит формула: пустая ячейка - 0, текст -
+// число, если он целиком число. false для прочего текста и ошибок.
+bool Sheet::ReadNumber(Position pos, double& value) const {
+    auto cell = cells_.find(pos);
+    if (cell == cells_.end()) {
+        value = 0.;
+        return true;
+    }
+    // операнд уже хранит число, разобранное из текста: повторно текст не читается
+    const auto& operand = static_cast<const Cell&>(*cell->second).GetOperand();
+    if (!operand.ready) {
+        cell->second->GetValue();
+    }
+    if (operand.is_error) {
+        return false;
+    }
+    value = operand.number;
+    return true;
+}
+
+void Sheet::PrintValues(std::ostream& output) const {
+    EvaluateAll();
+    Print(output, {0, 0}, size_, [this, &output](std::ostream& os, const CellInterface& cell) {
+        std::visit(ValueVisitor { output, number_format_ }, cell.GetValue());
+    });
+}
+
+void Sheet::PrintTexts(std::ostream& output) const {
+    Print(output, {0, 0}, size_, [](std::ostream& os, const CellInterface& cell) {
+        os << cell.GetText();
+    });
+
+}
+
+void Sheet::PrintValues(std::ostream& output, const CellRange& range) const {
+    EvaluateRange(range);
+    Print(output, range.from, range.GetSize(), [this, &output](std::ostream& os, const CellInterface& cell) {
+        std::visit(ValueVisitor { output, number_format_ }, cell.GetValue());
+    });
+}
+
+void Sheet::PrintTexts(std::ostream& output, const CellRange& range) const {
+    if (!range.IsValid()) {
+        throw InvalidPositionException("Invalid cell range");
+    }
+    Print(output, range.from, range.GetSize(), [](std::ostream& os, const CellInterface& cell) {
+        os << cell.GetText();
+    });
+}
+
+void RecalcTask::Cancel() {
+    cancelled_ = true;
+}
+
+bool RecalcTask::IsCancelled() const {
+    return cancelled_;
+}
+
+size_t RecalcTask::GetDone() const {
+    return done_;
+}
+
+size_t RecalcTask::GetTotal() const {
+    return total_;
+}
+
+std::shared_future<bool> RecalcTask::GetFuture() const {
+    return result_;
+}
+
+bool RecalcTask::Wait() const {
+    return result_.get();
+}
+
+std::unique_ptr<SheetInterface> CreateSheet() {
+    return std::make_unique<Sheet>();
+}
@@ -1,52 +1,348 @@
-#pragma once
-
-#include "cell.h"
-#include "common.h"
-
-#include <functional>
-#include <iostream>
-
-class Sheet : public SheetInterface {
-public:
-    Sheet();
-    ~Sheet();
-
-    void SetCell(Position pos, std::string text) override;
-
-    const CellInterface* GetCell(Position pos) const override;
-    CellInterface* GetCell(Position pos) override;
-
-    void ClearCell(Position pos) override;
-
-    Size GetPrintableSize() const override;
-
-    void PrintValues(std::ostream& output) const override;
-    void PrintTexts(std::ostream& output) const override;
-
-
-private:
-    struct ValueVisitor {
-        std::ostream& out;
-        void operator()(const std::string& val) {
-            out << val;
-        }
-        void operator()(const double& val) {
-            out << val;
-        }
-        void operator()(const FormulaError& val) {
-            out << val;
-        }
-    };
-
-    void UpdateSize();
-    bool CheckPosition(const Position& pos) const;
-    
-    template <typename Func>
-    void Print(std::ostream& output, Func pred) const;
-    
-    std::unordered_map<int, std::unordered_set<int>> cols_idx_;
-    std::unordered_map<int, std::unordered_set<int>> rows_idx_;
-    Size size_ {0, 0};
-
-    std::unordered_map<Position, std::unique_ptr<CellInterface>, PositionHash> cells_;
-};
+#pragma once
+
+#include "cell.h"
+#include "cell_map.h"
+#include "common.h"
+#include "copy_on_write.h"
+#include "numeric_column.h"
+
+#include <atomic>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class Workbook;
+
+enum class RecalcMode {
+    // значения вычисляются при чтении, правка только помечает зависимые ячейки
+    Lazy,
+    // после правки затронутые ячейки сразу пересчитываются в топологическом порядке
+    Eager,
+};
+
+// Фоновый пересчёт таблицы, запущенный Sheet::RecalculateAsync.
+class RecalcTask {
+public:
+    void Cancel();
+    bool IsCancelled() const;
+    // Сколько из неактуальных на момент запуска ячеек уже вычислено.
+    size_t GetDone() const;
+    size_t GetTotal() const;
+
+    // true, если вычислены все ячейки, false, если пересчёт отменён.
+    std::shared_future<bool> GetFuture() const;
+    bool Wait() const;
+
+private:
+    friend class Sheet;
+
+    std::atomic<bool> cancelled_ {false};
+    std::atomic<size_t> done_ {0};
+    size_t total_ = 0;
+    std::shared_future<bool> result_;
+};
+
+// Значения, изменившиеся после правки since (Sheet::GetValueChanges).
+struct ValueChanges {
+    // номер правки, на которой сделана выгрузка: since для следующего вызова
+    uint64_t revision = 0;
+    // по возрастанию позиций; очищенная ячейка - пустая строка
+    std::vector<std::pair<Position, CellInterface::Value>> values;
+};
+
+// Память таблицы в байтах (Sheet::GetMemoryStats). Оценка по размерам
+// и ёмкостям структур, без служебных данных распределителя памяти.
+struct SheetMemoryStats {
+    // хеш-таблица ячеек и объекты Cell
+    size_t cells = 0;
+    // содержимое текстовых и пустых ячеек
+    size_t texts = 0;
+    // содержимое ячеек с формулами: текст, дерево разбора, программа, ссылки
+    size_t formulas = 0;
+    // строковые значения в кешах ячеек и числовые столбцы
+    size_t values = 0;
+    // граф зависимостей и отметки очищенных ячеек, на которые есть ссылки
+    size_t dependencies = 0;
+    // индексы строк и столбцов
+    size_t indexes = 0;
+    // журнал изменений для GetValueChanges и последние изменения режима Eager
+    size_t change_log = 0;
+
+    size_t GetTotal() const {
+        return cells + texts + formulas + values + dependencies + indexes + change_log;
+    }
+};
+
+class Sheet : public SheetInterface {
+public:
+    Sheet();
+    ~Sheet();
+
+    // Независимая копия таблицы для расчёта сценариев. Ячейки копии разделяют
+    // с исходной неизменяемое содержимое (текст и разобранные формулы), формулы
+    // заново не разбираются; вычисленные значения копируются, дальше у каждой
+    // таблицы свой кеш. Копии можно вычислять параллельно в разных потоках.
+    // Подписчики и фоновый пересчёт не копируются. Копия листа книги читает
+    // другие листы книги, но в книгу не входит: правки других листов её кеш
+    // не сбрасывают, и она не должна переживать книгу.
+    std::unique_ptr<Sheet> Clone() const;
+
+    void SetCell(Position pos, std::string text) override;
+    // Записывает в ячейку заранее разобранную формулу (используется при импорте).
+    void SetCell(Position pos, std::unique_ptr<FormulaInterface> formula);
+
+    const CellInterface* GetCell(Position pos) const override;
+    CellInterface* GetCell(Position pos) override;
+
+    void ClearCell(Position pos) override;
+    // Очищает все ячейки диапазона за одну правку: размер таблицы пересчитывается
+    // один раз, зависимые ячейки сбрасываются (в режиме Eager - пересчитываются)
+    // одним проходом. Время пропорционально числу непустых ячеек в строках диапазона.
+    void ClearRange(const CellRange& range);
+
+    // Вставка и удаление строк и столбцов. Ячейки ниже (правее) сдвигаются,
+    // ссылки в формулах переписываются в разобранных деревьях без разбора текста,
+    // ссылки на удалённые ячейки становятся #REF!. Время пропорционально числу
+    // сдвинутых ячеек и ссылок на них. Если вставка вытолкнула бы непустые
+    // ячейки за край таблицы, бросается InvalidPositionException. Ссылки
+    // других листов книги на этот лист не переписываются.
+    void InsertRows(int before, int count = 1);
+    void DeleteRows(int first, int count = 1);
+    void InsertCols(int before, int count = 1);
+    void DeleteCols(int first, int count = 1);
+
+    // Заполняет dst копиями src, повторяя его по строкам и столбцам (протягивание).
+    // Ссылки формул сдвигаются вместе с копией, ссылка за край таблицы становится
+    // #REF!; формулы не разбираются заново, цикл проверяется один раз для всей
+    // операции. Пустые ячейки src очищают соответствующие ячейки dst.
+    void FillRange(const CellRange& src, const CellRange& dst);
+    // Копирует src так, что его левый верхний угол оказывается в dst.
+    void CopyRange(const CellRange& src, Position dst);
+    // Записывает пакет ячеек за одну правку (импорт, восстановление): формулы
+    // уже разобраны, цикл проверяется один раз для всего пакета, граф
+    // зависимостей строится одним проходом. Позиции не повторяются, texts -
+    // не формулы. Если позиция некорректна или пакет создаёт цикл, бросает
+    // исключение, и таблица не меняется. Формулы со ссылками на другие листы
+    // записываются после пакета по одной, с проверкой циклов через книгу.
+    void LoadCells(std::vector<std::pair<Position, std::string>> texts,
+                   std::vector<std::pair<Position, std::unique_ptr<FormulaInterface>>> formulas);
+
+    Size GetPrintableSize() const override;
+    // Непустые позиции диапазона, по строкам. Время пропорционально числу
+    // строк диапазона и непустых ячеек в них.
+    std::vector<Position> GetCellsIn(const CellRange& range) const;
+
+    void PrintValues(std::ostream& output) const override;
+    void PrintTexts(std::ostream& output) const override;
+    // Печать окна range в том же формате; печатается весь прямоугольник,
+    // в том числе за пределами GetPrintableSize. Вычисляются только ячейки
+    // окна и то, от чего они зависят (EvaluateRange).
+    void PrintValues(std::ostream& output, const CellRange& range) const;
+    void PrintTexts(std::ostream& output, const CellRange& range) const;
+    // Запись чисел в PrintValues. По умолчанию Shortest: напечатанное значение
+    // читается обратно без потерь; Stream - прежний вывод с 6 значащими цифрами.
+    void SetNumberFormat(NumberFormat format);
+    NumberFormat GetNumberFormat() const;
+
+    // Вычисляет неактуальные ячейки в фоновом потоке. Любая правка таблицы
+    // отменяет идущий пересчёт и дожидается его остановки; невычисленные
+    // ячейки остаются неактуальными и вычисляются при чтении, как обычно.
+    // Пока пересчёт идёт, другие потоки читают значения только через
+    // TryGetValue, PrintValues, EvaluateAll и EvaluateRange.
+    std::shared_ptr<RecalcTask> RecalculateAsync();
+    void CancelRecalc();
+    // Значение ячейки, если оно уже вычислено, иначе nullopt; пустая позиция -
+    // пустая строка. Не запускает вычислений.
+    std::optional<CellInterface::Value> TryGetValue(Position pos) const;
+
+    // Вычисляет все неактуальные ячейки. Подряд идущие в столбце формулы
+    // одинакового вида (=A1*B1, =A2*B2, ...) вычисляются одним пакетом
+    // по массивам входных значений (EvaluateBatch).
+    void EvaluateAll() const;
+    // Вычисляет неактуальные ячейки диапазона и их входы (транзитивно), остальные
+    // не трогает. Время пропорционально числу этих ячеек, а не размеру таблицы.
+    void EvaluateRange(const CellRange& range) const;
+
+    // Столбец, в котором набралось достаточно числовых текстовых ячеек, получает
+    // плотную копию чисел (NumericColumn); формулы читают числа оттуда.
+    bool TryGetNumber(Position pos, double& value) const override;
+    SheetInterface* FindSheet(std::string_view name) const override;
+    // Плотное числовое хранилище столбца или nullptr, если столбец не переведён в него.
+    const NumericColumn* GetNumericColumn(int col) const;
+
+    using PositionSet = CellSet;
+
+    // Граф зависимостей хранится в таблице и не требует существования ячеек:
+    // ссылка на пустую позицию - это только запись в индексе.
+    void AddDependency(Position from, Position to);
+    void RemoveDependency(Position from, Position to);
+    // Ссылки на другие листы; у таблицы вне книги ничего не делают.
+    void AddSheetDependency(Position from, const SheetPosition& to);
+    void RemoveSheetDependency(Position from, const SheetPosition& to);
+    // Ячейки, формулы которых ссылаются на pos; nullptr, если таких нет.
+    const PositionSet* GetDependents(Position pos) const;
+    // Сбрасывает значения всех ячеек, транзитивно зависящих от pos.
+    void InvalidateDependents(Position pos);
+    // Растёт, когда таблица создаёт, удаляет или двигает ячейки: формулы держат
+    // указатели на операнды своих входов (FindOperand) и по нему их обновляют.
+    uint64_t GetLayoutVersion() const;
+    // Операнд ячейки pos; для пустой позиции - общий операнд, равный 0.
+    const CellOperand* FindOperand(Position pos) const;
+
+    // Номер последней правки (SetCell/ClearCell), растёт монотонно.
+    uint64_t GetRevision() const;
+    // Номер правки, на которой значение в pos изменилось в последний раз;
+    // для пустой позиции - когда она была очищена.
+    uint64_t GetChangedAt(Position pos) const;
+    // Ячейки, значение которых изменилось после правки since, с новыми значениями
+    // (since = 0 - все ячейки). Вычисляются только ячейки, сброшенные или
+    // изменённые после since; время пропорционально их числу, а не размеру таблицы.
+    // Ячейки, сдвинутые вставкой и удалением строк и столбцов, попадают
+    // в выгрузку и по старому, и по новому адресу.
+    ValueChanges GetValueChanges(uint64_t since) const;
+
+    // Индексы, граф зависимостей и числовые столбцы, общие с копиями таблицы
+    // (Clone), входят в оценку каждой копии целиком.
+    SheetMemoryStats GetMemoryStats() const;
+    // Освобождает лишнюю ёмкость структур таблицы (например, после удаления
+    // большого диапазона): хеш-таблицы перестраиваются под число элементов,
+    // пустые строки и столбцы уходят из индексов, журнал изменений сжимается.
+    // Время пропорционально размеру таблицы.
+    void ShrinkToFit();
+
+    // В режиме Eager все значения всегда актуальны, а после каждой правки
+    // подписчики получают отсортированный список ячеек, значение которых
+    // действительно изменилось. Если пересчитанная ячейка получила прежнее
+    // значение, зависящие от неё ячейки не пересчитываются.
+    using ChangeCallback = std::function<void(const std::vector<Position>&)>;
+
+    void SetRecalcMode(RecalcMode mode);
+    RecalcMode GetRecalcMode() const;
+    size_t Subscribe(ChangeCallback callback);
+    void Unsubscribe(size_t id);
+    // Изменения, вызванные последней правкой в режиме Eager.
+    const std::vector<Position>& GetLastChanges() const;
+
+private:
+    friend class Workbook;
+
+    struct ValueVisitor {
+        std::ostream& out;
+        NumberFormat format;
+        void operator()(const std::string& val) {
+            out << val;
+        }
+        void operator()(const double& val) {
+            PrintNumber(out, val, format);
+        }
+        void operator()(const FormulaError& val) {
+            out << val;
+        }
+    };
+
+    template <typename Content>
+    void DoSetCell(Position pos, Content content);
+    std::optional<CellInterface::Value> GetEagerValue(Position pos) const;
+    void OnCellChanged(Position pos, const std::optional<CellInterface::Value>& old_value);
+    std::vector<Position> CollectAffected(Position pos) const;
+
+    // Неактуальная формула: программа берётся при сборе, пока ячейка в кеше.
+    struct FormulaRow {
+        int row;
+        const Cell* cell;
+        const std::vector<FormulaInstruction>* program;
+    };
+    using FormulaColumns = std::unordered_map<int, std::vector<FormulaRow>>;
+    // Вычисляет formulas (по столбцам), серии одинаковых формул - пакетами.
+    void EvaluateFormulas(FormulaColumns& formulas) const;
+    void EvaluateRun(int col, const FormulaRow* run, int rows) const;
+    bool ReadNumber(Position pos, double& value) const;
+
+    void EraseCell(Position pos);
+    // Для книги: изменилось значение ячейки другого листа, на которую ссылается pos.
+    void InvalidateFromSheet(Position pos);
+    // Сбрасывает ячейки других листов книги, ссылающиеся на pos.
+    void InvalidateOtherSheets(Position pos);
+    using RefMap = CellMap<std::vector<Position>>;
+    // Есть ли цикл, если ссылки позиций replaced заменить на new_refs
+    // (позиция replaced без записи в new_refs ни на что не ссылается).
+    bool HasCycle(const std::function<bool(Position)>& replaced, const RefMap& new_refs) const;
+    // В режиме Eager после операции над многими ячейками: пересчитывает таблицу
+    // и сообщает подписчикам changed и все ячейки, значение которых изменилось.
+    void NotifyBulkChange(std::vector<Position> changed);
+    void ShiftLines(bool rows, int first, int count, bool insert);
+    // Замкнёт ли цикл через другие листы книги сдвиг строк (столбцов) от first
+    // на delta: их ссылки на этот лист не переписываются.
+    bool HasShiftCycle(bool rows, int first, int delta) const;
+    // Запись в журнал изменений для GetValueChanges; moved - содержимое позиции
+    // заменено сдвигом строк (столбцов), и её значение выгружается безусловно.
+    void LogChange(Position pos, bool moved = false);
+    // Оставляет в журнале по одной записи на позицию.
+    void CompactChangeLog();
+    void ShiftNumericStore(bool rows, int first, int count, bool insert);
+
+    void UpdateNumericStore(Position pos, bool was_number);
+    // Учитывает удаление числовых ячеек rows столбца col.
+    void ReleaseNumbers(int col, const std::vector<int>& rows);
+    void PromoteColumn(int col);
+
+    void AddToIndex(const Position& pos);
+    void UpdateSize();
+    bool CheckPosition(const Position& pos) const;
+    
+    template <typename Func>
+    void Print(std::ostream& output, Position from, Size size, Func pred) const;
+    
+    // индексы, граф зависимостей и числовые столбцы копии таблицы
+    // разделяют с исходной до первого изменения.
+    // Индексы строк и столбцов ключуются номером строки (столбца), а не ячейкой:
+    // CellKey к ним неприменим.
+    CopyOnWrite<std::unordered_map<int, std::unordered_set<int>>> cols_idx_;
+    CopyOnWrite<std::unordered_map<int, std::unordered_set<int>>> rows_idx_;
+    Size size_ {0, 0};
+
+    CellMap<std::unique_ptr<CellInterface>> cells_;
+    CopyOnWrite<CellMap<PositionSet>> dependents_;
+
+    // позиции с зависимыми ячейками, очищенные на правке с этим номером
+    CellMap<uint64_t> cleared_at_;
+    uint64_t revision_ = 0;
+    // 0 у ячейки означает, что её входы ещё не привязаны
+    uint64_t layout_version_ = 1;
+
+    struct ChangeRecord {
+        uint64_t revision;
+        Position pos;
+        bool moved;
+    };
+    // позиции, значение которых могло измениться, по возрастанию номера правки;
+    // повторы одной позиции время от времени сжимаются в одну запись
+    std::vector<ChangeRecord> change_log_;
+    size_t compact_log_at_ = 1024;
+
+    // числовых текстовых ячеек в столбце
+    std::unordered_map<int, int> numeric_counts_;
+    CopyOnWrite<std::unordered_map<int, NumericColumn>> numeric_cols_;
+
+    // книга и имя в ней; у копии листа книги есть только книга
+    Workbook* workbook_ = nullptr;
+    std::string name_;
+
+    RecalcMode recalc_mode_ = RecalcMode::Lazy;
+    NumberFormat number_format_ = NumberFormat::Shortest;
+    std::map<size_t, ChangeCallback> subscribers_;
+    size_t next_subscriber_id_ = 0;
+    std::vector<Position> last_changes_;
+
+    // фоновый пересчёт, EvaluateAll и TryGetValue обращаются к кешам ячеек
+    // только под этим мьютексом
+    mutable std::mutex eval_mutex_;
+    std::shared_ptr<RecalcTask> recalc_task_;
+};
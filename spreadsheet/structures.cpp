@@ -1,107 +1,192 @@
-#include "common.h"
-
-#include <cctype>
-#include <sstream>
-#include <algorithm>
-
-const int LETTERS = 26;
-const int MAX_POSITION_LENGTH = 17;
-const int MAX_POS_LETTER_COUNT = 3;
-
-const Position Position::NONE = {-1, -1};
-
-bool Position::operator==(const Position rhs) const {
-    return row == rhs.row && col == rhs.col;
-}
-
-bool Position::operator<(const Position rhs) const {
-    return std::tie(row, col) < std::tie(rhs.row, rhs.col);
-}
-
-bool Position::IsValid() const {
-    return row >= 0 && col >= 0 && row < MAX_ROWS && col < MAX_COLS;
-}
-
-std::string Position::ToString() const {
-    if (!IsValid()) {
-        return "";
-    }
-
-    std::string result;
-    result.reserve(MAX_POSITION_LENGTH);
-    int c = col;
-    while (c >= 0) {
-        result.insert(result.begin(), 'A' + c % LETTERS);
-        c = c / LETTERS - 1;
-    }
-
-    result += std::to_string(row + 1);
-
-    return result;
-}
-
-Position Position::FromString(std::string_view str) {
-    auto it = std::find_if(str.begin(), str.end(), [](const char c) {
-        return !(std::isalpha(c) && std::isupper(c));
-    });
-    auto letters = str.substr(0, it - str.begin());
-    auto digits = str.substr(it - str.begin());
-
-    if (letters.empty() || digits.empty()) {
-        return Position::NONE;
-    }
-    if (letters.size() > MAX_POS_LETTER_COUNT) {
-        return Position::NONE;
-    }
-
-    if (!std::isdigit(digits[0])) {
-        return Position::NONE;
-    }
-
-    int row;
-    std::istringstream row_in{std::string{digits}};
-    if (!(row_in >> row) || !row_in.eof()) {
-        return Position::NONE;
-    }
-
-    int col = 0;
-    for (char ch : letters) {
-        col *= LETTERS;
-        col += ch - 'A' + 1;
-    }
-
-    return {row - 1, col - 1};
-}
-
-bool Size::operator==(Size rhs) const {
-    return cols == rhs.cols && rows == rhs.rows;
-}
-
-FormulaError::FormulaError(Category category) : category_(category) {
-    //
-}
-
-FormulaError::Category FormulaError::GetCategory() const {
-    return category_;
-}
-
-bool FormulaError::operator==(FormulaError rhs) const {
-    return category_ == rhs.category_;
-}
-
-std::string_view FormulaError::ToString() const {
-    switch (category_) {
-        case FormulaError::Category::Value:
-            return "#VALUE!";
-        case FormulaError::Category::Arithmetic:
-            return "#ARITHM!";
-        case FormulaError::Category::Ref:
-            return "#REF!";
-    }
-    return "";
-}
-
-std::ostream& operator<<(std::ostream& output, FormulaError fe) {
-    output << fe.ToString();
-    return output;
-}
+#include "common.h"
+
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <cstdlib>
+#include <sstream>
+#include <algorithm>
+
+const int LETTERS = 26;
+const int MAX_POS_LETTER_COUNT = 3;
+
+const Position Position::NONE = {-1, -1};
+
+bool Position::operator==(const Position rhs) const {
+    return row == rhs.row && col == rhs.col;
+}
+
+bool Position::operator<(const Position rhs) const {
+    return std::tie(row, col) < std::tie(rhs.row, rhs.col);
+}
+
+bool Position::IsValid() const {
+    return row >= 0 && col >= 0 && row < MAX_ROWS && col < MAX_COLS;
+}
+
+std::string Position::ToString() const {
+    char buffer[MAX_NAME_LENGTH];
+    return std::string(buffer, ToChars(buffer));
+}
+
+size_t Position::ToChars(char* buffer) const {
+    if (!IsValid()) {
+        return 0;
+    }
+    // буквы столбца получаются с конца
+    char letters[MAX_POS_LETTER_COUNT];
+    size_t count = 0;
+    for (int c = col; c >= 0; c = c / LETTERS - 1) {
+        letters[count++] = static_cast<char>('A' + c % LETTERS);
+    }
+    std::reverse_copy(letters, letters + count, buffer);
+    const auto result = std::to_chars(buffer + count, buffer + MAX_NAME_LENGTH, row + 1);
+    return static_cast<size_t>(result.ptr - buffer);
+}
+
+Position Position::FromString(std::string_view str) {
+    size_t letters = 0;
+    while (letters < str.size() && str[letters] >= 'A' && str[letters] <= 'Z') {
+        ++letters;
+    }
+    if (letters == 0 || letters > MAX_POS_LETTER_COUNT || letters == str.size()) {
+        return Position::NONE;
+    }
+    // from_chars принял бы и минус
+    if (str[letters] < '0' || str[letters] > '9') {
+        return Position::NONE;
+    }
+
+    int row;
+    const char* end = str.data() + str.size();
+    const auto [ptr, ec] = std::from_chars(str.data() + letters, end, row);
+    if (ec != std::errc() || ptr != end) {
+        return Position::NONE;
+    }
+
+    int col = 0;
+    for (size_t i = 0; i < letters; ++i) {
+        col *= LETTERS;
+        col += str[i] - 'A' + 1;
+    }
+
+    return {row - 1, col - 1};
+}
+
+bool ParseNumber(std::string_view text, double& value) {
+    size_t i = 0;
+    while (i < text.size() && std::isspace(static_cast<unsigned char>(text[i]))) {
+        ++i;
+    }
+    const size_t begin = i;
+    auto skip_digits = [&text, &i]() {
+        const size_t start = i;
+        while (i < text.size() && std::isdigit(static_cast<unsigned char>(text[i]))) {
+            ++i;
+        }
+        return i - start;
+    };
+    if (i < text.size() && (text[i] == '+' || text[i] == '-')) {
+        ++i;
+    }
+    size_t mantissa_digits = skip_digits();
+    if (i < text.size() && text[i] == '.') {
+        ++i;
+        mantissa_digits += skip_digits();
+    }
+    if (mantissa_digits == 0) {
+        return false;
+    }
+    if (i < text.size() && (text[i] == 'e' || text[i] == 'E')) {
+        ++i;
+        if (i < text.size() && (text[i] == '+' || text[i] == '-')) {
+            ++i;
+        }
+        if (skip_digits() == 0) {
+            return false;
+        }
+    }
+    if (i != text.size()) {
+        return false;
+    }
+
+    // strtod нужна строка с завершающим нулём
+    const std::string number(text.substr(begin));
+    const double result = std::strtod(number.c_str(), nullptr);
+    if (std::isinf(result)) {
+        return false;
+    }
+    value = result;
+    return true;
+}
+
+size_t FormatNumber(double value, char* buffer, NumberFormat format) {
+    char* end = buffer + MAX_NUMBER_LENGTH;
+    const auto result = format == NumberFormat::Shortest
+                            ? std::to_chars(buffer, end, value)
+                            : std::to_chars(buffer, end, value, std::chars_format::general, 6);
+    return static_cast<size_t>(result.ptr - buffer);
+}
+
+void PrintNumber(std::ostream& output, double value, NumberFormat format) {
+    if (format == NumberFormat::Stream) {
+        // с учётом настроек самого потока, как раньше
+        output << value;
+        return;
+    }
+    char buffer[MAX_NUMBER_LENGTH];
+    output.write(buffer, FormatNumber(value, buffer, format));
+}
+
+bool SheetPosition::operator==(const SheetPosition& rhs) const {
+    return pos == rhs.pos && sheet == rhs.sheet;
+}
+
+bool SheetPosition::operator<(const SheetPosition& rhs) const {
+    return std::tie(sheet, pos) < std::tie(rhs.sheet, rhs.pos);
+}
+
+bool Size::operator==(Size rhs) const {
+    return cols == rhs.cols && rows == rhs.rows;
+}
+
+bool CellRange::IsValid() const {
+    return from.IsValid() && to.IsValid() && from.row <= to.row && from.col <= to.col;
+}
+
+bool CellRange::Contains(Position pos) const {
+    return pos.row >= from.row && pos.row <= to.row && pos.col >= from.col && pos.col <= to.col;
+}
+
+Size CellRange::GetSize() const {
+    return {to.row - from.row + 1, to.col - from.col + 1};
+}
+
+FormulaError::FormulaError(Category category) : category_(category) {
+    //
+}
+
+FormulaError::Category FormulaError::GetCategory() const {
+    return category_;
+}
+
+bool FormulaError::operator==(FormulaError rhs) const {
+    return category_ == rhs.category_;
+}
+
+std::string_view FormulaError::ToString() const {
+    switch (category_) {
+        case FormulaError::Category::Value:
+            return "#VALUE!";
+        case FormulaError::Category::Arithmetic:
+            return "#ARITHM!";
+        case FormulaError::Category::Ref:
+            return "#REF!";
+    }
+    return "";
+}
+
+std::ostream& operator<<(std::ostream& output, FormulaError fe) {
+    output << fe.ToString();
+    return output;
+}
@@ -0,0 +1,396 @@
+#include "sweep.h"
+
+#include "FormulaAST.h"
+#include "batch_eval.h"
+#include "cell.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <cmath>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+
+namespace {
+
+// сценариев в одном блоке, как у EvaluateBatch
+const size_t BLOCK = 256;
+
+using Op = FormulaInstruction::Op;
+
+// Ошибка в слоте: 0 - нет, иначе категория + 1.
+using ErrorCode = unsigned char;
+
+ErrorCode ToErrorCode(FormulaError error) {
+    return static_cast<ErrorCode>(error.GetCategory()) + 1;
+}
+
+FormulaError FromErrorCode(ErrorCode code) {
+    return FormulaError(static_cast<FormulaError::Category>(code - 1));
+}
+
+const ErrorCode ARITHM_ERROR = ToErrorCode(FormulaError::Category::Arithmetic);
+
+double ApplyBinary(Op op, double lhs, double rhs) {
+    switch (op) {
+        case Op::Add:
+            return lhs + rhs;
+        case Op::Subtract:
+            return lhs - rhs;
+        case Op::Multiply:
+            return lhs * rhs;
+        default:
+            return lhs / rhs;
+    }
+}
+
+}  // namespace
+
+// Значения и ошибки всех слотов для блока сценариев; у каждого потока свой.
+class Sweep::Block {
+public:
+    Block(const Sweep& sweep, size_t rows)
+        : sweep_(sweep),
+          rows_(rows),
+          values_(sweep.constants_.size() * rows),
+          errors_(sweep.constants_.size() * rows),
+          has_error_(sweep.constants_.size()),
+          arithm_error_(new bool[rows]) {
+        for (size_t slot = 0; slot < sweep.constants_.size(); ++slot) {
+            const auto& constant = sweep.constants_[slot];
+            if (!constant) {
+                continue;
+            }
+            std::fill_n(Values(slot), rows, constant->value);
+            if (constant->error) {
+                std::fill_n(Errors(slot), rows, ToErrorCode(*constant->error));
+                has_error_[slot] = true;
+            }
+        }
+    }
+
+    void Evaluate(const std::vector<std::vector<double>>& values, size_t first, size_t rows) {
+        for (size_t input = 0; input < sweep_.input_count_; ++input) {
+            std::copy_n(values[input].data() + first, rows, Values(input));
+        }
+        for (const auto& node : sweep_.nodes_) {
+            const bool error_in_operands = std::any_of(node.operands.begin(), node.operands.end(), [this](int slot) {
+                return has_error_[slot];
+            });
+            if (!error_in_operands) {
+                EvaluateBatchNode(node, rows);
+            } else {
+                for (size_t row = 0; row < rows; ++row) {
+                    EvaluateRow(node, row);
+                }
+                has_error_[node.slot] = std::any_of(Errors(node.slot), Errors(node.slot) + rows, [](ErrorCode code) {
+                    return code != 0;
+                });
+            }
+        }
+    }
+
+    CellInterface::Value GetValue(int slot, size_t row) const {
+        const ErrorCode error = errors_[slot * rows_ + row];
+        if (error != 0) {
+            return FromErrorCode(error);
+        }
+        return values_[slot * rows_ + row];
+    }
+
+private:
+    double* Values(size_t slot) {
+        return values_.data() + slot * rows_;
+    }
+    ErrorCode* Errors(size_t slot) {
+        return errors_.data() + slot * rows_;
+    }
+
+    void EvaluateBatchNode(const Node& node, size_t rows) {
+        inputs_.clear();
+        for (const int slot : node.operands) {
+            inputs_.push_back(Values(slot));
+        }
+        EvaluateBatch(node.code, inputs_, rows, Values(node.slot), arithm_error_.get());
+        auto* errors = Errors(node.slot);
+        bool has_error = false;
+        for (size_t row = 0; row < rows; ++row) {
+            errors[row] = arithm_error_[row] ? ARITHM_ERROR : 0;
+            has_error |= arithm_error_[row];
+        }
+        has_error_[node.slot] = has_error;
+    }
+
+    // Один сценарий с учётом ошибок операндов. Правый операнд вычисляется
+    // раньше левого (как в дереве формулы), поэтому его ошибка важнее.
+    void EvaluateRow(const Node& node, size_t row) {
+        stack_values_.resize(node.code.size());
+        stack_errors_.resize(node.code.size());
+        size_t top = 0;
+        size_t operand = 0;
+        for (const auto& instruction : node.code) {
+            switch (instruction.op) {
+                case Op::Number:
+                    stack_values_[top] = instruction.number;
+                    stack_errors_[top++] = 0;
+                    break;
+                case Op::Cell: {
+                    const int slot = node.operands[operand++];
+                    stack_values_[top] = Values(slot)[row];
+                    stack_errors_[top++] = Errors(slot)[row];
+                    break;
+                }
+                case Op::UnaryPlus:
+                    break;
+                case Op::UnaryMinus:
+                    stack_values_[top - 1] = -stack_values_[top - 1];
+                    break;
+                default: {
+                    --top;
+                    auto& error = stack_errors_[top - 1];
+                    if (stack_errors_[top] != 0) {
+                        error = stack_errors_[top];
+                    } else if (error == 0) {
+                        auto& value = stack_values_[top - 1];
+                        value = ApplyBinary(instruction.op, value, stack_values_[top]);
+                        if (!std::isfinite(value)) {
+                            error = ARITHM_ERROR;
+                        }
+                    }
+                }
+            }
+        }
+        Values(node.slot)[row] = stack_values_[0];
+        Errors(node.slot)[row] = stack_errors_[0];
+    }
+
+    const Sweep& sweep_;
+    size_t rows_;
+    std::vector<double> values_;
+    std::vector<ErrorCode> errors_;
+    // в слоте есть ошибка хотя бы в одном сценарии блока
+    std::vector<char> has_error_;
+    std::unique_ptr<bool[]> arithm_error_;
+    std::vector<const double*> inputs_;
+    std::vector<double> stack_values_;
+    std::vector<ErrorCode> stack_errors_;
+};
+
+Sweep::Sweep(Sheet& sheet, std::vector<Position> inputs, std::vector<Position> outputs) {
+    input_count_ = inputs.size();
+    for (const auto& pos : inputs) {
+        if (!pos.IsValid()) {
+            throw InvalidPositionException("Invalid sweep input position");
+        }
+        if (!slots_.emplace(pos, static_cast<int>(constants_.size())).second) {
+            throw std::invalid_argument("Duplicate sweep input " + pos.ToString());
+        }
+        constants_.emplace_back();
+    }
+    for (const auto& pos : outputs) {
+        if (!pos.IsValid()) {
+            throw InvalidPositionException("Invalid sweep output position");
+        }
+        Output output;
+        const int slot = AddSlot(sheet, pos);
+        if (constants_[slot]) {
+            const auto* cell = sheet.GetCell(pos);
+            output.value = cell != nullptr ? cell->GetValue() : CellInterface::Value(std::string());
+        } else {
+            output.slot = slot;
+        }
+        outputs_.push_back(std::move(output));
+    }
+}
+
+int Sweep::AddSlot(Sheet& sheet, Position root) {
+    // обход в глубину без рекурсии: цепочки формул бывают длинными
+    struct Frame {
+        Position pos;
+        const FormulaInterface* formula;
+        std::vector<Position> refs;
+        size_t next = 0;
+    };
+    std::vector<Frame> stack;
+
+    auto add_constant = [this, &sheet](Position pos) {
+        Constant constant;
+        try {
+            constant.value = ASTImpl::GetCellOperand(sheet, pos);
+        } catch (const FormulaError& error) {
+            constant.error = error;
+        }
+        const int slot = static_cast<int>(constants_.size());
+        constants_.push_back(constant);
+        slots_.emplace(pos, slot);
+    };
+    auto visit = [&](Position pos) {
+        if (slots_.count(pos) != 0) {
+            return;
+        }
+        const FormulaInterface* formula = nullptr;
+        if (pos.IsValid()) {
+            if (const auto* cell = sheet.GetCell(pos)) {
+                formula = static_cast<const Cell*>(cell)->GetFormula();
+            }
+        }
+        if (formula == nullptr) {
+            add_constant(pos);
+            return;
+        }
+        stack.push_back({pos, formula, formula->GetReferencedCells()});
+    };
+
+    visit(root);
+    while (!stack.empty()) {
+        auto& frame = stack.back();
+        if (frame.next < frame.refs.size()) {
+            visit(frame.refs[frame.next++]);
+            continue;
+        }
+        const bool variable = std::any_of(frame.refs.begin(), frame.refs.end(), [this](Position pos) {
+            return !constants_[slots_.at(pos)];
+        });
+        if (!variable) {
+            add_constant(frame.pos);
+            stack.pop_back();
+            continue;
+        }
+        if (frame.formula->GetProgram().empty()) {
+            throw std::invalid_argument("Sweep: formula in " + frame.pos.ToString()
+                                        + " depends on inputs and references another sheet");
+        }
+        Node node;
+        // программа копируется: таблица может измениться после создания Sweep
+        node.code = frame.formula->GetProgram();
+        for (const auto& instruction : node.code) {
+            if (instruction.op != Op::Cell) {
+                continue;
+            }
+            // ссылка #REF! (Position::NONE) не входит в GetReferencedCells:
+            // ей достаётся общий слот-константа с ошибкой #REF!
+            if (!instruction.cell.IsValid() && slots_.count(instruction.cell) == 0) {
+                add_constant(instruction.cell);
+            }
+            node.operands.push_back(slots_.at(instruction.cell));
+        }
+        node.slot = static_cast<int>(constants_.size());
+        constants_.emplace_back();
+        slots_.emplace(frame.pos, node.slot);
+        nodes_.push_back(std::move(node));
+        stack.pop_back();
+    }
+    return slots_.at(root);
+}
+
+std::vector<std::vector<CellInterface::Value>> Sweep::Run(const std::vector<std::vector<double>>& values,
+                                                          unsigned threads) const {
+    if (values.size() != input_count_) {
+        throw std::invalid_argument("Sweep::Run: expected values for each input");
+    }
+    const size_t scenarios = values.empty() ? 0 : values[0].size();
+    for (const auto& input_values : values) {
+        if (input_values.size() != scenarios) {
+            throw std::invalid_argument("Sweep::Run: inputs have different scenario counts");
+        }
+    }
+
+    std::vector<std::vector<CellInterface::Value>> result(outputs_.size());
+    for (size_t i = 0; i < outputs_.size(); ++i) {
+        if (outputs_[i].slot < 0) {
+            result[i].assign(scenarios, outputs_[i].value);
+        } else {
+            result[i].resize(scenarios);
+        }
+    }
+
+    const size_t blocks = (scenarios + BLOCK - 1) / BLOCK;
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = static_cast<unsigned>(std::min<size_t>(threads, blocks));
+    if (threads <= 1) {
+        RunBlocks(values, 0, blocks, result);
+        return result;
+    }
+    // потоки пишут в непересекающиеся диапазоны result
+    std::vector<std::future<void>> workers;
+    for (unsigned i = 0; i < threads; ++i) {
+        const size_t first = blocks * i / threads;
+        const size_t last = blocks * (i + 1) / threads;
+        workers.push_back(std::async(std::launch::async, [this, &values, first, last, &result] {
+            RunBlocks(values, first, last, result);
+        }));
+    }
+    for (auto& worker : workers) {
+        worker.get();
+    }
+    return result;
+}
+
+void Sweep::RunBlocks(const std::vector<std::vector<double>>& values, size_t first, size_t last,
+                      std::vector<std::vector<CellInterface::Value>>& result) const {
+    const size_t scenarios = result.empty() || values.empty() ? 0 : values[0].size();
+    Block block(*this, std::min(BLOCK, scenarios));
+    for (size_t index = first; index < last; ++index) {
+        const size_t begin = index * BLOCK;
+        const size_t rows = std::min(BLOCK, scenarios - begin);
+        block.Evaluate(values, begin, rows);
+        for (size_t i = 0; i < outputs_.size(); ++i) {
+            if (outputs_[i].slot < 0) {
+                continue;
+            }
+            for (size_t row = 0; row < rows; ++row) {
+                result[i][begin + row] = block.GetValue(outputs_[i].slot, row);
+            }
+        }
+    }
+}
+
+size_t Sweep::GetFormulaCount() const {
+    return nodes_.size();
+}
+
+std::optional<double> GoalSeek(Sheet& sheet, Position input, Position output, double target, double guess,
+                               double tolerance, int max_iterations) {
+    const Sweep sweep(sheet, {input}, {output});
+    auto residual = [&sweep, target](double x) -> std::optional<double> {
+        const auto result = sweep.Run({{x}}, 1);
+        const auto* value = std::get_if<double>(&result[0][0]);
+        if (value == nullptr) {
+            return std::nullopt;
+        }
+        return *value - target;
+    };
+
+    double x0 = guess;
+    auto f0 = residual(x0);
+    if (!f0) {
+        return std::nullopt;
+    }
+    if (std::abs(*f0) <= tolerance) {
+        return x0;
+    }
+    double x1 = guess + std::max(std::abs(guess) * 1e-3, 1e-3);
+    for (int i = 0; i < max_iterations; ++i) {
+        const auto f1 = residual(x1);
+        if (!f1) {
+            return std::nullopt;
+        }
+        if (std::abs(*f1) <= tolerance) {
+            return x1;
+        }
+        if (*f1 == *f0) {
+            return std::nullopt;
+        }
+        const double x2 = x1 - *f1 * (x1 - x0) / (*f1 - *f0);
+        if (!std::isfinite(x2)) {
+            return std::nullopt;
+        }
+        x0 = x1;
+        f0 = f1;
+        x1 = x2;
+    }
+    return std::nullopt;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+class Sheet;
+
+// Расчёт множества сценариев "что если" без правок таблицы.
+// При создании из таблицы один раз выделяется подграф формул, зависящих
+// от входов и нужных выходам; остальные ячейки становятся константами
+// со значениями на момент создания. Run подставляет значения входов
+// и вычисляет подграф пакетами сценариев (EvaluateBatch) в нескольких потоках.
+// Формулы подграфа не могут ссылаться на другие листы книги (std::invalid_argument).
+class Sweep {
+public:
+    Sweep(Sheet& sheet, std::vector<Position> inputs, std::vector<Position> outputs);
+
+    // values[i][s] - значение i-го входа в сценарии s, у всех входов поровну
+    // сценариев. Возвращает result[o][s] - значение o-го выхода в сценарии s.
+    // threads == 0 - по числу ядер.
+    std::vector<std::vector<CellInterface::Value>> Run(const std::vector<std::vector<double>>& values,
+                                                       unsigned threads = 0) const;
+
+    // Сколько формул вычисляется в каждом сценарии.
+    size_t GetFormulaCount() const;
+
+private:
+    // Формула подграфа. operands - слоты значений её инструкций Cell по порядку.
+    struct Node {
+        std::vector<FormulaInstruction> code;
+        std::vector<int> operands;
+        int slot;
+    };
+
+    // Значение ячейки-константы в роли операнда формулы.
+    struct Constant {
+        double value = 0.;
+        std::optional<FormulaError> error;
+    };
+
+    // Выход: слот подграфа или значение константы.
+    struct Output {
+        int slot = -1;
+        CellInterface::Value value;
+    };
+
+    class Block;
+
+    int AddSlot(Sheet& sheet, Position pos);
+    void RunBlocks(const std::vector<std::vector<double>>& values, size_t first, size_t last,
+                   std::vector<std::vector<CellInterface::Value>>& result) const;
+
+    size_t input_count_ = 0;
+    // слоты: сначала входы, затем константы и формулы вперемешку
+    std::unordered_map<Position, int, PositionHash> slots_;
+    std::vector<std::optional<Constant>> constants_;
+    // в топологическом порядке
+    std::vector<Node> nodes_;
+    std::vector<Output> outputs_;
+};
+
+// Подбирает значение input, при котором output равен target с точностью
+// tolerance, методом секущих от guess. Таблица не меняется.
+// nullopt, если за max_iterations решение не найдено или output дал ошибку.
+std::optional<double> GoalSeek(Sheet& sheet, Position input, Position output, double target, double guess,
+                               double tolerance = 1e-9, int max_iterations = 100);
@@ -0,0 +1,422 @@
+#include "value_export.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+// Формат выгрузки (числа varint - по 7 бит, младшие вперёд):
+//   'S' 'V' 1                      - сигнатура и версия
+//   varint rows, varint cols
+//   столбцы по порядку, каждый - отрезки, пока их длины не дадут rows:
+//     byte kind, varint length, данные:
+//       Empty    -
+//       Numbers  length x double (8 байт, little-endian)
+//       Strings  length x строка
+//       Errors   length x byte (FormulaError::Category)
+//       Repeat   byte kind (Numbers/Strings/Errors) и одно значение этого вида
+//       Sequence double start, double step: значения start + i * step
+//   строка: varint (индекс в словаре + 1) или 0, varint длина и байты новой
+//   строки, которая получает следующий индекс словаря.
+
+namespace {
+
+enum class RunKind : uint8_t {
+    Empty = 0,
+    Numbers = 1,
+    Strings = 2,
+    Errors = 3,
+    Repeat = 4,
+    Sequence = 5,
+};
+
+const char MAGIC[] = {'S', 'V', 1};
+// короче этого повтор и прогрессия не выделяются в отдельный отрезок
+const size_t MIN_RUN = 4;
+
+using Value = CellInterface::Value;
+
+uint64_t ToBits(double value) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+double FromBits(uint64_t bits) {
+    double value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// Элемент прогрессии; кодировщик и декодер считают его одной функцией,
+// чтобы значения совпадали побитово.
+double GetSequenceValue(double start, double step, uint64_t index) {
+    return start + static_cast<double>(index) * step;
+}
+
+RunKind GetKind(const Value& value) {
+    if (const auto* text = std::get_if<std::string>(&value)) {
+        return text->empty() ? RunKind::Empty : RunKind::Strings;
+    }
+    return std::holds_alternative<double>(value) ? RunKind::Numbers : RunKind::Errors;
+}
+
+// Совпадение значений; числа сравниваются побитово, чтобы повтор восстанавливался точно.
+bool IsSame(const Value& lhs, const Value& rhs) {
+    if (const auto* number = std::get_if<double>(&lhs)) {
+        const auto* other = std::get_if<double>(&rhs);
+        return other != nullptr && ToBits(*number) == ToBits(*other);
+    }
+    return lhs == rhs;
+}
+
+// Пишет в буфер вызывающего, пока хватает места; дальше только считает размер.
+class Writer {
+public:
+    Writer(char* data, size_t capacity) : data_(data), capacity_(capacity) {
+    }
+
+    void Byte(uint8_t value) {
+        if (size_ < capacity_) {
+            data_[size_] = static_cast<char>(value);
+        }
+        ++size_;
+    }
+
+    void Bytes(const char* bytes, size_t count) {
+        if (size_ < capacity_) {
+            std::memcpy(data_ + size_, bytes, std::min(count, capacity_ - size_));
+        }
+        size_ += count;
+    }
+
+    void Varint(uint64_t value) {
+        while (value >= 0x80) {
+            Byte(static_cast<uint8_t>(value | 0x80));
+            value >>= 7;
+        }
+        Byte(static_cast<uint8_t>(value));
+    }
+
+    void Double(double value) {
+        const uint64_t bits = ToBits(value);
+        for (int shift = 0; shift < 64; shift += 8) {
+            Byte(static_cast<uint8_t>(bits >> shift));
+        }
+    }
+
+    size_t GetSize() const {
+        return size_;
+    }
+
+private:
+    char* data_;
+    size_t capacity_;
+    size_t size_ = 0;
+};
+
+class Encoder {
+public:
+    Encoder(Writer& out, bool compress_runs) : out_(out), compress_runs_(compress_runs) {
+    }
+
+    void WriteColumn(const std::vector<Value>& values) {
+        size_t begin = 0;
+        while (begin < values.size()) {
+            const RunKind kind = GetKind(values[begin]);
+            size_t end = begin + 1;
+            if (kind == RunKind::Empty) {
+                while (end < values.size() && GetKind(values[end]) == RunKind::Empty) {
+                    ++end;
+                }
+                WriteHeader(kind, end - begin);
+                begin = end;
+                continue;
+            }
+            if (compress_runs_ && WriteRun(values, begin)) {
+                continue;
+            }
+            while (end < values.size() && GetKind(values[end]) == kind
+                   && !(compress_runs_ && GetRun(values, end).length >= MIN_RUN)) {
+                ++end;
+            }
+            WriteHeader(kind, end - begin);
+            for (size_t i = begin; i < end; ++i) {
+                WriteValue(values[i]);
+            }
+            begin = end;
+        }
+    }
+
+private:
+    struct Run {
+        RunKind kind = RunKind::Repeat;
+        size_t length = 0;
+        double step = 0.;
+    };
+
+    // Самый длинный повтор или прогрессия, начинающиеся с begin.
+    static Run GetRun(const std::vector<Value>& values, size_t begin) {
+        Run run;
+        size_t end = begin + 1;
+        while (end < values.size() && IsSame(values[end], values[begin])) {
+            ++end;
+        }
+        run.length = end - begin;
+
+        const auto* start = std::get_if<double>(&values[begin]);
+        const auto* next = begin + 1 < values.size() ? std::get_if<double>(&values[begin + 1]) : nullptr;
+        if (start == nullptr || next == nullptr || *next == *start) {
+            return run;
+        }
+        // шаг - разность первых двух, но и второй элемент проверяется: start + step
+        // может не совпасть с ним побитово
+        const double step = *next - *start;
+        end = begin + 1;
+        while (end < values.size()) {
+            const auto* number = std::get_if<double>(&values[end]);
+            if (number == nullptr || ToBits(GetSequenceValue(*start, step, end - begin)) != ToBits(*number)) {
+                break;
+            }
+            ++end;
+        }
+        if (end - begin > run.length) {
+            run = {RunKind::Sequence, end - begin, step};
+        }
+        return run;
+    }
+
+    bool WriteRun(const std::vector<Value>& values, size_t& begin) {
+        const Run run = GetRun(values, begin);
+        if (run.length < MIN_RUN) {
+            return false;
+        }
+        WriteHeader(run.kind, run.length);
+        if (run.kind == RunKind::Sequence) {
+            out_.Double(std::get<double>(values[begin]));
+            out_.Double(run.step);
+        } else {
+            out_.Byte(static_cast<uint8_t>(GetKind(values[begin])));
+            WriteValue(values[begin]);
+        }
+        begin += run.length;
+        return true;
+    }
+
+    void WriteHeader(RunKind kind, size_t length) {
+        out_.Byte(static_cast<uint8_t>(kind));
+        out_.Varint(length);
+    }
+
+    void WriteValue(const Value& value) {
+        if (const auto* number = std::get_if<double>(&value)) {
+            out_.Double(*number);
+        } else if (const auto* error = std::get_if<FormulaError>(&value)) {
+            out_.Byte(static_cast<uint8_t>(error->GetCategory()));
+        } else {
+            WriteString(std::get<std::string>(value));
+        }
+    }
+
+    void WriteString(const std::string& text) {
+        const auto it = dictionary_.find(text);
+        if (it != dictionary_.end()) {
+            out_.Varint(it->second + 1);
+            return;
+        }
+        dictionary_.emplace(text, dictionary_.size());
+        out_.Varint(0);
+        out_.Varint(text.size());
+        out_.Bytes(text.data(), text.size());
+    }
+
+    Writer& out_;
+    bool compress_runs_;
+    std::unordered_map<std::string, uint64_t> dictionary_;
+};
+
+class Reader {
+public:
+    Reader(const char* data, size_t size) : data_(data), size_(size) {
+    }
+
+    uint8_t Byte() {
+        Require(1);
+        return static_cast<uint8_t>(data_[offset_++]);
+    }
+
+    uint64_t Varint() {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            const uint8_t byte = Byte();
+            value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) {
+                return value;
+            }
+        }
+        throw std::invalid_argument("ImportValues: bad varint");
+    }
+
+    double Double() {
+        uint64_t bits = 0;
+        for (int shift = 0; shift < 64; shift += 8) {
+            bits |= static_cast<uint64_t>(Byte()) << shift;
+        }
+        return FromBits(bits);
+    }
+
+    Value Read(RunKind kind) {
+        switch (kind) {
+            case RunKind::Numbers:
+                return Double();
+            case RunKind::Errors: {
+                const uint8_t category = Byte();
+                if (category > static_cast<uint8_t>(FormulaError::Category::Arithmetic)) {
+                    throw std::invalid_argument("ImportValues: bad error code");
+                }
+                return FormulaError(static_cast<FormulaError::Category>(category));
+            }
+            case RunKind::Strings:
+                return ReadString();
+            default:
+                throw std::invalid_argument("ImportValues: bad value kind");
+        }
+    }
+
+    bool AtEnd() const {
+        return offset_ == size_;
+    }
+
+    size_t GetRemaining() const {
+        return size_ - offset_;
+    }
+
+private:
+    std::string ReadString() {
+        const uint64_t index = Varint();
+        if (index > 0) {
+            if (index > dictionary_.size()) {
+                throw std::invalid_argument("ImportValues: bad string index");
+            }
+            return dictionary_[index - 1];
+        }
+        const uint64_t length = Varint();
+        Require(length);
+        dictionary_.emplace_back(data_ + offset_, length);
+        offset_ += length;
+        return dictionary_.back();
+    }
+
+    void Require(uint64_t count) const {
+        if (count > size_ - offset_) {
+            throw std::invalid_argument("ImportValues: truncated data");
+        }
+    }
+
+    const char* data_;
+    size_t size_;
+    size_t offset_ = 0;
+    std::vector<std::string> dictionary_;
+};
+
+// Разбирает столбцы выгрузки в grid; grid == nullptr - только проверяет поток.
+void ReadColumns(Reader& in, uint64_t rows, uint64_t cols, ValueGrid* grid) {
+    for (uint64_t col = 0; col < cols; ++col) {
+        uint64_t row = 0;
+        while (row < rows) {
+            const auto kind = static_cast<RunKind>(in.Byte());
+            const uint64_t length = in.Varint();
+            if (length == 0 || length > rows - row) {
+                throw std::invalid_argument("ImportValues: bad run length");
+            }
+            const auto store = [grid, cols, col, row](uint64_t i, Value value) {
+                if (grid != nullptr) {
+                    grid->values[(row + i) * cols + col] = std::move(value);
+                }
+            };
+            switch (kind) {
+                case RunKind::Empty:
+                    break;
+                case RunKind::Numbers:
+                case RunKind::Strings:
+                case RunKind::Errors:
+                    for (uint64_t i = 0; i < length; ++i) {
+                        store(i, in.Read(kind));
+                    }
+                    break;
+                case RunKind::Repeat: {
+                    const Value value = in.Read(static_cast<RunKind>(in.Byte()));
+                    for (uint64_t i = 0; grid != nullptr && i < length; ++i) {
+                        store(i, value);
+                    }
+                    break;
+                }
+                case RunKind::Sequence: {
+                    const double start = in.Double();
+                    const double step = in.Double();
+                    for (uint64_t i = 0; grid != nullptr && i < length; ++i) {
+                        store(i, GetSequenceValue(start, step, i));
+                    }
+                    break;
+                }
+                default:
+                    throw std::invalid_argument("ImportValues: bad run kind");
+            }
+            row += length;
+        }
+    }
+    if (!in.AtEnd()) {
+        throw std::invalid_argument("ImportValues: trailing data");
+    }
+}
+
+}  // namespace
+
+size_t ExportValues(const Sheet& sheet, const CellRange& range, char* buffer, size_t capacity,
+                    const ValueExportOptions& options) {
+    sheet.EvaluateRange(range);
+    const Size size = range.GetSize();
+    Writer out(buffer, capacity);
+    out.Bytes(MAGIC, sizeof(MAGIC));
+    out.Varint(size.rows);
+    out.Varint(size.cols);
+
+    Encoder encoder(out, options.compress_runs);
+    std::vector<Value> column(size.rows);
+    for (int col = range.from.col; col <= range.to.col; ++col) {
+        for (int row = range.from.row; row <= range.to.row; ++row) {
+            const auto* cell = sheet.GetCell({row, col});
+            column[row - range.from.row] = cell != nullptr ? cell->GetValue() : Value();
+        }
+        encoder.WriteColumn(column);
+    }
+    return out.GetSize();
+}
+
+ValueGrid ImportValues(const char* data, size_t size) {
+    Reader in(data, size);
+    for (const char magic : MAGIC) {
+        if (in.Byte() != static_cast<uint8_t>(magic)) {
+            throw std::invalid_argument("ImportValues: bad signature");
+        }
+    }
+    const uint64_t rows = in.Varint();
+    const uint64_t cols = in.Varint();
+    // каждый непустой столбец занимает хотя бы два байта (вид и длина отрезка)
+    if (rows > static_cast<uint64_t>(Position::MAX_ROWS) || cols > static_cast<uint64_t>(Position::MAX_COLS)
+        || (rows > 0 && cols > in.GetRemaining() / 2)) {
+        throw std::invalid_argument("ImportValues: bad size");
+    }
+    // Размеры из заголовка не проверены данными: память под таблицу выделяется,
+    // только когда поток разобран целиком.
+    Reader check = in;
+    ReadColumns(check, rows, cols, nullptr);
+
+    ValueGrid grid;
+    grid.size = {static_cast<int>(rows), static_cast<int>(cols)};
+    grid.values.resize(rows * cols);
+    ReadColumns(in, rows, cols, &grid);
+    return grid;
+}
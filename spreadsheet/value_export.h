@@ -0,0 +1,38 @@
+#pragma once
+
+#include "common.h"
+#include "sheet.h"
+
+#include <cstddef>
+#include <vector>
+
+struct ValueExportOptions {
+    // сворачивать повторы и арифметические прогрессии чисел в один отрезок
+    bool compress_runs = true;
+};
+
+// Двоичная выгрузка значений диапазона для передачи клиенту. Значения идут
+// по столбцам, столбец - последовательность типизированных отрезков: пустые
+// ячейки, числа (8 байт, без потери точности), строки (индексы словаря, новая
+// строка записывается при первой встрече), коды ошибок, а также повтор одного
+// значения и арифметическая прогрессия чисел. Формат описан в value_export.cpp.
+//
+// Пишет в buffer не больше capacity байт и возвращает полный размер выгрузки;
+// если он больше capacity, buffer нужно увеличить и вызвать снова. Неактуальные
+// ячейки диапазона вычисляются (Sheet::EvaluateRange).
+size_t ExportValues(const Sheet& sheet, const CellRange& range, char* buffer, size_t capacity,
+                    const ValueExportOptions& options = {});
+
+// Значения, прочитанные из выгрузки; пустая ячейка - пустая строка.
+struct ValueGrid {
+    Size size;
+    // по строкам: ячейка (row, col) - values[row * size.cols + col]
+    std::vector<CellInterface::Value> values;
+
+    const CellInterface::Value& Get(int row, int col) const {
+        return values[static_cast<size_t>(row) * size.cols + col];
+    }
+};
+
+// Разбирает выгрузку ExportValues; при ошибке формата бросает std::invalid_argument.
+ValueGrid ImportValues(const char* data, size_t size);
@@ -0,0 +1,260 @@
+#include "workbook.h"
+
+#include "sheet.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <future>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <unordered_set>
+
+namespace {
+// Имя листа, которое лексер формулы читает как префикс ссылки (Formula.g4: SHEET_NAME).
+bool IsValidSheetName(std::string_view name) {
+    if (name.empty() || !(std::isalpha(static_cast<unsigned char>(name[0])) || name[0] == '_')) {
+        return false;
+    }
+    return std::all_of(name.begin(), name.end(), [](char c) {
+        return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+    });
+}
+}  // namespace
+
+Workbook::Workbook() {
+}
+
+Workbook::~Workbook() {
+}
+
+Sheet& Workbook::AddSheet(std::string name) {
+    if (!IsValidSheetName(name)) {
+        throw std::invalid_argument("Invalid sheet name: " + name);
+    }
+    if (sheets_.count(name) > 0) {
+        throw std::invalid_argument("Sheet already exists: " + name);
+    }
+    auto sheet = std::make_unique<Sheet>();
+    sheet->workbook_ = this;
+    sheet->name_ = name;
+    Sheet& result = *sheet;
+    sheets_.emplace(name, std::move(sheet));
+
+    // формулы, ссылавшиеся на ещё не созданный лист, давали #REF!
+    auto waiting = dependents_.find(name);
+    if (waiting != dependents_.end()) {
+        for (const auto& [pos, dependents] : waiting->second) {
+            for (const auto& dependent : dependents) {
+                dependent.sheet->InvalidateFromSheet(dependent.pos);
+            }
+        }
+    }
+    return result;
+}
+
+Sheet* Workbook::GetSheet(std::string_view name) {
+    auto it = sheets_.find(name);
+    return it != sheets_.end() ? it->second.get() : nullptr;
+}
+
+const Sheet* Workbook::GetSheet(std::string_view name) const {
+    auto it = sheets_.find(name);
+    return it != sheets_.end() ? it->second.get() : nullptr;
+}
+
+std::vector<std::string> Workbook::GetSheetNames() const {
+    std::vector<std::string> names;
+    for (const auto& [name, sheet] : sheets_) {
+        names.push_back(name);
+    }
+    return names;
+}
+
+void Workbook::AddDependency(Sheet& sheet, Position from, const SheetPosition& to) {
+    dependents_[to.sheet][to.pos].push_back({&sheet, from});
+}
+
+void Workbook::RemoveDependency(Sheet& sheet, Position from, const SheetPosition& to) {
+    auto by_sheet = dependents_.find(to.sheet);
+    if (by_sheet == dependents_.end()) {
+        return;
+    }
+    auto by_pos = by_sheet->second.find(to.pos);
+    if (by_pos == by_sheet->second.end()) {
+        return;
+    }
+    auto& dependents = by_pos->second;
+    dependents.erase(std::remove_if(dependents.begin(), dependents.end(),
+                                    [&](const Dependent& dependent) {
+                                        return dependent.sheet == &sheet && dependent.pos == from;
+                                    }),
+                     dependents.end());
+    if (dependents.empty()) {
+        by_sheet->second.erase(by_pos);
+        if (by_sheet->second.empty()) {
+            dependents_.erase(by_sheet);
+        }
+    }
+}
+
+void Workbook::InvalidateDependents(const std::string& sheet, Position pos) {
+    auto by_sheet = dependents_.find(sheet);
+    if (by_sheet == dependents_.end()) {
+        return;
+    }
+    auto by_pos = by_sheet->second.find(pos);
+    if (by_pos == by_sheet->second.end()) {
+        return;
+    }
+    for (const auto& dependent : by_pos->second) {
+        dependent.sheet->InvalidateFromSheet(dependent.pos);
+    }
+}
+
+bool Workbook::HasCycle(const Sheet& changed, const ChangedLinks& changed_links,
+                        const std::vector<Position>& starts) const {
+    std::vector<std::pair<const Sheet*, Position>> roots;
+    for (const auto& pos : starts) {
+        roots.emplace_back(&changed, pos);
+    }
+    // цикл с переходом между листами входит в changed по ссылке на неё
+    auto by_sheet = dependents_.find(changed.name_);
+    if (by_sheet != dependents_.end()) {
+        for (const auto& [pos, dependents] : by_sheet->second) {
+            for (const auto& dependent : dependents) {
+                roots.emplace_back(dependent.sheet, dependent.pos);
+            }
+        }
+    }
+    if (roots.empty()) {
+        return false;
+    }
+
+    const auto get_links = [&](const Sheet& sheet, Position pos) {
+        Links links;
+        if (&sheet == &changed && changed_links(pos, links)) {
+            return links;
+        }
+        const auto* cell = static_cast<const Cell*>(sheet.GetCell(pos));
+        if (const auto* formula = cell != nullptr ? cell->GetFormula() : nullptr) {
+            links.cells = formula->GetReferencedCells();
+            links.sheets = formula->GetSheetReferences();
+        }
+        return links;
+    };
+    // обход в глубину без рекурсии, как в Sheet::HasCycle;
+    // 1 - ячейка на пути обхода, 2 - обработана
+    std::unordered_map<const Sheet*, CellMap<char>> state;
+    struct Frame {
+        const Sheet* sheet;
+        Position pos;
+        Links links;
+        size_t next = 0;
+    };
+    std::vector<Frame> stack;
+    for (const auto& [root_sheet, root] : roots) {
+        if (!root.IsValid() || state[root_sheet].count(root) != 0) {
+            continue;
+        }
+        state[root_sheet][root] = 1;
+        stack.push_back({root_sheet, root, get_links(*root_sheet, root)});
+        while (!stack.empty()) {
+            auto& frame = stack.back();
+            const size_t own = frame.links.cells.size();
+            if (frame.next == own + frame.links.sheets.size()) {
+                state[frame.sheet][frame.pos] = 2;
+                stack.pop_back();
+                continue;
+            }
+            const Sheet* next_sheet = frame.sheet;
+            Position next;
+            if (frame.next < own) {
+                next = frame.links.cells[frame.next++];
+            } else {
+                const auto& ref = frame.links.sheets[frame.next++ - own];
+                next_sheet = GetSheet(ref.sheet);
+                next = ref.pos;
+            }
+            if (next_sheet == nullptr || !next.IsValid()) {
+                continue;
+            }
+            auto& next_state = state[next_sheet][next];
+            if (next_state != 0) {
+                if (next_state == 1) {
+                    return true;
+                }
+                continue;
+            }
+            next_state = 1;
+            stack.push_back({next_sheet, next, get_links(*next_sheet, next)});
+        }
+    }
+    return false;
+}
+
+void Workbook::EvaluateAll(unsigned threads) const {
+    // листы по уровням: лист попадает в уровень, когда вычислены все листы,
+    // на которые он ссылается
+    std::unordered_map<const Sheet*, std::unordered_set<const Sheet*>> inputs;
+    for (const auto& [name, sheet] : sheets_) {
+        inputs[sheet.get()];
+    }
+    for (const auto& [name, by_pos] : dependents_) {
+        const Sheet* source = GetSheet(name);
+        if (source == nullptr) {
+            continue;
+        }
+        for (const auto& [pos, dependents] : by_pos) {
+            for (const auto& dependent : dependents) {
+                if (dependent.sheet != source) {
+                    inputs[dependent.sheet].insert(source);
+                }
+            }
+        }
+    }
+
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    while (!inputs.empty()) {
+        std::vector<const Sheet*> level;
+        for (const auto& [sheet, sheet_inputs] : inputs) {
+            if (sheet_inputs.empty()) {
+                level.push_back(sheet);
+            }
+        }
+        if (level.empty()) {
+            // листы ссылаются друг на друга по кругу (через разные ячейки):
+            // вычисляются по очереди, каждый дочитывает нужное из остальных
+            for (const auto& [sheet, sheet_inputs] : inputs) {
+                sheet->EvaluateAll();
+            }
+            return;
+        }
+        // листы уровня читают только уже вычисленные листы и друг друга не трогают
+        std::atomic<size_t> next {0};
+        const auto work = [&level, &next] {
+            for (size_t i = next++; i < level.size(); i = next++) {
+                level[i]->EvaluateAll();
+            }
+        };
+        std::vector<std::future<void>> workers;
+        for (size_t i = 1; i < std::min<size_t>(threads, level.size()); ++i) {
+            workers.push_back(std::async(std::launch::async, work));
+        }
+        work();
+        for (auto& worker : workers) {
+            worker.get();
+        }
+        for (const auto* sheet : level) {
+            inputs.erase(sheet);
+        }
+        for (auto& [sheet, sheet_inputs] : inputs) {
+            for (const auto* done : level) {
+                sheet_inputs.erase(done);
+            }
+        }
+    }
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "common.h"
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+class Sheet;
+
+// Книга из именованных листов. Формула листа ссылается на ячейку другого
+// листа как Лист2!A1; лист, которого нет, даёт #REF!. Правка ячейки сбрасывает
+// зависящие от неё ячейки всех листов, они пересчитываются при чтении или
+// в EvaluateAll (в режиме Eager подписчики листа узнают только о правках
+// самого листа).
+class Workbook {
+public:
+    Workbook();
+    ~Workbook();
+
+    // Имя листа: буква или '_', затем буквы, цифры и '_'. Если имени нет
+    // или лист с таким именем уже есть, бросается std::invalid_argument.
+    Sheet& AddSheet(std::string name);
+    // nullptr, если листа с таким именем нет.
+    Sheet* GetSheet(std::string_view name);
+    const Sheet* GetSheet(std::string_view name) const;
+    // По алфавиту.
+    std::vector<std::string> GetSheetNames() const;
+
+    // Вычисляет все неактуальные ячейки книги. Лист вычисляется после листов,
+    // на которые ссылается, независимые друг от друга листы - параллельно
+    // в threads потоках (0 - по числу ядер).
+    void EvaluateAll(unsigned threads = 0) const;
+
+private:
+    friend class Sheet;
+
+    struct Dependent {
+        Sheet* sheet;
+        Position pos;
+    };
+
+    // Граф зависимостей между листами: ячейка from листа sheet ссылается на to.
+    void AddDependency(Sheet& sheet, Position from, const SheetPosition& to);
+    void RemoveDependency(Sheet& sheet, Position from, const SheetPosition& to);
+    // Сбрасывает ячейки других листов, ссылающиеся на pos листа sheet.
+    void InvalidateDependents(const std::string& sheet, Position pos);
+
+    // Ссылки ячейки на свой лист и на другие листы книги.
+    struct Links {
+        std::vector<Position> cells;
+        std::vector<SheetPosition> sheets;
+    };
+    // Ссылки ячейки pos листа после правки; false - ячейка правкой не затронута.
+    using ChangedLinks = std::function<bool(Position pos, Links& links)>;
+    // Будет ли цикл с переходом между листами, если ссылки ячеек листа changed
+    // станут такими, как говорит changed_links. Обход начинается с ячеек,
+    // ссылающихся на changed, и с позиций starts листа changed (в них после
+    // правки стоят формулы со ссылками на листы).
+    bool HasCycle(const Sheet& changed, const ChangedLinks& changed_links, const std::vector<Position>& starts) const;
+
+    // упорядоченный словарь с поиском по string_view
+    std::map<std::string, std::unique_ptr<Sheet>, std::less<>> sheets_;
+    // ссылки на лист хранятся по имени: лист может появиться позже формулы
+    std::unordered_map<std::string, std::unordered_map<Position, std::vector<Dependent>, PositionHash>> dependents_;
+};